@@ -16,6 +16,12 @@ TEMPLATE = app
 
 SOURCES += \
     ../src/cartridge.cpp \
+    ../src/romimage.cpp \
+    ../src/savedatabase.cpp \
+    ../src/savewriter.cpp \
+    ../src/savestate.cpp \
+    ../src/bootcache.cpp \
+    ../src/rewind.cpp \
     ../src/cp15.cpp \
     ../src/cpu.cpp \
     ../src/cpuinstrs.cpp \
@@ -41,6 +47,8 @@ SOURCES += \
     ../src/disasm_arm.cpp \
     ../src/gpueng.cpp \
     ../src/gpu3d.cpp \
+    ../src/gpu3dmath.cpp \
+    ../src/guestmemory.cpp \
     ../src/armtable.cpp \
     ../src/emuthread.cpp \
     ../src/bios.cpp
@@ -50,6 +58,12 @@ DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000
 
 HEADERS += \
     ../src/cartridge.hpp \
+    ../src/romimage.hpp \
+    ../src/savedatabase.hpp \
+    ../src/savewriter.hpp \
+    ../src/savestate.hpp \
+    ../src/bootcache.hpp \
+    ../src/rewind.hpp \
     ../src/cp15.hpp \
     ../src/cpu.hpp \
     ../src/cpuinstrs.hpp \
@@ -74,6 +88,8 @@ HEADERS += \
     ../src/disassembler.hpp \
     ../src/gpueng.hpp \
     ../src/gpu3d.hpp \
+    ../src/gpu3dmath.hpp \
+    ../src/guestmemory.hpp \
     ../src/emuthread.hpp \
     ../src/bios.hpp
 
@@ -264,6 +264,7 @@ void Emulator::arm7_write_word(uint32_t address, uint32_t word)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         *(uint32_t*)&main_RAM[address & MAIN_RAM_MASK] = word;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= SHARED_WRAM_START && address < ARM7_WRAM_START)
@@ -412,6 +413,7 @@ void Emulator::arm7_write_halfword(uint32_t address, uint16_t halfword)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         *(uint16_t*)&main_RAM[address & MAIN_RAM_MASK] = halfword;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= SHARED_WRAM_START && address < ARM7_WRAM_START)
@@ -590,6 +592,7 @@ void Emulator::arm7_write_byte(uint32_t address, uint8_t byte)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         main_RAM[address & MAIN_RAM_MASK] = byte;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= ARM7_WRAM_START && address < IO_REGS_START)
@@ -684,3 +687,33 @@ void Emulator::arm7_write_byte(uint32_t address, uint8_t byte)
     printf("\n(7) Unrecognized byte write of $%02X to $%08X", byte, address);
     //exit(2);
 }
+
+uint8_t* Emulator::arm7_get_block(uint32_t address, uint32_t size)
+{
+    uint32_t end = address + size - 1;
+    if (address >= MAIN_RAM_START && end < SHARED_WRAM_START)
+        return get_mirrored_block(main_RAM, MAIN_RAM_MASK, address, size);
+    if (address >= ARM7_WRAM_START && end < IO_REGS_START)
+        return get_mirrored_block(arm7_WRAM, ARM7_WRAM_MASK, address, size);
+    if (address >= SHARED_WRAM_START && end < ARM7_WRAM_START)
+    {
+        switch (WRAMCNT)
+        {
+            case 0: //Mirror to ARM7 WRAM
+                return get_mirrored_block(arm7_WRAM, ARM7_WRAM_MASK, address, size);
+            case 1: //First half
+                return get_mirrored_block(shared_WRAM, 0x3FFF, address, size);
+            case 2: //Second half
+                return get_mirrored_block(shared_WRAM + 0x4000, 0x3FFF, address, size);
+            case 3: //Entire 32 KB
+                return get_mirrored_block(shared_WRAM, 0x7FFF, address, size);
+        }
+    }
+    return nullptr;
+}
+
+void Emulator::arm7_block_written(uint32_t address, uint32_t size)
+{
+    if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK], size);
+}
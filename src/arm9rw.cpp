@@ -376,6 +376,7 @@ void Emulator::arm9_write_word(uint32_t address, uint32_t word)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         *(uint32_t*)&main_RAM[address & MAIN_RAM_MASK] = word;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= SHARED_WRAM_START && address < IO_REGS_START)
@@ -622,11 +623,21 @@ void Emulator::arm9_write_word(uint32_t address, uint32_t word)
         case 0x04000304:
             gpu.set_POWCNT1(word & 0xFFFF);
             return;
+        case 0x04000340:
+            gpu.set_ALPHA_TEST_REF(word & 0xFFFF);
+            return;
         case 0x04000350:
             gpu.set_CLEAR_COLOR(word);
             return;
+        case 0x04000354:
+            gpu.set_CLEAR_DEPTH(word & 0xFFFF);
+            gpu.set_CLRIMAGE_OFFSET(word >> 16);
+            return;
         case 0x04000358:
-            //TODO: FOG_COLOR
+            gpu.set_FOG_COLOR(word);
+            return;
+        case 0x0400035C:
+            gpu.set_FOG_OFFSET(word & 0xFFFF);
             return;
         case 0x04000600:
             gpu.set_GXSTAT(word);
@@ -722,12 +733,18 @@ void Emulator::arm9_write_word(uint32_t address, uint32_t word)
         case 0x04001070:
             return;
     }
-    //TODO: EDGE_COLOR
     if (address >= 0x04000330 && address < 0x04000340)
+    {
+        gpu.set_EDGE_COLOR((address & 0xF) >> 1, word & 0xFFFF);
+        gpu.set_EDGE_COLOR(((address + 2) & 0xF) >> 1, word >> 16);
         return;
-    //TODO: FOG_TABLE
+    }
     if (address >= 0x04000360 && address < 0x04000380)
+    {
+        for (int i = 0; i < 4; i++)
+            gpu.set_FOG_TABLE((address + i) & 0x1F, (word >> (i * 8)) & 0xFF);
         return;
+    }
     if (address >= 0x04000380 && address < 0x040003C0)
     {
         gpu.set_TOON_TABLE((address & 0x3F) >> 1, word & 0xFFFF);
@@ -809,6 +826,7 @@ void Emulator::arm9_write_halfword(uint32_t address, uint16_t halfword)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         *(uint16_t*)&main_RAM[address & MAIN_RAM_MASK] = halfword;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= PALETTE_START && address < VRAM_BGA_START)
@@ -1058,16 +1076,22 @@ void Emulator::arm9_write_halfword(uint32_t address, uint16_t halfword)
             gpu.set_POWCNT1(halfword);
             return;
         case 0x04000340:
-            //TODO: ALPHA_TEST_REF
+            gpu.set_ALPHA_TEST_REF(halfword);
             return;
         case 0x04000354:
             gpu.set_CLEAR_DEPTH(halfword);
             return;
         case 0x04000356:
-            //TODO: CLRIMAGE_OFFSET
+            gpu.set_CLRIMAGE_OFFSET(halfword);
+            return;
+        case 0x04000358:
+            gpu.set_FOG_COLOR_lo(halfword);
+            return;
+        case 0x0400035A:
+            gpu.set_FOG_COLOR_hi(halfword);
             return;
         case 0x0400035C:
-            //TODO: FOG_OFFSET
+            gpu.set_FOG_OFFSET(halfword);
             return;
         case 0x04001000:
             gpu.set_DISPCNT_B_lo(halfword);
@@ -1166,9 +1190,17 @@ void Emulator::arm9_write_halfword(uint32_t address, uint16_t halfword)
             gpu.set_MASTER_BRIGHT_B(halfword);
             return;
     }
-    //TODO: EDGE_COLOR
     if (address >= 0x04000330 && address < 0x04000340)
+    {
+        gpu.set_EDGE_COLOR((address & 0xF) >> 1, halfword);
+        return;
+    }
+    if (address >= 0x04000360 && address < 0x04000380)
+    {
+        gpu.set_FOG_TABLE(address & 0x1F, halfword & 0xFF);
+        gpu.set_FOG_TABLE((address + 1) & 0x1F, halfword >> 8);
         return;
+    }
     if (address >= 0x04000380 && address < 0x040003C0)
     {
         gpu.set_TOON_TABLE((address & 0x3F) >> 1, halfword);
@@ -1187,6 +1219,7 @@ void Emulator::arm9_write_byte(uint32_t address, uint8_t byte)
     if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
     {
         main_RAM[address & MAIN_RAM_MASK] = byte;
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK]);
         return;
     }
     if (address >= PALETTE_START && address < VRAM_BGA_START)
@@ -1253,6 +1286,11 @@ void Emulator::arm9_write_byte(uint32_t address, uint8_t byte)
             gpu.set_BLDY_B(byte);
             return;
     }
+    if (address >= 0x04000360 && address < 0x04000380)
+    {
+        gpu.set_FOG_TABLE(address & 0x1F, byte);
+        return;
+    }
     if (address >= PALETTE_START && address < GBA_ROM_START)
     {
         printf("\nWarning: 8-bit write to VRAM $%08X", address);
@@ -1261,3 +1299,40 @@ void Emulator::arm9_write_byte(uint32_t address, uint8_t byte)
     printf("\n(9) Unrecognized byte write of $%02X to $%08X", byte, address);
     //exit(1);
 }
+
+uint8_t* Emulator::arm9_get_block(uint32_t address, uint32_t size)
+{
+    uint32_t end = address + size - 1;
+    if (address >= MAIN_RAM_START && end < SHARED_WRAM_START)
+        return get_mirrored_block(main_RAM, MAIN_RAM_MASK, address, size);
+    if (address >= SHARED_WRAM_START && end < IO_REGS_START)
+    {
+        switch (WRAMCNT)
+        {
+            case 0: //Entire 32 KB
+                return get_mirrored_block(shared_WRAM, 0x7FFF, address, size);
+            case 1: //Second half
+                return get_mirrored_block(shared_WRAM + 0x4000, 0x3FFF, address, size);
+            case 2: //First half
+                return get_mirrored_block(shared_WRAM, 0x3FFF, address, size);
+            case 3: //Undefined memory
+                return nullptr;
+        }
+    }
+    if (address >= PALETTE_START && end < VRAM_BGA_START)
+        return gpu.get_palette_block(address, size);
+    if (address >= VRAM_LCDC_A && end < VRAM_LCDC_END)
+        return gpu.get_lcdc_block(address, size);
+    if (address >= OAM_START && end < GBA_ROM_START)
+        return gpu.get_OAM_block(address, size);
+    return nullptr;
+}
+
+//Lets the GPU and dirty tracking know about a block written through arm9_get_block
+void Emulator::arm9_block_written(uint32_t address, uint32_t size)
+{
+    if (address >= MAIN_RAM_START && address < SHARED_WRAM_START)
+        memory.mark_dirty(&main_RAM[address & MAIN_RAM_MASK], size);
+    if (address >= VRAM_LCDC_A && address < VRAM_LCDC_END)
+        gpu.lcdc_block_written(address, size);
+}
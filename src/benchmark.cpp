@@ -0,0 +1,676 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "config.hpp"
+#include "emulator.hpp"
+
+using namespace std;
+
+//Microbenchmarks for the hot paths of the core. Each one runs on a fresh emulator with no BIOS, firmware or ROM,
+//against fixtures built through the same register and memory writes a game would use.
+//Results are printed as JSON, in a fixed order, so they can be compared between commits.
+
+#define BENCHMARK_SAMPLES 7
+
+struct Benchmark_Result
+{
+    string name;
+    string unit;
+    uint64_t ops;
+    double median_ns;
+    double min_ns;
+};
+
+static vector<Benchmark_Result> results;
+
+//Keeps the compiler from throwing away reads whose values are never used
+static volatile uint32_t sink;
+
+//Times a benchmark that does ops units of work per run, after one untimed run to warm caches
+template <typename Func>
+static void measure(const char* name, const char* unit, uint64_t ops, Func run)
+{
+    run();
+    vector<double> ns_per_op;
+    for (int i = 0; i < BENCHMARK_SAMPLES; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        run();
+        auto end = chrono::steady_clock::now();
+        ns_per_op.push_back(chrono::duration<double, nano>(end - start).count() / ops);
+    }
+    sort(ns_per_op.begin(), ns_per_op.end());
+
+    Benchmark_Result result;
+    result.name = name;
+    result.unit = unit;
+    result.ops = ops;
+    result.median_ns = ns_per_op[BENCHMARK_SAMPLES / 2];
+    result.min_ns = ns_per_op[0];
+    results.push_back(result);
+}
+
+static void print_results()
+{
+    printf("{\n    \"samples\": %d,\n    \"benchmarks\": [\n", BENCHMARK_SAMPLES);
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        const Benchmark_Result& result = results[i];
+        printf("        {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, "
+               "\"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, \"ops_per_sec\": %.0f}%s\n",
+               result.name.c_str(), result.unit.c_str(), (unsigned long long)result.ops,
+               result.median_ns, result.min_ns, 1000000000.0 / result.median_ns,
+               (i + 1 < results.size()) ? "," : "");
+    }
+    printf("    ]\n}\n");
+}
+
+static Emulator* create_emulator()
+{
+    Emulator* e = new Emulator();
+    e->init();
+    e->power_on();
+    return e;
+}
+
+//Deterministic filler for VRAM, palettes and OAM
+static uint32_t next_random(uint32_t& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) | (seed << 16);
+}
+
+static void fill_words(Emulator* e, uint32_t address, uint32_t size, uint32_t seed)
+{
+    for (uint32_t i = 0; i < size; i += 4)
+        e->arm9_write_word(address + i, next_random(seed));
+}
+
+//Advances the display one scanline without drawing it. Reaching VBLANK ends the 3D frame.
+static void step_scanline(GPU* gpu)
+{
+    SchedulerEvent event;
+    event.id = 1;
+    gpu->handle_event(event);
+}
+
+static void step_to_VBLANK(GPU* gpu)
+{
+    do
+    {
+        step_scanline(gpu);
+    } while (gpu->get_VCOUNT() != SCANLINES);
+}
+
+/**
+  * Interpreter
+  */
+
+static void bench_interpreter()
+{
+    const int INSTRUCTIONS = 1000000;
+    Emulator* e = create_emulator();
+    ARM_CPU* arm9 = e->get_arm9();
+
+    //ALU, multiply, load and store in a loop, with the data at 0x02100000
+    const uint32_t arm_code[] =
+    {
+        0xE3A05402, //mov r5, #0x02000000
+        0xE2855601, //add r5, r5, #0x00100000
+        0xE3A00000, //mov r0, #0
+        0xE2800001, //loop: add r0, r0, #1
+        0xE0201180, //eor r1, r0, r0, lsl #3
+        0xE1812000, //orr r2, r1, r0
+        0xE0423001, //sub r3, r2, r1
+        0xE0040190, //mul r4, r0, r1
+        0xE5854004, //str r4, [r5, #4]
+        0xE5956004, //ldr r6, [r5, #4]
+        0xEAFFFFF7  //b loop
+    };
+    const uint16_t thumb_code[] =
+    {
+        0x2000, //movs r0, #0
+        0x3001, //loop: adds r0, #1
+        0x00C1, //lsls r1, r0, #3
+        0x4041, //eors r1, r0
+        0x430A, //orrs r2, r1
+        0x1A53, //subs r3, r2, r1
+        0x4341, //muls r1, r0
+        0x6069, //str r1, [r5, #4]
+        0x686E, //ldr r6, [r5, #4]
+        0xE7F6  //b loop
+    };
+    for (unsigned int i = 0; i < sizeof(arm_code) / sizeof(arm_code[0]); i++)
+        e->arm9_write_word(0x02000000 + i * 4, arm_code[i]);
+    for (unsigned int i = 0; i < sizeof(thumb_code) / sizeof(thumb_code[0]); i++)
+        e->arm9_write_halfword(0x02000400 + i * 2, thumb_code[i]);
+
+    arm9->jp(0x02000000, true);
+    measure("interpreter/arm", "instruction", INSTRUCTIONS, [&]
+    {
+        for (int i = 0; i < INSTRUCTIONS; i++)
+            arm9->execute();
+    });
+
+    arm9->set_register(5, 0x02100000);
+    arm9->jp(0x02000401, true);
+    measure("interpreter/thumb", "instruction", INSTRUCTIONS, [&]
+    {
+        for (int i = 0; i < INSTRUCTIONS; i++)
+            arm9->execute();
+    });
+    delete e;
+}
+
+/**
+  * Memory bus
+  */
+
+static void bench_memory()
+{
+    const int READS = 1 << 20;
+    Emulator* e = create_emulator();
+
+    //Shared WRAM all to the ARM9, VRAM A as engine A BG, VRAM B in LCDC mode
+    e->arm9_write_byte(0x04000247, 0);
+    e->arm9_write_byte(0x04000240, 0x81);
+    e->arm9_write_byte(0x04000241, 0x80);
+
+    struct Region
+    {
+        const char* name;
+        uint32_t start, size;
+    };
+    const Region regions[] =
+    {
+        {"memory/bios", 0xFFFF0000, 0x1000},
+        {"memory/main_ram", 0x02000000, 0x10000},
+        {"memory/shared_wram", 0x03000000, 0x8000},
+        {"memory/palette", 0x05000000, 0x800},
+        {"memory/vram_bg", 0x06000000, 0x10000},
+        {"memory/vram_lcdc", 0x06820000, 0x10000},
+        {"memory/oam", 0x07000000, 0x800},
+        {"memory/gba_slot", 0x08000000, 0x10000}
+    };
+
+    for (unsigned int r = 0; r < sizeof(regions) / sizeof(regions[0]); r++)
+    {
+        const Region& region = regions[r];
+        measure(region.name, "read", READS, [&]
+        {
+            uint32_t sum = 0;
+            for (int i = 0; i < READS; i++)
+                sum += e->arm9_read_word(region.start + ((i * 4) & (region.size - 1)));
+            sink = sum;
+        });
+    }
+
+    //Registers without read side effects, from the display, DMA, IPC, interrupt, math and 3D blocks
+    const uint32_t IO_regs[] =
+    {
+        0x04000000, 0x04000064, 0x040000B0, 0x040000B8, 0x04000180, 0x04000208,
+        0x04000210, 0x04000214, 0x04000240, 0x04000290, 0x040002A0, 0x04000600
+    };
+    const int IO_count = sizeof(IO_regs) / sizeof(IO_regs[0]);
+    measure("memory/io", "read", READS, [&]
+    {
+        uint32_t sum = 0;
+        for (int i = 0; i < READS; i++)
+            sum += e->arm9_read_word(IO_regs[i % IO_count]);
+        sink = sum;
+    });
+    delete e;
+}
+
+/**
+  * 2D engine
+  */
+
+//Draws a frame of engine A scanlines, stepping VCOUNT through VBLANK so the affine registers are latched
+static void draw_2D_frame(GPU* gpu, GPU_2D_Engine* eng)
+{
+    for (int line = 0; line < 263; line++)
+    {
+        if (gpu->get_VCOUNT() < SCANLINES)
+            eng->draw_scanline();
+        step_scanline(gpu);
+    }
+}
+
+static void setup_2D_VRAM(Emulator* e)
+{
+    //VRAM A as engine A BG, VRAM B as engine A OBJ
+    e->arm9_write_byte(0x04000240, 0x81);
+    e->arm9_write_byte(0x04000241, 0x82);
+    fill_words(e, 0x06000000, 0x20000, 1);
+    fill_words(e, 0x06400000, 0x20000, 2);
+    fill_words(e, 0x05000000, 0x400, 3);
+}
+
+//128 sprites of every size, some of them 256-color
+static void setup_2D_sprites(Emulator* e)
+{
+    uint32_t seed = 4;
+    for (int i = 0; i < 128; i++)
+    {
+        uint32_t random = next_random(seed);
+        uint16_t attr0 = (random & 0xFF) | ((i & 0x3) == 3 ? 0 : (i & 0x3) << 14) | ((i & 0x4) << 11);
+        uint16_t attr1 = ((random >> 8) & 0x1FF) | (((i >> 3) & 0x3) << 14);
+        uint16_t attr2 = ((random >> 17) & 0x3FF) | ((i & 0x3) << 10) | ((i & 0xF) << 12);
+        e->arm9_write_halfword(0x07000000 + i * 8, attr0);
+        e->arm9_write_halfword(0x07000002 + i * 8, attr1);
+        e->arm9_write_halfword(0x07000004 + i * 8, attr2);
+    }
+}
+
+static void bench_2D()
+{
+    const int LINES = SCANLINES * 4;
+    Emulator* e = create_emulator();
+    GPU* gpu = e->get_gpu();
+    GPU_2D_Engine* eng = gpu->get_engine(true);
+    setup_2D_VRAM(e);
+    setup_2D_sprites(e);
+
+    //Mode 0: four scrolled text BGs of different sizes and color depths, with alpha blending
+    e->arm9_write_word(0x04000000, 0x00010F00);
+    e->arm9_write_word(0x04000008, 0x1C00 | (0x1D81 << 16));
+    e->arm9_write_word(0x0400000C, 0xDE02 | (0x5883 << 16));
+    e->arm9_write_word(0x04000010, 17 | (5 << 16));
+    e->arm9_write_word(0x04000014, 200 | (31 << 16));
+    e->arm9_write_word(0x04000018, 301 | (77 << 16));
+    e->arm9_write_word(0x0400001C, 3 | (250 << 16));
+    e->arm9_write_word(0x04000050, 0x3E41 | (0x0808 << 16));
+    measure("2d/text", "scanline", LINES, [&]
+    {
+        for (int frame = 0; frame < LINES / SCANLINES; frame++)
+            draw_2D_frame(gpu, eng);
+    });
+
+    //Mode 5: a rotated and scaled direct color bitmap over a 256-color bitmap
+    e->arm9_write_word(0x04000000, 0x00010C05);
+    e->arm9_write_word(0x0400000C, 0x4482 | (0x4087 << 16));
+    e->arm9_write_word(0x04000020, 0x0100 | (0x0000 << 16));
+    e->arm9_write_word(0x04000024, 0x0000 | (0x0100 << 16));
+    e->arm9_write_word(0x04000030, 0x00DD | (0x0080 << 16));
+    e->arm9_write_word(0x04000034, 0xFF80 | (0x00DD << 16));
+    e->arm9_write_word(0x04000038, 0x1000);
+    e->arm9_write_word(0x0400003C, 0x0800);
+    e->arm9_write_word(0x04000050, 0);
+    measure("2d/bitmap", "scanline", LINES, [&]
+    {
+        for (int frame = 0; frame < LINES / SCANLINES; frame++)
+            draw_2D_frame(gpu, eng);
+    });
+
+    //Sprites only, with 1D tile mapping
+    e->arm9_write_word(0x04000000, 0x00011010);
+    measure("2d/sprites", "scanline", LINES, [&]
+    {
+        for (int frame = 0; frame < LINES / SCANLINES; frame++)
+            draw_2D_frame(gpu, eng);
+    });
+    delete e;
+}
+
+/**
+  * Geometry commands
+  */
+
+//Builds a GXFIFO stream, packing up to four commands into each command word like the SDK does
+class GX_Stream
+{
+    private:
+        vector<uint8_t> commands;
+        vector<vector<uint32_t>> params;
+    public:
+        void add(uint8_t command, initializer_list<uint32_t> command_params = {});
+        vector<uint32_t> pack();
+};
+
+void GX_Stream::add(uint8_t command, initializer_list<uint32_t> command_params)
+{
+    commands.push_back(command);
+    params.push_back(vector<uint32_t>(command_params));
+}
+
+vector<uint32_t> GX_Stream::pack()
+{
+    vector<uint32_t> words;
+    for (unsigned int i = 0; i < commands.size(); i += 4)
+    {
+        unsigned int count = min((unsigned int)commands.size() - i, 4U);
+        uint32_t command_word = 0;
+        for (unsigned int j = 0; j < count; j++)
+            command_word |= commands[i + j] << (j * 8);
+        words.push_back(command_word);
+        for (unsigned int j = 0; j < count; j++)
+            words.insert(words.end(), params[i + j].begin(), params[i + j].end());
+    }
+    return words;
+}
+
+static uint32_t vtx_xy(int x, int y)
+{
+    return (uint16_t)x | ((uint32_t)(uint16_t)y << 16);
+}
+
+static uint32_t rgb(int r, int g, int b)
+{
+    return r | (g << 5) | (b << 10);
+}
+
+static uint32_t texcoord(int s, int t)
+{
+    return (uint16_t)(s << 4) | ((uint32_t)(uint16_t)(t << 4) << 16);
+}
+
+static uint32_t pack_10(int x, int y, int z)
+{
+    return (x & 0x3FF) | ((y & 0x3FF) << 10) | ((z & 0x3FF) << 20);
+}
+
+//Feeds words to GXFIFO, letting the geometry engine catch up whenever the FIFO fills
+static void feed_GXFIFO(Emulator* e, const vector<uint32_t>& words)
+{
+    unsigned int pos = 0;
+    while (pos < words.size())
+    {
+        int consumed = e->write_GXFIFO_block(&words[pos], words.size() - pos);
+        pos += consumed;
+        if (!consumed)
+            e->get_arm9()->add_internal_cycles(0x1000);
+    }
+    e->get_arm9()->add_internal_cycles(0x100000);
+    e->get_gpu()->run_3D();
+}
+
+static void add_lighting(GX_Stream& stream)
+{
+    stream.add(0x30, {rgb(20, 20, 20) | (rgb(6, 6, 6) << 16) | (1 << 15)});
+    stream.add(0x31, {rgb(31, 31, 31) | (rgb(2, 2, 2) << 16)});
+    stream.add(0x32, {pack_10(0, 0, -511)});
+    stream.add(0x33, {rgb(31, 31, 31)});
+    stream.add(0x32, {pack_10(200, -200, -300) | (1u << 30)});
+    stream.add(0x33, {rgb(31, 10, 10) | (1u << 30)});
+}
+
+//Objects as a game would send them: a matrix setup, then lit and textured triangle strips
+static vector<uint32_t> build_GX_stream()
+{
+    GX_Stream stream;
+    stream.add(0x60, {0xBFFF0000});
+    stream.add(0x10, {0});
+    stream.add(0x15);
+    stream.add(0x10, {2});
+    stream.add(0x15);
+    add_lighting(stream);
+    for (int object = 0; object < 48; object++)
+    {
+        stream.add(0x11);
+        stream.add(0x1C, {(uint32_t)((object % 8) * 0x100 - 0x380), (uint32_t)((object / 8) * 0x100 - 0x300), 0});
+        stream.add(0x18, {0x0F80, 0x0100, 0, 0, (uint32_t)-0x0100, 0x0F80, 0, 0, 0, 0, 0x1000, 0,
+                          0, 0, 0, 0x1000});
+        stream.add(0x29, {0xC3u | (31 << 16) | ((object & 0x3F) << 24)});
+        stream.add(0x2A, {(3 << 20) | (3 << 23) | (3 << 26) | (1 << 16) | (1 << 17)});
+        stream.add(0x40, {2});
+        for (int i = 0; i < 16; i++)
+        {
+            stream.add(0x21, {pack_10(i * 20 - 160, 100, -400)});
+            stream.add(0x22, {texcoord(i * 4, (i & 1) * 32)});
+            stream.add(0x23, {vtx_xy(i * 0x10 - 0x80, (i & 1) * 0x80 - 0x40), (uint16_t)-0x100});
+        }
+        stream.add(0x41);
+        stream.add(0x12, {1});
+    }
+    stream.add(0x50, {0});
+    return stream.pack();
+}
+
+static void setup_texture_VRAM(Emulator* e)
+{
+    //Fill VRAM A and E through LCDC, then map them as texture image and palette slot 0
+    e->arm9_write_byte(0x04000240, 0x80);
+    e->arm9_write_byte(0x04000244, 0x80);
+    fill_words(e, 0x06800000, 0x20000, 5);
+    fill_words(e, 0x06880000, 0x10000, 6);
+    e->arm9_write_byte(0x04000240, 0x83);
+    e->arm9_write_byte(0x04000244, 0x83);
+}
+
+static void bench_GX()
+{
+    Emulator* e = create_emulator();
+    GPU* gpu = e->get_gpu();
+    setup_texture_VRAM(e);
+    vector<uint32_t> words = build_GX_stream();
+
+    //Each run ends with SWAP_BUFFERS, and VBLANK hands the polygons to the renderer so the next run starts empty
+    measure("gx/lit_textured_strips", "word", words.size(), [&]
+    {
+        feed_GXFIFO(e, words);
+        step_to_VBLANK(gpu);
+    });
+    delete e;
+}
+
+/**
+  * 3D rasterization
+  */
+
+static void add_quad(GX_Stream& stream, int x0, int y0, int x1, int y1, int z, int tex_size)
+{
+    stream.add(0x40, {1});
+    stream.add(0x20, {rgb(31, 0, 0)});
+    stream.add(0x22, {texcoord(0, 0)});
+    stream.add(0x23, {vtx_xy(x0, y0), (uint16_t)z});
+    stream.add(0x20, {rgb(0, 31, 0)});
+    stream.add(0x22, {texcoord(tex_size, 0)});
+    stream.add(0x23, {vtx_xy(x1, y0), (uint16_t)z});
+    stream.add(0x20, {rgb(0, 0, 31)});
+    stream.add(0x22, {texcoord(tex_size, tex_size)});
+    stream.add(0x23, {vtx_xy(x1, y1), (uint16_t)z});
+    stream.add(0x20, {rgb(31, 31, 31)});
+    stream.add(0x22, {texcoord(0, tex_size)});
+    stream.add(0x23, {vtx_xy(x0, y1), (uint16_t)z});
+    stream.add(0x41);
+}
+
+//A screen of overlapping textured and gouraud quads, with translucent quads on top
+static vector<uint32_t> build_3D_scene()
+{
+    GX_Stream stream;
+    stream.add(0x60, {0xBFFF0000});
+    stream.add(0x10, {0});
+    stream.add(0x15);
+    stream.add(0x10, {2});
+    stream.add(0x15);
+
+    const int formats[] = {3, 4, 2, 7};
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+        {
+            int cell = y * 8 + x;
+            int format = formats[cell & 0x3];
+            stream.add(0x29, {0xC0u | (31 << 16) | ((cell & 0x3F) << 24)});
+            if (cell % 5 == 4)
+                stream.add(0x2A, {0});
+            else
+                stream.add(0x2A, {(uint32_t)((cell * 0x800) >> 3) | (3 << 20) | (3 << 23) | (format << 26) |
+                                  (1 << 16) | (1 << 17)});
+            stream.add(0x2B, {(uint32_t)cell});
+            int x0 = x * 0x400 - 0x1000, y0 = y * 0x400 - 0x1000;
+            add_quad(stream, x0 - 0x100, y0 - 0x100, x0 + 0x500, y0 + 0x500, -0x100 - cell, 64);
+        }
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        int x0 = (i % 4) * 0x800 - 0x1000, y0 = (i / 4) * 0x800 - 0x1000;
+        stream.add(0x29, {0xC0u | (12 << 16) | ((i + 1) << 24)});
+        stream.add(0x2A, {0});
+        add_quad(stream, x0, y0, x0 + 0x600, y0 + 0x600, -0x400 - i * 0x10, 0);
+    }
+    stream.add(0x50, {0});
+    return stream.pack();
+}
+
+static void bench_3D()
+{
+    const int LINES = SCANLINES * 4;
+    Emulator* e = create_emulator();
+    GPU* gpu = e->get_gpu();
+    setup_texture_VRAM(e);
+
+    //Texture mapping and alpha blending on, with a cleared depth buffer
+    e->arm9_write_halfword(0x04000060, 0x0009);
+    e->arm9_write_word(0x04000350, rgb(4, 4, 8) | (31 << 16));
+    e->arm9_write_halfword(0x04000354, 0x7FFF);
+
+    //Submit the scene, then pass VBLANK once so it becomes the frame being rendered
+    feed_GXFIFO(e, build_3D_scene());
+    step_to_VBLANK(gpu);
+
+    //Every VBLANK after this renders the same polygons again
+    static uint32_t framebuffer[PIXELS_PER_LINE * SCANLINES];
+    uint8_t bg_priorities[PIXELS_PER_LINE];
+    measure("3d/render_scanline", "scanline", LINES, [&]
+    {
+        for (int frame = 0; frame < LINES / SCANLINES; frame++)
+        {
+            for (int line = 0; line < 263; line++)
+            {
+                if (gpu->get_VCOUNT() < SCANLINES)
+                    gpu->draw_3D_scanline(framebuffer, bg_priorities, 0);
+                step_scanline(gpu);
+            }
+        }
+    });
+    delete e;
+}
+
+/**
+  * DMA
+  */
+
+static void run_DMA(Emulator* e, uint32_t source, uint32_t dest, uint32_t CNT)
+{
+    e->arm9_write_word(0x040000B0, source);
+    e->arm9_write_word(0x040000B4, dest);
+    e->arm9_write_word(0x040000B8, CNT);
+
+    SchedulerEvent event;
+    event.id = 0;
+    event.processing = true;
+    e->get_dma()->handle_event(event);
+}
+
+static void bench_DMA()
+{
+    const int WORDS = 0x4000;
+    Emulator* e = create_emulator();
+    e->arm9_write_byte(0x04000240, 0x80);
+    fill_words(e, 0x02000000, WORDS * 4, 7);
+
+    //Immediate timing, enabled, with the source and destination incrementing unless noted
+    const uint32_t START = 1u << 31;
+    const uint32_t WORD_TRANSFER = 1 << 26;
+    const uint32_t FIXED_SOURCE = 2 << 23;
+    measure("dma/main_ram_copy_32", "word", WORDS, [&]
+    {
+        run_DMA(e, 0x02000000, 0x02100000, START | WORD_TRANSFER | WORDS);
+    });
+    measure("dma/main_ram_copy_16", "halfword", WORDS, [&]
+    {
+        run_DMA(e, 0x02000000, 0x02100000, START | WORDS);
+    });
+    measure("dma/main_ram_to_vram", "word", WORDS, [&]
+    {
+        run_DMA(e, 0x02000000, 0x06800000, START | WORD_TRANSFER | WORDS);
+    });
+    measure("dma/fill_32", "word", WORDS, [&]
+    {
+        run_DMA(e, 0x02000000, 0x02100000, START | WORD_TRANSFER | FIXED_SOURCE | WORDS);
+    });
+    delete e;
+}
+
+struct Benchmark_Suite
+{
+    const char* name;
+    void (*run)();
+};
+
+static const Benchmark_Suite suites[] =
+{
+    {"interpreter", bench_interpreter},
+    {"memory", bench_memory},
+    {"2d", bench_2D},
+    {"gx", bench_GX},
+    {"3d", bench_3D},
+    {"dma", bench_DMA}
+};
+
+static const int suite_count = sizeof(suites) / sizeof(suites[0]);
+
+int main(int argc, char* argv[])
+{
+    Config::direct_boot_enabled = false;
+    Config::boot_cache_enabled = false;
+    Config::threaded_3D = false;
+    Config::frameskip = 0;
+    Config::rewind_enabled = false;
+    Config::run_ahead_frames = 0;
+    Config::hle_bios = false;
+
+    //With no arguments every suite runs
+    vector<const Benchmark_Suite*> selected;
+    for (int i = 1; i < argc; i++)
+    {
+        const Benchmark_Suite* suite = nullptr;
+        for (int j = 0; j < suite_count; j++)
+        {
+            if (!strcmp(argv[i], suites[j].name))
+                suite = &suites[j];
+        }
+        if (!suite)
+        {
+            fprintf(stderr, "Unknown benchmark suite %s. Suites are:", argv[i]);
+            for (int j = 0; j < suite_count; j++)
+                fprintf(stderr, " %s", suites[j].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+        selected.push_back(suite);
+    }
+    if (!selected.size())
+    {
+        for (int i = 0; i < suite_count; i++)
+            selected.push_back(&suites[i]);
+    }
+
+    //The core logs to stdout, so that goes to stderr while the suites run to keep the JSON clean
+    fflush(stdout);
+    int json_fd = dup(fileno(stdout));
+    dup2(fileno(stderr), fileno(stdout));
+    for (unsigned int i = 0; i < selected.size(); i++)
+        selected[i]->run();
+    fflush(stdout);
+    dup2(json_fd, fileno(stdout));
+    close(json_fd);
+
+    print_results();
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "bootcache.hpp"
+#include "savestate.hpp"
+
+using namespace std;
+
+Boot_Cache::Boot_Cache()
+{
+    reset_key();
+}
+
+void Boot_Cache::reset_key()
+{
+    key = 14695981039346656037ULL;
+}
+
+void Boot_Cache::add_to_key(const uint8_t* data, uint64_t size)
+{
+    for (uint64_t i = 0; i < size; i++)
+    {
+        key ^= data[i];
+        key *= 1099511628211ULL;
+    }
+}
+
+//Returns false when there is no snapshot for the current key
+bool Boot_Cache::load(const string& file_name, Save_State& state)
+{
+    ifstream file(file_name, ios::binary | ios::in | ios::ate);
+    if (!file.is_open())
+        return false;
+    uint64_t file_size = file.tellg();
+    file.seekg(0, ios::beg);
+
+    Boot_Cache_Header header;
+    if (file_size < sizeof(header))
+        return false;
+    file.read((char*)&header, sizeof(header));
+    if (memcmp(header.magic, "CDSB", 4) || header.version != BOOT_CACHE_VERSION || header.key != key ||
+            header.state_size != file_size - sizeof(header))
+        return false;
+
+    state.set_size(header.state_size);
+    file.read((char*)state.get_writable(), header.state_size);
+    if (!file)
+    {
+        printf("Failed to read boot snapshot %s\n", file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+void Boot_Cache::save(const string& file_name, Save_State& state)
+{
+    Boot_Cache_Header header;
+    memcpy(header.magic, "CDSB", 4);
+    header.version = BOOT_CACHE_VERSION;
+    header.key = key;
+    header.state_size = state.get_size();
+
+    ofstream file(file_name, ios::binary | ios::out | ios::trunc);
+    if (!file.is_open())
+    {
+        printf("Unable to write boot snapshot %s\n", file_name.c_str());
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)state.get_data(), state.get_size());
+    file.close();
+
+    //A partial snapshot would be rejected by its size anyway, but there's no reason to keep it around
+    if (file.fail())
+    {
+        printf("Unable to write boot snapshot %s\n", file_name.c_str());
+        remove(file_name.c_str());
+    }
+}
@@ -0,0 +1,47 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef bootcache_hpp
+#define bootcache_hpp
+#include <cstdint>
+#include <string>
+
+#define BOOT_CACHE_VERSION 1
+
+class Save_State;
+
+//Start of a boot snapshot file. The save state follows directly after it.
+struct Boot_Cache_Header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t state_size;
+};
+
+//Snapshot of the emulator at the moment the game reaches its entry point, written next to the ROM as <ROM>.boot.
+//The key is a hash of everything the boot depends on, so a snapshot made with other BIOS, firmware or settings is ignored.
+class Boot_Cache
+{
+    private:
+        uint64_t key;
+    public:
+        Boot_Cache();
+
+        void reset_key();
+        void add_to_key(const uint8_t* data, uint64_t size);
+        uint64_t get_key();
+
+        bool load(const std::string& file_name, Save_State& state);
+        void save(const std::string& file_name, Save_State& state);
+};
+
+inline uint64_t Boot_Cache::get_key()
+{
+    return key;
+}
+
+#endif /* bootcache_hpp */
@@ -4,12 +4,14 @@
     See LICENSE.txt for details
 */
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <string>
 #include "cartridge.hpp"
 #include "config.hpp"
 #include "emulator.hpp"
+#include "savestate.hpp"
 
 using namespace std;
 
@@ -110,8 +112,10 @@ void NDS_Cart::power_on()
 {
     save_size = 1024 * 1024;
     save_type = 2;
-    cycles_left = 8;
-    bytes_left = 0;
+    word_cycles = 20;
+    block_words = 0;
+    block_index = 0;
+    block_has_data = false;
     ROMCTRL.word_ready = true;
     ROMCTRL.block_busy = false;
     cmd_encrypt_mode = 0;
@@ -121,11 +125,13 @@ void NDS_Cart::power_on()
     AUXSPICNT.IRQ_after_transfer = false;
     AUXSPICNT.enabled = false;
 
-    memset(SPI_save, 0, 1024 * 64);
-    dirty_save = false;
+    //Finish writing the previous game's save before it is replaced
+    save_writer.flush();
+    SPI_save.assign(save_size, 0);
+    dirty_start = 0;
+    dirty_end = 0;
 
-    if (ROM)
-        ROM = nullptr;
+    ROM.close();
 
     ROM_name = "";
 
@@ -134,39 +140,83 @@ void NDS_Cart::power_on()
     spi_params = 0;
 }
 
-int NDS_Cart::load_database(string file_name)
+void NDS_Cart::do_state(Save_State& state)
 {
-    save_database = nullptr;
-    database_size = 0;
-    ifstream file(file_name, ios::binary | ios::in);
-    if (!file.is_open())
+    state.begin_chunk("CART", 1);
+
+    //States only load into the game they were made with
+    uint8_t header[16], state_header[16];
+    ROM.read(0, header, sizeof(header));
+    memcpy(state_header, header, sizeof(header));
+    state.sync(state_header);
+    if (state.is_loading() && memcmp(header, state_header, sizeof(header)))
     {
-        printf("Failed to load save database.\n");
-        return 1;
+        printf("Save state was made with a different game.\n");
+        state.fail();
+        return;
     }
 
-    database_size = get_file_size(file_name);
-    if (database_size % 19)
+    state.sync(key1_buffer);
+    state.sync(cmd_encrypt_mode);
+    state.sync(save_type);
+
+    //The save data follows in the same chunk, so a size that doesn't fit in what's left of it is corrupt
+    int state_save_size = save_size;
+    state.sync(state_save_size);
+    if (state.is_loading() && !state.has_failed() &&
+            (state_save_size <= 0 || (uint64_t)state_save_size > state.get_chunk_remaining()))
     {
-        printf("Save database corrupted or in wrong format.\n");
-        return 1;
+        printf("Save state has an invalid save size of %d\n", state_save_size);
+        state.fail();
+        return;
+    }
+    bool resized = false;
+    if (state.is_loading() && !state.has_failed() && state_save_size != (int)SPI_save.size())
+    {
+        resize_save(state_save_size);
+        resized = true;
     }
 
-    printf("Save database successfully loaded.\n");
+    //Only write the save file again if the state actually changed it
+    if (state.sync_block_changed(SPI_save.data(), SPI_save.size()) || resized)
+    {
+        dirty_start = 0;
+        dirty_end = save_size;
+    }
 
-    save_database = unique_ptr<uint8_t[]>(new uint8_t[database_size]);
-    file.read((char*)save_database.get(), database_size);
-    file.close();
+    state.sync(command_buffer);
+    state.sync(data_output);
+    state.sync(block_buffer);
+    state.sync(block_words);
+    state.sync(block_index);
+    state.sync(block_has_data);
+    state.sync(ROM_data_index);
+    state.sync(command_id);
+    state.sync(secure_area_index);
+    state.sync(word_cycles);
+    state.sync(ROMCTRL);
+    state.sync(AUXSPICNT);
+    state.sync(spi_cmd);
+    state.sync(spi_data);
+    state.sync(spi_params);
+    state.sync(spi_addr);
+    state.sync(spi_write_enabled);
+    state.sync(encrypt_seed0);
+    state.sync(encrypt_seed1);
+    state.sync(keycode);
+    state.end_chunk();
+}
 
-    return 0;
+int NDS_Cart::load_database(string file_name)
+{
+    return save_database.load(file_name);
 }
 
 int NDS_Cart::load_ROM(string file_name)
 {
     power_on();
     
-    ifstream file(file_name, ios::binary | ios::in);
-    if (!file.is_open())
+    if (!ROM.open(file_name))
     {
         printf("Failed to load %s\n", file_name.c_str());
         return 1;
@@ -174,16 +224,11 @@ int NDS_Cart::load_ROM(string file_name)
     
     printf("%s successfully loaded\n", file_name.c_str());
     
-    ROM_size = get_file_size(file_name);
-    printf("Allocating %lld bytes for ROM...\n", ROM_size);
-    
-    ROM = unique_ptr<uint8_t[]>(new uint8_t[ROM_size]);
-    
-    printf("Allocated memory successfully.\n");
-    printf("Loading ROM into memory...\n");
-    
-    file.read((char*)ROM.get(), ROM_size);
-    file.close();
+    ROM_size = ROM.get_size();
+    if (ROM.is_mapped())
+        printf("Mapped %lld bytes of ROM\n", ROM_size);
+    else
+        printf("Reading %lld bytes of ROM on demand\n", ROM_size);
 
     //Remove the .nds extension
     ROM_name = file_name.substr(0, file_name.length() - 4);
@@ -195,8 +240,8 @@ int NDS_Cart::load_ROM(string file_name)
         int file_size = get_file_size(ROM_name + ".sav");
         if (file_size)
         {
-            save_file.read((char*)SPI_save, file_size);
-            save_size = file_size;
+            resize_save(file_size);
+            save_file.read((char*)SPI_save.data(), file_size);
             printf("Loaded save for %s successfully.\n", ROM_name.c_str());
             printf("Save size: %d\n", save_size);
         }
@@ -205,54 +250,40 @@ int NDS_Cart::load_ROM(string file_name)
     else
     {
         //Check database for possible entry
-        if (save_database)
+        uint8_t header[16];
+        int size_index;
+        ROM.read(0, header, 16);
+        if (save_database.find(header, size_index))
         {
-            bool match;
-            for (int index = 0; index < database_size / 19; index++)
+            printf("\nFound ROM entry in database.\n");
+            switch (size_index)
             {
-                //Check if NDS header and database entry match
-                match = true;
-                for (int c = 0; c < 16; c++)
-                {
-                    if (ROM[c] != save_database[c + (index * 19)])
-                    {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match)
-                {
-                    printf("\nFound ROM entry in database.\n");
-                    int size_index = save_database[18 + (index * 19)];
-                    switch (size_index)
-                    {
-                        case 0x02:
-                            save_size = 512;
-                            break;
-                        case 0x03:
-                            save_size = 1024 * 8;
-                            break;
-                        case 0x04:
-                            save_size = 1024 * 64;
-                            break;
-                        case 0x05:
-                            save_size = 1024 * 256;
-                            break;
-                        case 0x06:
-                            save_size = 1024 * 512;
-                            break;
-                        case 0x07:
-                            save_size = 1024 * 1024;
-                            break;
-                        default:
-                            printf("Unrecognized save format %d!\n", size_index);
-                            break;
-                    }
-                    printf("Save size: %d\n", save_size);
-                }
+                case 0x02:
+                    save_size = 512;
+                    break;
+                case 0x03:
+                    save_size = 1024 * 8;
+                    break;
+                case 0x04:
+                    save_size = 1024 * 64;
+                    break;
+                case 0x05:
+                    save_size = 1024 * 256;
+                    break;
+                case 0x06:
+                    save_size = 1024 * 512;
+                    break;
+                case 0x07:
+                    save_size = 1024 * 1024;
+                    break;
+                default:
+                    printf("Unrecognized save format %d!\n", size_index);
+                    break;
             }
+            printf("Save size: %d\n", save_size);
         }
     }
+    resize_save(save_size);
 
     if (save_size == 512)
         save_type = 0;
@@ -265,26 +296,27 @@ int NDS_Cart::load_ROM(string file_name)
     if (Config::direct_boot_enabled)
         return 0;
     
-    uint32_t gamecode = *(uint32_t*)&ROM[0xC];
-    uint32_t arm_ROM_base = *(uint32_t*)&ROM[0x20];
+    uint32_t gamecode = ROM.read_word(0xC);
+    uint32_t arm_ROM_base = ROM.read_word(0x20);
     if (arm_ROM_base < 0x8000)
     {
         if (arm_ROM_base >= 0x4000)
         {
-            if (*(uint32_t*)&ROM[arm_ROM_base] == 0xE7FFDEFF && *(uint32_t*)&ROM[arm_ROM_base + 0x10] != 0xE7FFDEFF)
+            uint8_t* secure_area = ROM.get_writable(arm_ROM_base, 0x800);
+            if (secure_area && *(uint32_t*)&secure_area[0] == 0xE7FFDEFF && *(uint32_t*)&secure_area[0x10] != 0xE7FFDEFF)
             {
                 //The first two KB of the secure area must be re-encrypted
                 //And the first eight bytes ("encryObj") must be double encrypted
                 printf("\nEncrypting secure area");
                 
-                strncpy((char*)&ROM[arm_ROM_base], "encryObj", 8);
+                strncpy((char*)secure_area, "encryObj", 8);
                 
                 init_keycode(gamecode, 3, 2);
                 for (unsigned int i = 0; i < 0x800; i += 8)
-                    key1_encrypt((uint32_t*)&ROM[arm_ROM_base + i]);
+                    key1_encrypt((uint32_t*)&secure_area[i]);
                 
                 init_keycode(gamecode, 2, 2);
-                key1_encrypt((uint32_t*)&ROM[arm_ROM_base]);
+                key1_encrypt((uint32_t*)secure_area);
             }
         }
     }
@@ -293,98 +325,184 @@ int NDS_Cart::load_ROM(string file_name)
     return 0;
 }
 
+//Hands the bytes written since the last check to the save writer, which puts them on disk in the background
 void NDS_Cart::save_check()
 {
-    if (dirty_save)
+    if (dirty_start < dirty_end)
     {
-        dirty_save = false;
-        ofstream save_file(ROM_name + ".sav", ios::binary | ios::out);
-        if (save_file.is_open())
-        {
-            save_file.write((char*)SPI_save, save_size);
-            save_file.close();
-        }
+        save_writer.update(ROM_name + ".sav", SPI_save.data(), save_size, dirty_start, dirty_end);
+        dirty_start = 0;
+        dirty_end = 0;
     }
 }
 
-void NDS_Cart::run(int cycles)
+//Save memory only takes the size of the game's save chip. Growing it keeps the existing contents.
+void NDS_Cart::resize_save(int size)
 {
-    if (ROMCTRL.block_busy && !ROMCTRL.word_ready)
+    SPI_save.resize(size, 0);
+    SPI_save.shrink_to_fit();
+    save_size = size;
+}
+
+void NDS_Cart::write_save(uint32_t address, uint8_t value)
+{
+    SPI_save[address] = value;
+    if (dirty_start == dirty_end)
     {
-        cycles_left -= cycles;
-        if (cycles_left > 0)
-            return;
+        dirty_start = address;
+        dirty_end = address + 1;
+    }
+    else
+    {
+        dirty_start = min(dirty_start, address);
+        dirty_end = max(dirty_end, address + 1);
+    }
+}
 
-        cycles_left = 8;
-        switch (command_id)
-        {
-            case CART_COMMAND::DUMMY:
-                data_output = 0xFFFFFFFF;
-                break;
-            case CART_COMMAND::GET_HEADER:
-                data_output = *(uint32_t*)&ROM[ROM_data_index];
+//Makes the next word of the block available and requests a cart DMA for it
+void NDS_Cart::handle_event(SchedulerEvent& event)
+{
+    event.processing = false;
+    if (!ROMCTRL.block_busy || ROMCTRL.word_ready)
+        return;
+
+    //read_block already handed out every word, and the cart has now finished sending them
+    if (block_index >= block_words)
+    {
+        end_block();
+        return;
+    }
+
+    if (block_has_data)
+    {
+        data_output = block_buffer[block_index];
+        ROMCTRL.word_ready = true;
+    }
+    block_index++;
+    e->gamecart_DMA_request();
+    if (block_index >= block_words)
+        end_block();
+    else if (!block_has_data)
+        e->add_cart_event(word_cycles);
+}
+
+//Computes every word of the transfer when it starts, so that it can be handed out in one go
+void NDS_Cart::fill_block()
+{
+    block_has_data = true;
+    switch (command_id)
+    {
+        case CART_COMMAND::DUMMY:
+            for (int i = 0; i < block_words; i++)
+                block_buffer[i] = 0xFFFFFFFF;
+            break;
+        case CART_COMMAND::GET_HEADER:
+            for (int i = 0; i < block_words; i++)
+            {
+                block_buffer[i] = ROM.read_word(ROM_data_index);
                 ROM_data_index += 4;
                 if (ROM_data_index > 0xFFF)
                     ROM_data_index = 0x0;
-                ROMCTRL.word_ready = true;
-                break;
-            case CART_COMMAND::GET_CHIP_ID:
-                //The chip id doesn't really matter as long as it stays consistent
-                //For those curious, this particular id corresponds to a Macronix 64 MB ROM
-                data_output = 0x00003FC2;
-                ROMCTRL.word_ready = true;
-                break;
-            case CART_COMMAND::ENABLE_KEY1:
-                cmd_encrypt_mode = 1;
-                break;
-            case CART_COMMAND::GET_SECURE_AREA_BLOCK:
-                data_output = *(uint32_t*)&ROM[secure_area_index];
+            }
+            break;
+        case CART_COMMAND::GET_CHIP_ID:
+            //The chip id doesn't really matter as long as it stays consistent
+            //For those curious, this particular id corresponds to a Macronix 64 MB ROM
+            for (int i = 0; i < block_words; i++)
+                block_buffer[i] = 0x00003FC2;
+            break;
+        case CART_COMMAND::ENABLE_KEY1:
+            cmd_encrypt_mode = 1;
+            block_has_data = false;
+            break;
+        case CART_COMMAND::GET_SECURE_AREA_BLOCK:
+            for (int i = 0; i < block_words; i++)
+            {
+                block_buffer[i] = ROM.read_word(secure_area_index);
                 secure_area_index += 4;
-                ROMCTRL.word_ready = true;
+            }
+            break;
+        case CART_COMMAND::READ_ROM:
+            if (ROM_data_index >= 0x8000)
+            {
+                ROM.read(ROM_data_index, (uint8_t*)block_buffer, block_words * 4);
+                ROM_data_index += block_words * 4;
                 break;
-            case CART_COMMAND::READ_ROM:
+            }
+            for (int i = 0; i < block_words; i++)
+            {
                 if (ROM_data_index < 0x8000)
-                    data_output = *(uint32_t*)&ROM[0x8000 + (ROM_data_index & 0x1FF)];
+                    block_buffer[i] = ROM.read_word(0x8000 + (ROM_data_index & 0x1FF));
                 else
-                    data_output = *(uint32_t*)&ROM[ROM_data_index];
+                    block_buffer[i] = ROM.read_word(ROM_data_index);
                 ROM_data_index += 4;
-                ROMCTRL.word_ready = true;
-                break;
-            default:
-                printf("\nCommand $%02X%02X%02X%02X%02X%02X%02X%02X to cartridge not recognized",
-                       command_buffer[0], command_buffer[1], command_buffer[2], command_buffer[3],
-                       command_buffer[4], command_buffer[5], command_buffer[6], command_buffer[7]);
-                //exit(3);
-        }
-        bytes_left -= 4;
-        e->gamecart_DMA_request();
-        if (bytes_left <= 0)
-        {
-            ROMCTRL.block_busy = false;
-            if (AUXSPICNT.IRQ_after_transfer)
-            {
-                if (e->arm7_has_cart_rights())
-                    e->request_interrupt7(INTERRUPT::CART_TRANSFER);
-                else
-                    e->request_interrupt9(INTERRUPT::CART_TRANSFER);
             }
-        }
+            break;
+        default:
+            printf("\nCommand $%02X%02X%02X%02X%02X%02X%02X%02X to cartridge not recognized",
+                   command_buffer[0], command_buffer[1], command_buffer[2], command_buffer[3],
+                   command_buffer[4], command_buffer[5], command_buffer[6], command_buffer[7]);
+            block_has_data = false;
+            //exit(3);
+    }
+}
+
+void NDS_Cart::end_block()
+{
+    ROMCTRL.block_busy = false;
+    if (AUXSPICNT.IRQ_after_transfer)
+    {
+        if (e->arm7_has_cart_rights())
+            e->request_interrupt7(INTERRUPT::CART_TRANSFER);
+        else
+            e->request_interrupt9(INTERRUPT::CART_TRANSFER);
     }
 }
 
 uint8_t NDS_Cart::direct_read(uint32_t address)
 {
-    return ROM[address];
+    return ROM.read_byte(address);
 }
 
 uint16_t NDS_Cart::direct_read_halfword(uint32_t address)
 {
-    return *(uint16_t*)&ROM[address];
+    return ROM.read_halfword(address);
 }
 
 uint32_t NDS_Cart::direct_read_word(uint32_t address)
 {
-    return *(uint32_t*)&ROM[address];
+    return ROM.read_word(address);
+}
+
+void NDS_Cart::direct_read_block(uint32_t address, uint8_t* dest, uint32_t size)
+{
+    ROM.read(address, dest, size);
+}
+
+//The ROM's path without the .nds extension, which other files for the game are named after
+string NDS_Cart::get_ROM_name()
+{
+    return ROM_name;
+}
+
+int NDS_Cart::get_save_size()
+{
+    return save_size;
+}
+
+void NDS_Cart::copy_save(vector<uint8_t>& save)
+{
+    save = SPI_save;
+}
+
+//Puts back a save copied with copy_save, which already matches the save file
+void NDS_Cart::restore_save(const vector<uint8_t>& save)
+{
+    if (save.size() != SPI_save.size())
+        return;
+    SPI_save = save;
+    dirty_start = 0;
+    dirty_end = 0;
 }
 
 uint8_t NDS_Cart::read_command(int index)
@@ -421,11 +539,38 @@ uint32_t NDS_Cart::get_output()
     if (ROMCTRL.word_ready)
     {
         ROMCTRL.word_ready = false;
-        cycles_left = 8;
+        if (ROMCTRL.block_busy)
+            e->add_cart_event(word_cycles);
     }
     return data_output;
 }
 
+//The word waiting in the data register plus the rest of the block
+int NDS_Cart::get_block_words_ready()
+{
+    if (!ROMCTRL.word_ready || !block_has_data)
+        return 0;
+    return block_words - block_index + 1;
+}
+
+//Reads out everything get_block_words_ready reports at once. The transfer still only finishes
+//once the cart would have sent the remaining words, (8 + gap) * clock + block_words * word_cycles after it started.
+void NDS_Cart::read_block(uint32_t* dest)
+{
+    int words = get_block_words_ready();
+    int words_left = block_words - block_index;
+    memcpy(dest, &block_buffer[block_index - 1], words * 4);
+    data_output = block_buffer[block_words - 1];
+    block_index = block_words;
+    ROMCTRL.word_ready = false;
+    if (!ROMCTRL.block_busy)
+        return;
+    if (words_left > 0)
+        e->add_cart_event(words_left * word_cycles);
+    else
+        end_block();
+}
+
 uint16_t NDS_Cart::get_AUXSPICNT()
 {
     uint16_t reg = 0;
@@ -524,8 +669,7 @@ void NDS_Cart::set_AUXSPIDATA(uint8_t value)
                             spi_addr = value;
                         else if (spi_write_enabled)
                         {
-                            dirty_save = true;
-                            SPI_save[spi_addr & 0xFF] = value;
+                            write_save(spi_addr & 0xFF, value);
                             spi_addr++;
                         }
                         break;
@@ -534,8 +678,7 @@ void NDS_Cart::set_AUXSPIDATA(uint8_t value)
                             spi_addr |= value << ((2 - spi_params) * 8);
                         else if (spi_write_enabled)
                         {
-                            dirty_save = true;
-                            SPI_save[spi_addr & (save_size - 1)] = value;
+                            write_save(spi_addr & (save_size - 1), value);
                             spi_addr++;
                         }
                         break;
@@ -544,8 +687,7 @@ void NDS_Cart::set_AUXSPIDATA(uint8_t value)
                             spi_addr |= value << ((3 - spi_params) * 8);
                         else if (spi_write_enabled)
                         {
-                            dirty_save = true;
-                            SPI_save[spi_addr & (save_size - 1)] = 0;
+                            write_save(spi_addr & (save_size - 1), 0);
                             spi_addr++;
                         }
                         break;
@@ -618,8 +760,7 @@ void NDS_Cart::set_AUXSPIDATA(uint8_t value)
                         if (spi_write_enabled)
                         {
                             printf("\nPage write to $%08X", spi_addr);
-                            dirty_save = true;
-                            SPI_save[spi_addr & (save_size - 1)] = value;
+                            write_save(spi_addr & (save_size - 1), value);
                             spi_addr++;
                         }
                     }
@@ -632,8 +773,7 @@ void NDS_Cart::set_AUXSPIDATA(uint8_t value)
                 {
                     if (spi_write_enabled)
                     {
-                        dirty_save = true;
-                        SPI_save[spi_addr & 0x1FF] = value;
+                        write_save(spi_addr & 0x1FF, value);
                         spi_addr++;
                         if (spi_addr == 0x200)
                             spi_addr = 0x100;
@@ -683,18 +823,24 @@ void NDS_Cart::set_ROMCTRL(uint32_t value)
     {
         ROMCTRL.word_ready = false;
         
+        int bytes;
         if (ROMCTRL.block_size == 0)
-            bytes_left = 0;
+            bytes = 0;
         else if (ROMCTRL.block_size == 7)
-            bytes_left = 4;
+            bytes = 4;
         else
-            bytes_left = 0x100 << ROMCTRL.block_size;
+            bytes = 0x100 << ROMCTRL.block_size;
+
+        //Each byte, including the eight command bytes and the gap, takes one ROM clock of 5 or 8 cycles
+        int clock = ROMCTRL.slow_transfer ? 8 : 5;
+        int gap = 0;
+        word_cycles = clock * 4;
         
         if (cmd_encrypt_mode)
-            cycles_left += ROMCTRL.key1_gap;
+            gap += ROMCTRL.key1_gap;
         if (cmd_encrypt_mode == 1)
         {
-            cycles_left += ROMCTRL.key1_gap;
+            gap += ROMCTRL.key1_gap;
             uint8_t data[8];
             for (int i = 0; i < 8; i++)
                 data[i] = command_buffer[7 - i];
@@ -730,7 +876,7 @@ void NDS_Cart::set_ROMCTRL(uint32_t value)
                 ROM_data_index |= (command_buffer[2] << 16);
                 ROM_data_index |= (command_buffer[3] << 8);
                 ROM_data_index |= (command_buffer[4]);
-                if (bytes_left > 0x1000)
+                if (bytes > 0x1000)
                 {
                     printf("\nROM read bytes left > 0x1000");
                     exit(1);
@@ -760,6 +906,12 @@ void NDS_Cart::set_ROMCTRL(uint32_t value)
                         break;
                 }
         }
+
+        //Even an empty transfer outputs one word
+        block_words = max(bytes / 4, 1);
+        block_index = 0;
+        fill_block();
+        e->add_cart_event((8 + gap) * clock + word_cycles);
     }
 }
 
@@ -8,6 +8,10 @@
 #define cartridge_hpp
 #include <memory>
 #include <string>
+#include <vector>
+#include "romimage.hpp"
+#include "savedatabase.hpp"
+#include "savewriter.hpp"
 
 enum CART_COMMAND
 {
@@ -57,6 +61,8 @@ struct REG_AUXSPICNT
 };
 
 class Emulator;
+class Save_State;
+struct SchedulerEvent;
 
 class NDS_Cart
 {
@@ -66,24 +72,26 @@ class NDS_Cart
         uint8_t key1_buffer[0x1048];
         int cmd_encrypt_mode;
     
-        std::unique_ptr<uint8_t[]> ROM;
-        std::unique_ptr<uint8_t[]> save_database;
+        ROM_Image ROM;
+        Save_Database save_database;
         std::string ROM_name;
-        uint8_t SPI_save[1024 * 1024 * 8];
+        std::vector<uint8_t> SPI_save;
         int save_size;
         int save_type;
-        bool dirty_save;
-        long long database_size;
+        uint32_t dirty_start, dirty_end;
+        Save_Writer save_writer;
         long long ROM_size;
         uint8_t command_buffer[8];
         uint32_t data_output;
+        uint32_t block_buffer[0x4000 / 4];
+        int block_words, block_index;
+        bool block_has_data;
         int ROM_data_index;
         CART_COMMAND command_id;
     
         int secure_area_index;
     
-        int cycles_left;
-        int bytes_left;
+        int word_cycles;
     
         REG_ROMCTRL ROMCTRL;
         REG_AUXSPICNT AUXSPICNT;
@@ -100,24 +108,38 @@ class NDS_Cart
         void key1_decrypt(uint32_t* data);
         void apply_keycode(uint32_t modulo);
         void init_keycode(uint32_t idcode, int level, uint32_t modulo);
+
+        void fill_block();
+        void end_block();
+        void write_save(uint32_t address, uint8_t value);
+        void resize_save(int size);
     public:
         NDS_Cart(Emulator* e);
         void power_on();
+        void do_state(Save_State& state);
         int load_database(std::string file_name);
         int load_ROM(std::string file_name);
         void save_check();
     
         uint8_t read_command(int index);
         void receive_command(uint8_t command, int index);
-        void run(int cycles);
+        void handle_event(SchedulerEvent& event);
         void debug_encrypt();
     
         uint8_t direct_read(uint32_t address);
         uint16_t direct_read_halfword(uint32_t address);
         uint32_t direct_read_word(uint32_t address);
+        void direct_read_block(uint32_t address, uint8_t* dest, uint32_t size);
+        std::string get_ROM_name();
+
+        int get_save_size();
+        void copy_save(std::vector<uint8_t>& save);
+        void restore_save(const std::vector<uint8_t>& save);
     
         uint32_t get_ROMCTRL();
         uint32_t get_output();
+        int get_block_words_ready();
+        void read_block(uint32_t* dest);
         uint16_t get_AUXSPICNT();
         uint8_t read_AUXSPIDATA();
     
@@ -13,12 +13,20 @@ namespace Config
     std::string firmware_path;
     std::string savelist_path;
     bool direct_boot_enabled;
+    bool boot_cache_enabled;
     bool pause_when_unfocused;
 
     bool bg_enable[4];
 
     int frameskip;
     bool enable_framelimiter;
+    bool threaded_3D;
+    bool huge_pages;
+
+    bool rewind_enabled;
+    int rewind_interval;
+    int rewind_memory;
+    int run_ahead_frames;
 
     bool hle_bios;
     bool test;
@@ -15,12 +15,20 @@ namespace Config
     extern std::string firmware_path;
     extern std::string savelist_path;
     extern bool direct_boot_enabled;
+    extern bool boot_cache_enabled;
     extern bool pause_when_unfocused;
 
     extern bool bg_enable[4];
 
     extern int frameskip;
     extern bool enable_framelimiter;
+    extern bool threaded_3D;
+    extern bool huge_pages;
+
+    extern bool rewind_enabled;
+    extern int rewind_interval;
+    extern int rewind_memory;
+    extern int run_ahead_frames;
 
     extern bool hle_bios;
     extern bool test;
@@ -29,9 +29,16 @@ ConfigWindow::ConfigWindow(QWidget *parent) :
 
     Config::direct_boot_enabled = cfg.value("boot/directboot").toBool();
     ui->toggle_direct_boot->setChecked(Config::direct_boot_enabled);
+    Config::boot_cache_enabled = cfg.value("boot/bootcache", false).toBool();
 
     Config::pause_when_unfocused = false;
 
+    Config::rewind_enabled = cfg.value("rewind/enabled", true).toBool();
+    Config::rewind_interval = cfg.value("rewind/interval", 4).toInt();
+    Config::rewind_memory = cfg.value("rewind/memory", 64).toInt();
+    Config::run_ahead_frames = cfg.value("emulation/runahead", 0).toInt();
+    Config::threaded_3D = cfg.value("emulation/threaded3d", true).toBool();
+
     update_ui();
 }
 
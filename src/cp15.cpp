@@ -8,6 +8,7 @@
 #include "cp15.hpp"
 #include "cpu.hpp"
 #include "emulator.hpp"
+#include "savestate.hpp"
 
 CP15::CP15(Emulator* e) : e(e)
 {
@@ -61,6 +62,26 @@ void CP15::power_on()
     control.dtcm_enable = true;
 }
 
+void CP15::do_state(Save_State& state)
+{
+    state.begin_chunk("CP15", 1);
+    state.sync(control);
+    state.sync(itcm_data);
+    state.sync(dtcm_data);
+    state.sync(itcm_size);
+    state.sync(dtcm_base);
+    state.sync(dtcm_size);
+    state.sync(dcache);
+    state.sync(icache);
+    state.end_chunk();
+}
+
+void CP15::set_memory(Guest_Memory* memory)
+{
+    ITCM = memory->get(GUEST_REGION::ITCM);
+    DTCM = memory->get(GUEST_REGION::DTCM);
+}
+
 void CP15::link_with_cpu(ARM_CPU *arm9)
 {
     this->arm9 = arm9;
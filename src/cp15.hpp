@@ -8,6 +8,7 @@
 #define cp15_hpp
 #include <cstdlib>
 #include <cstdint>
+#include "guestmemory.hpp"
 
 struct ControlReg
 {
@@ -29,6 +30,7 @@ struct ControlReg
 
 class ARM_CPU;
 class Emulator;
+class Save_State;
 
 class CP15
 {
@@ -45,8 +47,8 @@ class CP15
         uint32_t dtcm_base;
         uint32_t dtcm_size;
 
-        uint8_t ITCM[1024 * 32];
-        uint8_t DTCM[1024 * 16];
+        uint8_t* ITCM;
+        uint8_t* DTCM;
 
         uint8_t dcache[1024 * 4];
         uint8_t icache[1024 * 8];
@@ -54,6 +56,8 @@ class CP15
         CP15(Emulator* e);
     
         void power_on();
+        void set_memory(Guest_Memory* memory);
+        void do_state(Save_State& state);
         void link_with_cpu(ARM_CPU* arm9);
     
         uint32_t get_itcm_size();
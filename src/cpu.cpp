@@ -11,6 +11,7 @@
 #include "cpu.hpp"
 #include "cpuinstrs.hpp"
 #include "emulator.hpp"
+#include "savestate.hpp"
 
 using namespace std;
 
@@ -209,6 +210,33 @@ void ARM_CPU::power_on()
     jp(exception_base, true); //Jump to reset vector
 }
 
+void ARM_CPU::do_state(Save_State& state)
+{
+    state.begin_chunk(cpu_id ? "ARM7" : "ARM9", 1);
+    state.sync(halted);
+    state.sync(SP_svc);
+    state.sync(SP_irq);
+    state.sync(SP_fiq);
+    state.sync(SP_abt);
+    state.sync(SP_und);
+    state.sync(LR_svc);
+    state.sync(LR_irq);
+    state.sync(LR_fiq);
+    state.sync(LR_abt);
+    state.sync(LR_und);
+    state.sync(fiq_regs);
+    state.sync(regs);
+    state.sync(CPSR);
+    state.sync(SPSR);
+    state.sync(exception_base);
+    state.sync(timestamp);
+    state.sync(last_timestamp);
+    state.sync(current_instr);
+    state.sync(code_waitstates);
+    state.sync(data_waitstates);
+    state.end_chunk();
+}
+
 void ARM_CPU::direct_boot(uint32_t entry_point)
 {
     jp(entry_point, true);
@@ -54,6 +54,7 @@ struct PSR_Flags
 };
 
 class Emulator;
+class Save_State;
 
 class ARM_CPU
 {
@@ -88,6 +89,7 @@ class ARM_CPU
         ARM_CPU(Emulator* e, int id);
         void set_cp15(CP15* cp);
         void power_on();
+        void do_state(Save_State& state);
         void direct_boot(uint32_t entry_point);
         void run();
         void execute();
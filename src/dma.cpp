@@ -5,8 +5,11 @@
 */
 
 #include "dma.hpp"
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include "emulator.hpp"
+#include "savestate.hpp"
 
 uint16_t DMACNT::get()
 {
@@ -51,12 +54,165 @@ void NDS_DMA::power_on()
     }
 }
 
+void NDS_DMA::do_state(Save_State& state)
+{
+    state.begin_chunk("DMA ", 1);
+    state.sync(dmas);
+    state.sync(active_DMAs);
+    state.end_chunk();
+}
+
+//Finishes the rest of a transfer in one step when both sides are plain memory.
+//Returns false if the transfer has to go through the bus one unit at a time.
+bool NDS_DMA::bulk_transfer(DMA* dma)
+{
+    int units = dma->length - dma->internal_len;
+    if (units <= 0)
+        return false;
+
+    //Only increment and fixed modes
+    if (dma->CNT.dest_control == 1 || dma->CNT.source_control == 1)
+        return false;
+    uint32_t unit_size = dma->CNT.word_transfer ? 4 : 2;
+    if ((dma->internal_source | dma->internal_dest) & (unit_size - 1))
+        return false;
+
+    bool source_fixed = dma->CNT.source_control == 2;
+    bool dest_fixed = dma->CNT.dest_control == 2;
+    uint32_t bytes = units * unit_size;
+    uint32_t source_size = source_fixed ? unit_size : bytes;
+    uint32_t dest_size = dest_fixed ? unit_size : bytes;
+
+    uint8_t *source, *dest;
+    if (dma->is_arm9)
+    {
+        source = e->arm9_get_block(dma->internal_source, source_size);
+        dest = e->arm9_get_block(dma->internal_dest, dest_size);
+    }
+    else
+    {
+        source = e->arm7_get_block(dma->internal_source, source_size);
+        dest = e->arm7_get_block(dma->internal_dest, dest_size);
+    }
+    if (!source || !dest)
+        return false;
+
+    //A unit-by-unit copy only matches memmove for overlapping blocks when moving downwards
+    bool overlap = dest < source + source_size && source < dest + dest_size;
+    if (overlap && !source_fixed && (dest_fixed || dest > source))
+        return false;
+
+    if (source_fixed)
+    {
+        uint32_t value = (unit_size == 4) ? *(uint32_t*)source : *(uint16_t*)source;
+        for (uint32_t i = 0; i < dest_size; i += unit_size)
+        {
+            if (unit_size == 4)
+                *(uint32_t*)&dest[i] = value;
+            else
+                *(uint16_t*)&dest[i] = value;
+        }
+    }
+    else if (dest_fixed)
+        memcpy(dest, source + bytes - unit_size, unit_size);
+    else
+        memmove(dest, source, bytes);
+
+    if (dma->is_arm9)
+        e->arm9_block_written(dma->internal_dest, dest_size);
+    else
+        e->arm7_block_written(dma->internal_dest, dest_size);
+    if (!source_fixed)
+        dma->internal_source += bytes;
+    if (!dest_fixed)
+        dma->internal_dest += bytes;
+    dma->internal_len = dma->length;
+    return true;
+}
+
+//Hands a burst of a display list DMA straight to the geometry engine's command parser.
+//Whatever the FIFO cannot take without stalling is left for the unit-by-unit loop.
+void NDS_DMA::GXFIFO_transfer(DMA* dma)
+{
+    if (!dma->is_arm9 || !dma->CNT.word_transfer || dma->CNT.source_control != 0 || dma->CNT.dest_control != 2)
+        return;
+    if (dma->internal_dest < 0x04000400 || dma->internal_dest >= 0x04000440)
+        return;
+
+    int units = std::min(dma->length, 112) - dma->internal_len;
+    if (units <= 0 || (dma->internal_source & 3))
+        return;
+
+    uint8_t* source = e->arm9_get_block(dma->internal_source, units * 4);
+    if (!source)
+        return;
+
+    int consumed = e->write_GXFIFO_block((uint32_t*)source, units);
+    dma->internal_source += consumed * 4;
+    dma->internal_len += consumed;
+}
+
+//Copies every word the cartridge has ready in one go, for a DMA that moves one word per cart request
+bool NDS_DMA::cart_transfer(DMA* dma)
+{
+    if (!dma->CNT.repeat || !dma->CNT.word_transfer || dma->CNT.IRQ_after_transfer)
+        return false;
+    if (dma->length != 1 || dma->internal_len != 0)
+        return false;
+    if (dma->internal_source != 0x04100010 || dma->CNT.source_control != 2)
+        return false;
+    if (dma->CNT.dest_control != 0 || (dma->internal_dest & 3))
+        return false;
+
+    int words = e->cart_get_block_words();
+    if (!words)
+        return false;
+
+    uint32_t bytes = words * 4;
+    uint8_t* dest;
+    if (dma->is_arm9)
+        dest = e->arm9_get_block(dma->internal_dest, bytes);
+    else
+        dest = e->arm7_get_block(dma->internal_dest, bytes);
+    if (!dest)
+        return false;
+
+    e->cart_read_block((uint32_t*)dest);
+    if (dma->is_arm9)
+        e->arm9_block_written(dma->internal_dest, bytes);
+    else
+        e->arm7_block_written(dma->internal_dest, bytes);
+    dma->internal_dest += bytes;
+    return true;
+}
+
 void NDS_DMA::handle_event(SchedulerEvent &event)
 {
     event.processing = false;
     DMA* active_DMA = &dmas[event.id];
+
+    bool cart_timing = active_DMA->CNT.timing == (active_DMA->is_arm9 ? 5 : 4);
+    if (cart_timing && cart_transfer(active_DMA))
+    {
+        active_DMAs &= ~(1 << event.id);
+        return;
+    }
+
+    if (active_DMA->CNT.timing != 7)
+        bulk_transfer(active_DMA);
+    else
+        GXFIFO_transfer(active_DMA);
     for (;;)
     {
+        //GXFIFO DMAs pause every 112 words
+        if (active_DMA->is_arm9 && active_DMA->CNT.timing == 7 && active_DMA->internal_len >= 112)
+        {
+            active_DMA->internal_len = 0;
+            active_DMA->length -= 112;
+            active_DMAs &= ~(1 << event.id);
+            return;
+        }
+
         active_DMA->internal_len++;
         if (active_DMA->internal_len > active_DMA->length)
         {
@@ -148,13 +304,6 @@ void NDS_DMA::handle_event(SchedulerEvent &event)
                 printf("\nUnrecognized DMA source control %d", active_DMA->CNT.source_control);
                 exit(1);
         }
-        if (active_DMA->is_arm9 && active_DMA->CNT.timing == 7 && active_DMA->internal_len >= 112)
-        {
-            active_DMA->internal_len = 0;
-            active_DMA->length -= 112;
-            active_DMAs &= ~(1 << event.id);
-            return;
-        }
     }
 }
 
@@ -36,6 +36,7 @@ struct DMA
 };
 
 class Emulator;
+class Save_State;
 struct SchedulerEvent;
 
 class NDS_DMA
@@ -45,9 +46,14 @@ class NDS_DMA
         DMA dmas[8];
         DMA* active_DMA7, active_DMA9;
         uint8_t active_DMAs;
+
+        bool bulk_transfer(DMA* dma);
+        void GXFIFO_transfer(DMA* dma);
+        bool cart_transfer(DMA* dma);
     public:
         NDS_DMA(Emulator* e);
         void power_on();
+        void do_state(Save_State& state);
         void DMA_event(int index);
         void update_DMA(int index);
 
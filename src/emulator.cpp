@@ -4,6 +4,7 @@
     See LICENSE.txt for details
 */
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
@@ -56,7 +57,16 @@ void POWCNT2_REG::set(uint8_t byte)
 }
 
 Emulator::Emulator() : arm7(this, 1), arm9(this, 0), arm9_cp15(this), cart(this), dma(this),
-                       gpu(this), spi(this), timers(this) {}
+                       gpu(this), spi(this), timers(this), rewind_frame_count(0),
+                       running_ahead(false), touch_x(0), touch_y(0xFFF),
+                       boot_snapshot_pending(false), boot_entry_reached(false), boot_cache_failed(false), boot_entry(0)
+{
+    main_RAM = memory.get(GUEST_REGION::MAIN_RAM);
+    shared_WRAM = memory.get(GUEST_REGION::SHARED_WRAM);
+    arm7_WRAM = memory.get(GUEST_REGION::ARM7_WRAM);
+    arm9_cp15.set_memory(&memory);
+    gpu.set_memory(&memory);
+}
 
 int Emulator::init()
 {
@@ -76,6 +86,8 @@ void Emulator::power_on()
     for (int i = 0; i < 4; i++)
         Config::bg_enable[i] = true;
     cycle_count = 0;
+    rewind_buffer.reset((uint64_t)Config::rewind_memory * 1024 * 1024);
+    rewind_frame_count = 0;
     arm9.power_on();
     arm7.power_on();
     arm9_cp15.power_on();
@@ -95,6 +107,12 @@ void Emulator::power_on()
     DMA_event.activation_time = 0;
     DMA_event.processing = false;
     DMA_event.id = 0;
+    GX_event.activation_time = 0;
+    GX_event.processing = false;
+    GX_event.id = 0;
+    cart_event.activation_time = 0;
+    cart_event.processing = false;
+    cart_event.id = 0;
 
     POSTFLG7 = 0;
     POSTFLG9 = 0;
@@ -131,9 +149,7 @@ void Emulator::power_on()
     fifo7.recent_word = 0;
     fifo9.recent_word = 0;
     
-    memset(main_RAM, 0x0, 1024 * 1024 * 4);
-    memset(shared_WRAM, 0x0, 1024 * 32);
-    memset(arm7_WRAM, 0x0, 1024 * 64);
+    memory.reset();
 
     int7_reg.IME = 0;
     int7_reg.IE = 0;
@@ -142,6 +158,24 @@ void Emulator::power_on()
     int9_reg.IE = 0;
     int9_reg.IF = 0;
 
+    //With the boot cache, the first boot is snapshotted when the ARM9 reaches the game's entry point
+    boot_snapshot_pending = false;
+    boot_entry_reached = false;
+    if (Config::boot_cache_enabled && !boot_cache_failed)
+    {
+        if (load_boot_snapshot())
+            return;
+        //A snapshot that failed to load may have left the emulator partway restored, so boot once more without the cache
+        if (boot_cache_failed)
+        {
+            power_on();
+            boot_cache_failed = false;
+            return;
+        }
+        boot_entry = cart.direct_read_word(0x24);
+        boot_snapshot_pending = true;
+    }
+
     if (Config::direct_boot_enabled)
         direct_boot();
 }
@@ -246,18 +280,258 @@ void Emulator::direct_boot()
     BIOSPROT = 0x1204;
     WRAMCNT = 3;
     
-    //Load ROM into RAM
-    for (unsigned int i = 0; i < boot_info[3]; i += 4)
-        arm9_write_word(boot_info[2] + i, cart.direct_read_word(boot_info[0] + i));
-    
-    for (unsigned int i = 0; i < boot_info[7]; i += 4)
-        arm7_write_word(boot_info[6] + i, cart.direct_read_word(boot_info[4] + i));
+    //Load ROM into RAM, in one copy when the binary goes into a single block of memory
+    uint32_t arm9_size = (boot_info[3] + 3) & ~3;
+    uint8_t* arm9_dest = arm9_size ? arm9_get_block(boot_info[2], arm9_size) : nullptr;
+    if (arm9_dest)
+    {
+        cart.direct_read_block(boot_info[0], arm9_dest, arm9_size);
+        arm9_block_written(boot_info[2], arm9_size);
+    }
+    else
+    {
+        for (unsigned int i = 0; i < boot_info[3]; i += 4)
+            arm9_write_word(boot_info[2] + i, cart.direct_read_word(boot_info[0] + i));
+    }
+
+    uint32_t arm7_size = (boot_info[7] + 3) & ~3;
+    uint8_t* arm7_dest = arm7_size ? arm7_get_block(boot_info[6], arm7_size) : nullptr;
+    if (arm7_dest)
+    {
+        cart.direct_read_block(boot_info[4], arm7_dest, arm7_size);
+        arm7_block_written(boot_info[6], arm7_size);
+    }
+    else
+    {
+        for (unsigned int i = 0; i < boot_info[7]; i += 4)
+            arm7_write_word(boot_info[6] + i, cart.direct_read_word(boot_info[4] + i));
+    }
 
     spi.direct_boot();
     
     cycles = 0;
 }
 
+//Hashes everything the boot depends on: the BIOS, firmware, boot settings, and the parts of the ROM that are loaded
+void Emulator::make_boot_key()
+{
+    boot_cache.reset_key();
+    boot_cache.add_to_key(arm9_bios, BIOS9_SIZE);
+    boot_cache.add_to_key(arm7_bios, BIOS7_SIZE);
+    boot_cache.add_to_key(spi.get_firmware(), Firmware::SIZE);
+
+    uint8_t settings[] = {Config::direct_boot_enabled, Config::hle_bios};
+    int save_size = cart.get_save_size();
+    boot_cache.add_to_key(settings, sizeof(settings));
+    boot_cache.add_to_key((uint8_t*)&save_size, sizeof(save_size));
+
+    uint8_t header[0x200];
+    cart.direct_read_block(0, header, sizeof(header));
+    boot_cache.add_to_key(header, sizeof(header));
+
+    //ARM9 and ARM7 binaries, which can't be larger than main RAM
+    vector<uint8_t> binary;
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t offset = *(uint32_t*)&header[0x20 + i * 0x10];
+        uint32_t size = min(*(uint32_t*)&header[0x2C + i * 0x10], (uint32_t)MAIN_RAM_MASK + 1);
+        binary.resize(size);
+        cart.direct_read_block(offset, binary.data(), size);
+        boot_cache.add_to_key(binary.data(), size);
+    }
+}
+
+bool Emulator::load_boot_snapshot()
+{
+    make_boot_key();
+    Save_State state;
+    string file_name = cart.get_ROM_name() + ".boot";
+    if (!boot_cache.load(file_name, state))
+        return false;
+
+    //The save file may have changed since the snapshot, and the game hasn't read it by its entry point
+    vector<uint8_t> save;
+    cart.copy_save(save);
+    int error = load_state(state);
+    cart.restore_save(save);
+    if (error)
+    {
+        if (remove(file_name.c_str()))
+            printf("Unable to remove boot snapshot %s\n", file_name.c_str());
+        boot_cache_failed = true;
+        return false;
+    }
+    printf("Booted from snapshot %s\n", file_name.c_str());
+    return true;
+}
+
+void Emulator::save_boot_snapshot()
+{
+    boot_snapshot_pending = false;
+    boot_entry_reached = false;
+    Save_State state;
+    save_state(state);
+    boot_cache.save(cart.get_ROM_name() + ".boot", state);
+}
+
+//Components are stored in a fixed order, with the cartridge first so that a state for another game is rejected early
+void Emulator::do_state(Save_State& state)
+{
+    cart.do_state(state);
+
+    state.begin_chunk("EMU ", 1);
+    state.sync(cycle_count);
+    state.sync(system_timestamp);
+    state.sync(next_event_time);
+    state.sync(GPU_event);
+    state.sync(DMA_event);
+    state.sync(GX_event);
+    state.sync(cart_event);
+    state.sync(total_timestamp);
+    state.sync(last_arm9_timestamp);
+    state.sync(last_arm7_timestamp);
+    state.sync(cycles);
+
+    state.sync(IPCSYNC_NDS9);
+    state.sync(IPCSYNC_NDS7);
+    fifo7.do_state(state);
+    fifo9.do_state(state);
+    state.sync_queue(fifo7_queue);
+    state.sync_queue(fifo9_queue);
+    state.sync(AUXSPICNT);
+    state.sync(int7_reg);
+    state.sync(int9_reg);
+    state.sync(KEYINPUT);
+    state.sync(EXTKEYIN);
+    state.sync(POWCNT2);
+    state.sync(DMAFILL);
+    state.sync(SIOCNT);
+    state.sync(RCNT);
+    state.sync(EXMEMCNT);
+    state.sync(WRAMCNT);
+    state.sync(DIVCNT);
+    state.sync(DIV_NUMER);
+    state.sync(DIV_DENOM);
+    state.sync(DIV_RESULT);
+    state.sync(DIV_REMRESULT);
+    state.sync(SQRTCNT);
+    state.sync(SQRT_RESULT);
+    state.sync(SQRT_PARAM);
+    state.sync(POSTFLG7);
+    state.sync(POSTFLG9);
+    state.sync(BIOSPROT);
+    state.sync(hstep_even);
+    state.end_chunk();
+
+    //Main RAM and VRAM track their writes, so saving over a state or loading it again only copies what changed since
+    uint32_t since = state.get_memory_gen(&memory);
+    if (!state.is_loading())
+        state.set_memory_gen(&memory, memory.next_generation());
+    state.begin_chunk("MEM ", 1);
+    for (int i = 0; i < (int)GUEST_REGION::COUNT; i++)
+    {
+        GUEST_REGION region = (GUEST_REGION)i;
+        uint32_t size = Guest_Memory::get_region_size(region);
+        if (region == GUEST_REGION::MAIN_RAM || (region >= GUEST_REGION::VRAM_A && region <= GUEST_REGION::VRAM_I))
+            state.sync_pages(memory.get(region), size, memory.get_page_generations(region), since);
+        else
+            state.sync_block(memory.get(region), size);
+    }
+    state.end_chunk();
+
+    arm9.do_state(state);
+    arm7.do_state(state);
+    arm9_cp15.do_state(state);
+    dma.do_state(state);
+    gpu.do_state(state);
+    rtc.do_state(state);
+    spi.do_state(state);
+    spu.do_state(state);
+    timers.do_state(state);
+    wifi.do_state(state);
+}
+
+void Emulator::save_state(Save_State& state)
+{
+    state.begin_save();
+    do_state(state);
+    state.finish();
+}
+
+int Emulator::load_state(Save_State& state)
+{
+    if (!state.begin_load())
+    {
+        printf("Save state corrupted or in wrong format.\n");
+        return 1;
+    }
+    uint32_t since = state.get_memory_gen(&memory);
+    do_state(state);
+
+    //Only the pages written since this state was last saved or loaded were restored.
+    //They no longer match any other state, but do match this one from here on.
+    if (since)
+        memory.mark_dirty_since(since);
+    else
+        memory.mark_all_dirty();
+    if (state.has_failed())
+    {
+        printf("Failed to load save state.\n");
+        return 1;
+    }
+    state.set_memory_gen(&memory, memory.next_generation());
+    return 0;
+}
+
+int Emulator::save_state(string file_name)
+{
+    Save_State state;
+    save_state(state);
+    return state.write_file(file_name);
+}
+
+//A state that fails partway through would leave the emulator half restored, so the current state is kept as a fallback
+int Emulator::load_state(string file_name)
+{
+    Save_State state;
+    if (state.read_file(file_name))
+        return 1;
+
+    Save_State backup;
+    save_state(backup);
+    if (load_state(state))
+    {
+        load_state(backup);
+        return 1;
+    }
+    return 0;
+}
+
+//The buttons and touchscreen follow the host, so whatever is held now stays held in the restored state
+int Emulator::load_state_keeping_input(Save_State& state)
+{
+    KEYINPUT_REG keys = KEYINPUT;
+    EXTKEYIN_REG ext_keys = EXTKEYIN;
+    int error = load_state(state);
+    KEYINPUT = keys;
+    EXTKEYIN = ext_keys;
+    spi.touchscreen_press(touch_x, touch_y);
+    return error;
+}
+
+//Goes back to the latest snapshot, or the one before it if no frames have run since the latest was taken
+//Returns false when there is nothing older to load, which leaves the emulator sitting on the oldest snapshot
+bool Emulator::rewind()
+{
+    if (!rewind_frame_count && !rewind_buffer.pop())
+        return false;
+    Save_State* state = rewind_buffer.get_latest();
+    if (!state || load_state_keeping_input(*state))
+        return false;
+    rewind_frame_count = 0;
+    return true;
+}
+
 void Emulator::debug()
 {
     //arm7.set_disassembly(!arm7.can_disassemble());
@@ -272,13 +546,30 @@ void Emulator::run()
     gpu.start_frame();
     while (!gpu.is_frame_complete())
     {
+        //Taken between steps, so that restoring it resumes exactly where it left off
+        if (boot_entry_reached)
+            save_boot_snapshot();
+
         //Handle ARM9
         calculate_system_timestamp();
-        while (arm9.get_timestamp() < (system_timestamp << 1))
+        if (boot_snapshot_pending)
+        {
+            //Only the first boot with the cache enabled has to watch for the entry point
+            while (arm9.get_timestamp() < (system_timestamp << 1))
+            {
+                if (arm9.get_PC() == boot_entry + 4)
+                    boot_entry_reached = true;
+                arm9.execute();
+                timers.run_timers9(arm9.cycles_ran() >> 1);
+            }
+        }
+        else
         {
-            arm9.execute();
-            timers.run_timers9(arm9.cycles_ran() >> 1);
-            gpu.run_3D(arm9.cycles_ran() >> 1);
+            while (arm9.get_timestamp() < (system_timestamp << 1))
+            {
+                arm9.execute();
+                timers.run_timers9(arm9.cycles_ran() >> 1);
+            }
         }
         //Now handle ARM7
         while (arm7.get_timestamp() < system_timestamp)
@@ -293,9 +584,48 @@ void Emulator::run()
         if (system_timestamp >= DMA_event.activation_time && DMA_event.processing)
             dma.handle_event(DMA_event);
 
-        cart.run(8);
+        if (system_timestamp >= GX_event.activation_time && GX_event.processing)
+        {
+            GX_event.processing = false;
+            gpu.run_3D();
+        }
+
+        if (system_timestamp >= cart_event.activation_time && cart_event.processing)
+            cart.handle_event(cart_event);
     }
+    //Frames run ahead are thrown away, so they are kept out of the save file and the rewind buffer
+    if (running_ahead)
+        return;
     cart.save_check();
+
+    if (Config::rewind_enabled && ++rewind_frame_count >= Config::rewind_interval)
+    {
+        save_state(*rewind_buffer.begin_capture());
+        rewind_buffer.end_capture();
+        rewind_frame_count = 0;
+    }
+}
+
+//Runs a frame, then shows the frame the game reaches after the given number of extra frames with the same input.
+//The extra frames are undone afterwards, so the game appears to respond to input that many frames sooner.
+void Emulator::run_ahead(int frames, uint32_t* upper_buffer, uint32_t* lower_buffer)
+{
+    run();
+    if (frames > 0)
+    {
+        save_state(run_ahead_state);
+        running_ahead = true;
+        for (int i = 1; i <= frames; i++)
+        {
+            gpu.set_skip_rendering(i < frames);
+            run();
+        }
+        running_ahead = false;
+    }
+    get_upper_frame(upper_buffer);
+    get_lower_frame(lower_buffer);
+    if (frames > 0)
+        load_state_keeping_input(run_ahead_state);
 }
 
 uint64_t Emulator::get_timestamp()
@@ -303,6 +633,12 @@ uint64_t Emulator::get_timestamp()
     return system_timestamp;
 }
 
+//The ARM9's position within the current timeslice, in system cycles
+uint64_t Emulator::get_arm9_timestamp()
+{
+    return arm9.get_timestamp() >> 1;
+}
+
 void Emulator::HBLANK_DMA_request()
 {
     dma.HBLANK_request();
@@ -323,6 +659,11 @@ void Emulator::check_GXFIFO_DMA()
     gpu.check_GXFIFO_DMA();
 }
 
+int Emulator::write_GXFIFO_block(const uint32_t* words, int count)
+{
+    return gpu.write_GXFIFO_block(words, count);
+}
+
 void Emulator::add_GPU_event(int event_id, uint64_t relative_time)
 {
     GPU_event.id = event_id;
@@ -340,6 +681,22 @@ void Emulator::add_DMA_event(int event_id, uint64_t relative_time)
         next_event_time = DMA_event.activation_time;
 }
 
+void Emulator::add_GX_event(uint64_t relative_time)
+{
+    GX_event.processing = true;
+    GX_event.activation_time = system_timestamp + relative_time;
+    if (GX_event.activation_time < next_event_time)
+        next_event_time = GX_event.activation_time;
+}
+
+void Emulator::add_cart_event(uint64_t relative_time)
+{
+    cart_event.processing = true;
+    cart_event.activation_time = system_timestamp + relative_time;
+    if (cart_event.activation_time < next_event_time)
+        next_event_time = cart_event.activation_time;
+}
+
 void Emulator::calculate_system_timestamp()
 {
     int cycles = next_event_time - system_timestamp;
@@ -353,6 +710,8 @@ void Emulator::touchscreen_press(int x, int y)
 {
     EXTKEYIN.pen_down = (y != 0xFFF);
     spi.touchscreen_press(x, y);
+    touch_x = x;
+    touch_y = y;
 }
 
 int Emulator::hle_bios(int cpu_id)
@@ -367,9 +726,20 @@ void Emulator::cart_copy_keybuffer(uint8_t *buffer)
     memcpy(buffer, arm7_bios + 0x30, 0x1048);
 }
 
+int Emulator::cart_get_block_words()
+{
+    return cart.get_block_words_ready();
+}
+
+void Emulator::cart_read_block(uint32_t* dest)
+{
+    cart.read_block(dest);
+}
+
 void Emulator::cart_write_header(uint32_t address, uint16_t halfword)
 {
     *(uint16_t*)&main_RAM[(0x027FFE00 + (address & 0x1FF)) & MAIN_RAM_MASK] = halfword;
+    memory.mark_dirty(&main_RAM[(0x027FFE00 + (address & 0x1FF)) & MAIN_RAM_MASK]);
 }
 
 void Emulator::request_interrupt7(INTERRUPT id)
@@ -404,6 +774,16 @@ ARM_CPU* Emulator::get_arm7()
     return &arm7;
 }
 
+GPU* Emulator::get_gpu()
+{
+    return &gpu;
+}
+
+NDS_DMA* Emulator::get_dma()
+{
+    return &dma;
+}
+
 bool Emulator::arm7_has_cart_rights()
 {
     return EXMEMCNT & (1 << 11);
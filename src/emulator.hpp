@@ -7,13 +7,17 @@
 #ifndef emulator_hpp
 #define emulator_hpp
 #include "bios.hpp"
+#include "bootcache.hpp"
 #include "cartridge.hpp"
 #include "cpu.hpp"
 #include "dma.hpp"
 #include "gpu.hpp"
+#include "guestmemory.hpp"
 #include "interrupts.hpp"
 #include "ipc.hpp"
+#include "rewind.hpp"
 #include "rtc.hpp"
+#include "savestate.hpp"
 #include "spi.hpp"
 #include "spu.hpp"
 #include "timers.hpp"
@@ -77,17 +81,29 @@ class Emulator
         SPU spu;
         NDS_Timing timers;
         WiFi wifi;
-    
-        uint8_t main_RAM[1024 * 1024 * 4]; //4 MB
-        uint8_t shared_WRAM[1024 * 32]; //32 KB
-        uint8_t arm7_WRAM[1024 * 64]; //64 KB
+
+        Guest_Memory memory;
+        uint8_t* main_RAM; //4 MB
+        uint8_t* shared_WRAM; //32 KB
+        uint8_t* arm7_WRAM; //64 KB
         uint8_t arm9_bios[BIOS9_SIZE];
         uint8_t arm7_bios[BIOS7_SIZE];
 
+        Rewind_Buffer rewind_buffer;
+        int rewind_frame_count;
+
+        Save_State run_ahead_state;
+        bool running_ahead;
+        int touch_x, touch_y;
+
+        Boot_Cache boot_cache;
+        bool boot_snapshot_pending, boot_entry_reached, boot_cache_failed;
+        uint32_t boot_entry;
+
         //Scheduling
         uint64_t system_timestamp;
         uint64_t next_event_time;
-        SchedulerEvent GPU_event, DMA_event;
+        SchedulerEvent GPU_event, DMA_event, GX_event, cart_event;
     
         IPCSYNC IPCSYNC_NDS9, IPCSYNC_NDS7;
         IPCFIFO fifo7, fifo9;
@@ -130,6 +146,15 @@ class Emulator
 
         void start_division();
         void start_sqrt();
+
+        static uint8_t* get_mirrored_block(uint8_t* mem, uint32_t mask, uint32_t address, uint32_t size);
+
+        void do_state(Save_State& state);
+        int load_state_keeping_input(Save_State& state);
+
+        void make_boot_key();
+        bool load_boot_snapshot();
+        void save_boot_snapshot();
     public:
         Emulator();
         int init();
@@ -142,11 +167,18 @@ class Emulator
 
         void power_on();
         void direct_boot();
+        void save_state(Save_State& state);
+        int load_state(Save_State& state);
+        int save_state(std::string file_name);
+        int load_state(std::string file_name);
+        bool rewind();
         void debug();
         void run();
+        void run_ahead(int frames, uint32_t* upper_buffer, uint32_t* lower_buffer);
         bool requesting_interrupt(int cpu_id);
 
         uint64_t get_timestamp();
+        uint64_t get_arm9_timestamp();
 
         void get_upper_frame(uint32_t* buffer);
         void get_lower_frame(uint32_t* buffer);
@@ -162,9 +194,12 @@ class Emulator
         void gamecart_DMA_request();
         void GXFIFO_DMA_request();
         void check_GXFIFO_DMA();
+        int write_GXFIFO_block(const uint32_t* words, int count);
 
         void add_GPU_event(int event_id, uint64_t relative_time);
         void add_DMA_event(int event_id, uint64_t relative_time);
+        void add_GX_event(uint64_t relative_time);
+        void add_cart_event(uint64_t relative_time);
         void calculate_system_timestamp();
 
         void touchscreen_press(int x, int y);
@@ -183,8 +218,17 @@ class Emulator
         void arm7_write_word(uint32_t address, uint32_t word);
         void arm7_write_halfword(uint32_t address, uint16_t halfword);
         void arm7_write_byte(uint32_t address, uint8_t byte);
+
+        //Host memory behind [address, address + size) when it is plain memory without mirroring
+        //inside the range, or nullptr. Used by DMA to copy whole blocks at once.
+        uint8_t* arm9_get_block(uint32_t address, uint32_t size);
+        uint8_t* arm7_get_block(uint32_t address, uint32_t size);
+        void arm9_block_written(uint32_t address, uint32_t size);
+        void arm7_block_written(uint32_t address, uint32_t size);
     
         void cart_copy_keybuffer(uint8_t* buffer);
+        int cart_get_block_words();
+        void cart_read_block(uint32_t* dest);
         void cart_write_header(uint32_t address, uint16_t halfword);
     
         void request_interrupt7(INTERRUPT id);
@@ -194,6 +238,8 @@ class Emulator
     
         ARM_CPU* get_arm9();
         ARM_CPU* get_arm7();
+        GPU* get_gpu();
+        NDS_DMA* get_dma();
 
         void button_up_pressed();
         void button_down_pressed();
@@ -249,6 +295,13 @@ bool inline Emulator::display_swapped()
     return gpu.display_swapped();
 }
 
+inline uint8_t* Emulator::get_mirrored_block(uint8_t* mem, uint32_t mask, uint32_t address, uint32_t size)
+{
+    if ((address & ~mask) != ((address + size - 1) & ~mask))
+        return nullptr;
+    return &mem[address & mask];
+}
+
 bool inline Emulator::DMA_active()
 {
     return dma.is_active();
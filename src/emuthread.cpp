@@ -13,6 +13,7 @@ using namespace std;
 EmuThread::EmuThread(QObject* parent) : QThread(parent)
 {
     pause_status = 0x1;
+    rewinding = false;
 }
 
 int EmuThread::init()
@@ -66,10 +67,19 @@ void EmuThread::run()
         else
         {
             auto last_update = chrono::system_clock::now();
-            e.run();
+            //Holding rewind steps back one snapshot per frame instead of running
+            //Once the buffer runs out, the last frame shown stays up until rewind is released
+            if (rewinding && Config::rewind_enabled)
+            {
+                if (e.rewind())
+                {
+                    e.get_upper_frame(upper_buffer);
+                    e.get_lower_frame(lower_buffer);
+                }
+            }
+            else
+                e.run_ahead(Config::run_ahead_frames, upper_buffer, lower_buffer);
             frames++;
-            e.get_upper_frame(upper_buffer);
-            e.get_lower_frame(lower_buffer);
             emit finished_frame(upper_buffer, lower_buffer);
 
             //If the game's too fast, sleep the thread
@@ -171,6 +181,9 @@ void EmuThread::press_key(DS_KEYS key)
         case DEBUGGING:
             e.debug();
             break;
+        case REWIND:
+            rewinding = true;
+            break;
     }
     key_mutex.unlock();
 }
@@ -216,6 +229,9 @@ void EmuThread::release_key(DS_KEYS key)
         case BUTTON_SELECT:
             e.button_select_released();
             break;
+        case REWIND:
+            rewinding = false;
+            break;
     }
     key_mutex.unlock();
 }
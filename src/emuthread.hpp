@@ -6,6 +6,7 @@
 
 #ifndef EMUTHREAD_HPP
 #define EMUTHREAD_HPP
+#include <atomic>
 #include <QMutex>
 #include <QThread>
 #include "emulator.hpp"
@@ -24,7 +25,8 @@ enum DS_KEYS
     BUTTON_RIGHT,
     BUTTON_UP,
     BUTTON_DOWN,
-    DEBUGGING
+    DEBUGGING,
+    REWIND
 };
 
 enum PAUSE_EVENT
@@ -43,6 +45,7 @@ class EmuThread : public QThread
         QMutex load_mutex, pause_mutex, key_mutex, screen_mutex;
         int pause_status;
         bool abort;
+        std::atomic<bool> rewinding;
         uint32_t upper_buffer[PIXELS_PER_LINE * SCANLINES], lower_buffer[PIXELS_PER_LINE * SCANLINES];
     public:
         explicit EmuThread(QObject* parent = 0);
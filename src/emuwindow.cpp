@@ -201,6 +201,9 @@ void EmuWindow::keyPressEvent(QKeyEvent *event)
         case Qt::Key_0:
             emit press_key(DEBUGGING);
             break;
+        case Qt::Key_Backspace:
+            emit press_key(REWIND);
+            break;
     }
 }
 
@@ -245,6 +248,11 @@ void EmuWindow::keyReleaseEvent(QKeyEvent *event)
         case Qt::Key_Space:
             emit release_key(BUTTON_SELECT);
             break;
+        case Qt::Key_Backspace:
+            //Auto-repeat sends a release with every repeated press
+            if (!event->isAutoRepeat())
+                emit release_key(REWIND);
+            break;
     }
 }
 
@@ -7,6 +7,7 @@
 #include <fstream>
 #include "emulator.hpp"
 #include "firmware.hpp"
+#include "savestate.hpp"
 
 using namespace std;
 
@@ -94,6 +95,18 @@ void Firmware::direct_boot()
         e->arm7_write_word(0x027FFC80+i, *(uint32_t*)&firmware[user_data+i]);
 }
 
+void Firmware::do_state(Save_State& state)
+{
+    state.begin_chunk("FIRM", 1);
+    state.sync(firmware);
+    state.sync(status_reg);
+    state.sync(user_data);
+    state.sync(command_id);
+    state.sync(address);
+    state.sync(total_args);
+    state.end_chunk();
+}
+
 uint8_t Firmware::transfer_data(uint8_t input)
 {
     total_args++;
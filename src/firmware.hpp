@@ -18,6 +18,7 @@ enum FIRM_COMMAND
 };
 
 class Emulator;
+class Save_State;
 
 class Firmware
 {
@@ -39,9 +40,16 @@ class Firmware
         Firmware(Emulator* e);
         int load_firmware(std::string file_name);
         void direct_boot();
+        void do_state(Save_State& state);
+        const uint8_t* get_image();
     
         uint8_t transfer_data(uint8_t input);
         void deselect();
 };
 
+inline const uint8_t* Firmware::get_image()
+{
+    return firmware;
+}
+
 #endif /* firmware_hpp */
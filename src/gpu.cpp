@@ -9,8 +9,10 @@
 #include "config.hpp"
 #include "emulator.hpp"
 #include "gpu.hpp"
+#include "savestate.hpp"
 
-GPU::GPU(Emulator* e) : e(e), eng_A(this, true), eng_B(this, false), eng_3D(e, this), frame_complete(false), cycles(0)
+GPU::GPU(Emulator* e) : e(e), eng_A(this, true), eng_B(this, false), eng_3D(e, this), frame_complete(false),
+    skip_rendering(false), cycles(0), guest_memory(nullptr)
 {
 
 }
@@ -37,21 +39,55 @@ void GPU::power_on()
     }
 
     e->add_GPU_event(0, 256 * 6);
+}
+
+//VRAM, palettes and OAM live in the emulator's guest memory arena, which is cleared on power on
+void GPU::set_memory(Guest_Memory* memory)
+{
+    VRAM_A = memory->get(GUEST_REGION::VRAM_A);
+    VRAM_B = memory->get(GUEST_REGION::VRAM_B);
+    VRAM_C = memory->get(GUEST_REGION::VRAM_C);
+    VRAM_D = memory->get(GUEST_REGION::VRAM_D);
+    VRAM_E = memory->get(GUEST_REGION::VRAM_E);
+    VRAM_F = memory->get(GUEST_REGION::VRAM_F);
+    VRAM_G = memory->get(GUEST_REGION::VRAM_G);
+    VRAM_H = memory->get(GUEST_REGION::VRAM_H);
+    VRAM_I = memory->get(GUEST_REGION::VRAM_I);
+    palette_A = memory->get(GUEST_REGION::PALETTE_A);
+    palette_B = memory->get(GUEST_REGION::PALETTE_B);
+    OAM = memory->get(GUEST_REGION::OAM);
+    guest_memory = memory;
+}
+
+void GPU::do_state(Save_State& state)
+{
+    state.begin_chunk("GPU ", 1);
+    state.sync(frame_complete);
+    state.sync(frames_skipped);
+    state.sync(cycles);
+    state.sync(DISPSTAT7);
+    state.sync(DISPSTAT9);
+    state.sync(VCOUNT);
+    state.sync(VRAMCNT_A);
+    state.sync(VRAMCNT_B);
+    state.sync(VRAMCNT_C);
+    state.sync(VRAMCNT_D);
+    state.sync(VRAMCNT_E);
+    state.sync(VRAMCNT_F);
+    state.sync(VRAMCNT_G);
+    state.sync(VRAMCNT_H);
+    state.sync(VRAMCNT_I);
+    state.sync(POWCNT1);
+    state.end_chunk();
 
-    memset(VRAM_A, 0, VRAM_A_SIZE);
-    memset(VRAM_B, 0, VRAM_B_SIZE);
-    memset(VRAM_C, 0, VRAM_C_SIZE);
-    memset(VRAM_D, 0, VRAM_D_SIZE);
-    memset(VRAM_E, 0, VRAM_E_SIZE);
-    memset(VRAM_F, 0, VRAM_F_SIZE);
-    memset(VRAM_G, 0, VRAM_G_SIZE);
-    memset(VRAM_H, 0, VRAM_H_SIZE);
-    memset(VRAM_I, 0, VRAM_I_SIZE);
+    eng_A.do_state(state);
+    eng_B.do_state(state);
+    eng_3D.do_state(state);
 }
 
-void GPU::run_3D(uint64_t cycles)
+void GPU::run_3D()
 {
-    eng_3D.run(cycles);
+    eng_3D.sync();
 }
 
 void GPU::get_upper_frame(uint32_t* buffer)
@@ -75,7 +111,7 @@ void GPU::handle_event(SchedulerEvent &event)
     switch (event.id)
     {
         case 0: //Start HBLANK
-            if (VCOUNT < SCANLINES && frames_skipped >= Config::frameskip)
+            if (VCOUNT < SCANLINES && frames_skipped >= Config::frameskip && !skip_rendering)
                 draw_scanline();
             //printf("\nStart HBLANK");
             DISPSTAT7.is_HBLANK = true;
@@ -107,6 +143,7 @@ void GPU::handle_event(SchedulerEvent &event)
             {
                 //VBLANK
                 //printf("\nVBLANK start");
+                eng_3D.sync();
                 eng_3D.end_of_frame();
                 frame_complete = true;
                 if (DISPSTAT7.IRQ_on_VBLANK)
@@ -139,6 +176,93 @@ void GPU::draw_3D_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256], ui
     eng_3D.render_scanline(framebuffer, bg_priorities, bg0_priority);
 }
 
+//Flattens the banks mapped to texture image (4 x 128 KB) and texture palette (6 x 16 KB) memory
+void GPU::copy_texture_VRAM(uint8_t* teximage, uint8_t* texpal)
+{
+    uint8_t* banks[] = {VRAM_A, VRAM_B, VRAM_C, VRAM_D};
+    VRAM_BANKCNT* cnts[] = {&VRAMCNT_A, &VRAMCNT_B, &VRAMCNT_C, &VRAMCNT_D};
+
+    memset(teximage, 0, VRAM_A_SIZE * 4);
+    for (int i = 0; i < 4; i++)
+    {
+        if (!cnts[i]->enabled || cnts[i]->MST != 3)
+            continue;
+        uint8_t* slot = teximage + cnts[i]->offset * VRAM_A_SIZE;
+        for (int j = 0; j < VRAM_A_SIZE; j++)
+            slot[j] |= banks[i][j];
+    }
+
+    memset(texpal, 0, VRAM_F_SIZE * 6);
+    if (VRAMCNT_E.enabled && VRAMCNT_E.MST == 3)
+        memcpy(texpal, VRAM_E, VRAM_E_SIZE);
+    if (VRAMCNT_F.enabled && VRAMCNT_F.MST == 3)
+    {
+        uint8_t* slot = texpal + ((VRAMCNT_F.offset & 0x1) + (VRAMCNT_F.offset & 0x2) * 2) * VRAM_F_SIZE;
+        for (int j = 0; j < VRAM_F_SIZE; j++)
+            slot[j] |= VRAM_F[j];
+    }
+    if (VRAMCNT_G.enabled && VRAMCNT_G.MST == 3)
+    {
+        uint8_t* slot = texpal + ((VRAMCNT_G.offset & 0x1) + (VRAMCNT_G.offset & 0x2) * 2) * VRAM_G_SIZE;
+        for (int j = 0; j < VRAM_G_SIZE; j++)
+            slot[j] |= VRAM_G[j];
+    }
+}
+
+//Texture memory can't be written by the CPUs, so decoded textures only go stale when a bank
+//is remapped or display capture writes into it
+void GPU::texture_VRAM_written(const VRAM_BANKCNT& cnt, int bank, uint32_t offset, uint32_t size)
+{
+    if (!cnt.enabled || cnt.MST != 3)
+        return;
+    switch (bank)
+    {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            eng_3D.invalidate_teximage(cnt.offset * VRAM_A_SIZE + offset, size);
+            break;
+        case 4:
+            eng_3D.invalidate_texpal(offset, size);
+            break;
+        case 5:
+        case 6:
+            eng_3D.invalidate_texpal(((cnt.offset & 0x1) + (cnt.offset & 0x2) * 2) * VRAM_F_SIZE + offset, size);
+            break;
+    }
+}
+
+void GPU::remap_VRAM_bank(const VRAM_BANKCNT& old_cnt, const VRAM_BANKCNT& new_cnt, int bank)
+{
+    if (old_cnt.MST == new_cnt.MST && old_cnt.offset == new_cnt.offset && old_cnt.enabled == new_cnt.enabled)
+        return;
+    uint32_t size = VRAM_A_SIZE;
+    if (bank == 4)
+        size = VRAM_E_SIZE;
+    else if (bank > 4)
+        size = VRAM_F_SIZE;
+    texture_VRAM_written(old_cnt, bank, 0, size);
+    texture_VRAM_written(new_cnt, bank, 0, size);
+}
+
+void GPU::VRAM_block_written(int id, uint32_t offset, uint32_t size)
+{
+    VRAM_BANKCNT* cnts[] = {&VRAMCNT_A, &VRAMCNT_B, &VRAMCNT_C, &VRAMCNT_D};
+    if (id < 0 || id > 3)
+        return;
+    uint8_t* banks[] = {VRAM_A, VRAM_B, VRAM_C, VRAM_D};
+    offset &= VRAM_A_SIZE - 1;
+    if (offset + size > VRAM_A_SIZE)
+    {
+        texture_VRAM_written(*cnts[id], id, 0, offset + size - VRAM_A_SIZE);
+        guest_memory->mark_dirty(banks[id], offset + size - VRAM_A_SIZE);
+        size = VRAM_A_SIZE - offset;
+    }
+    texture_VRAM_written(*cnts[id], id, offset, size);
+    guest_memory->mark_dirty(&banks[id][offset], size);
+}
+
 void GPU::draw_scanline()
 {
     /*if (!POWCNT1.lcd_enable)
@@ -250,39 +374,39 @@ void GPU::write_bga(uint32_t address, uint16_t halfword)
     if (ADDR_IN_RANGE(VRAM_BGA_START + (VRAMCNT_A.offset * 0x20000), VRAM_A_SIZE) && VRAMCNT_A.MST == 1)
     {
         if (VRAMCNT_A.enabled)
-            *(uint16_t*)&VRAM_A[address & VRAM_A_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_A, address & VRAM_A_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGA_START + (VRAMCNT_B.offset * 0x20000), VRAM_B_SIZE) && VRAMCNT_B.MST == 1)
     {
         if (VRAMCNT_B.enabled)
-            *(uint16_t*)&VRAM_B[address & VRAM_B_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_B, address & VRAM_B_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGA_START + (VRAMCNT_C.offset * 0x20000), VRAM_C_SIZE) && VRAMCNT_C.MST == 1)
     {
         if (VRAMCNT_C.enabled)
-            *(uint16_t*)&VRAM_C[address & VRAM_C_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_C, address & VRAM_C_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGA_START + (VRAMCNT_D.offset * 0x20000), VRAM_D_SIZE) && VRAMCNT_D.MST == 1)
     {
         if (VRAMCNT_D.enabled)
-            *(uint16_t*)&VRAM_D[address & VRAM_D_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_D, address & VRAM_D_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGA_START, VRAM_E_SIZE) && VRAMCNT_E.MST == 1)
     {
         if (VRAMCNT_E.enabled)
-            *(uint16_t*)&VRAM_E[address & VRAM_E_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_E, address & VRAM_E_MASK, halfword);
     }
     uint32_t f_offset = (VRAMCNT_F.offset & 0x1) * 0x4000 + (VRAMCNT_F.offset & 0x2) * 0x10000;
     if (ADDR_IN_RANGE(VRAM_BGA_START, f_offset) && VRAMCNT_F.MST == 1)
     {
         if (VRAMCNT_F.enabled)
-            *(uint16_t*)&VRAM_F[address & VRAM_F_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_F, address & VRAM_F_MASK, halfword);
     }
     uint32_t g_offset = (VRAMCNT_G.offset & 0x1) * 0x4000 + (VRAMCNT_G.offset & 0x2) * 0x10000;
     if (ADDR_IN_RANGE(VRAM_BGA_START, g_offset) && VRAMCNT_G.MST == 1)
     {
         if (VRAMCNT_G.enabled)
-            *(uint16_t*)&VRAM_G[address & VRAM_G_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_G, address & VRAM_G_MASK, halfword);
     }
 }
 
@@ -292,17 +416,17 @@ void GPU::write_bgb(uint32_t address, uint16_t halfword)
     if (ADDR_IN_RANGE(VRAM_BGB_C, VRAM_C_SIZE) && VRAMCNT_C.MST == 4)
     {
         if (VRAMCNT_C.enabled)
-            *(uint16_t*)&VRAM_C[address & VRAM_C_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_C, address & VRAM_C_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGB_H, VRAM_H_SIZE) && VRAMCNT_H.MST == 1)
     {
         if (VRAMCNT_H.enabled)
-            *(uint16_t*)&VRAM_H[address & VRAM_H_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_H, address & VRAM_H_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_BGB_I, VRAM_I_SIZE) && VRAMCNT_I.MST == 1)
     {
         if (VRAMCNT_I.enabled)
-            *(uint16_t*)&VRAM_I[address & VRAM_I_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_I, address & VRAM_I_MASK, halfword);
     }
 }
 
@@ -312,29 +436,29 @@ void GPU::write_obja(uint32_t address, uint16_t halfword)
     if (ADDR_IN_RANGE(VRAM_OBJA_START + ((VRAMCNT_A.offset & 0x1) * 0x20000), VRAM_A_SIZE) && VRAMCNT_A.MST == 2)
     {
         if (VRAMCNT_A.enabled)
-            *(uint16_t*)&VRAM_A[address & VRAM_A_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_A, address & VRAM_A_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_OBJA_START + ((VRAMCNT_B.offset & 0x1) * 0x20000), VRAM_B_SIZE) && VRAMCNT_B.MST == 2)
     {
         if (VRAMCNT_B.enabled)
-            *(uint16_t*)&VRAM_B[address & VRAM_B_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_B, address & VRAM_B_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_OBJA_START, VRAM_E_SIZE) && VRAMCNT_E.MST == 2)
     {
         if (VRAMCNT_E.enabled)
-            *(uint16_t*)&VRAM_E[address & VRAM_E_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_E, address & VRAM_E_MASK, halfword);
     }
     uint32_t f_offset = (VRAMCNT_F.offset & 0x1) * 0x4000 + (VRAMCNT_F.offset & 0x2) * 0x10000;
     if (ADDR_IN_RANGE(VRAM_OBJA_START, f_offset) && VRAMCNT_F.MST == 2)
     {
         if (VRAMCNT_F.enabled)
-            *(uint16_t*)&VRAM_F[address & VRAM_F_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_F, address & VRAM_F_MASK, halfword);
     }
     uint32_t g_offset = (VRAMCNT_G.offset & 0x1) * 0x4000 + (VRAMCNT_G.offset & 0x2) * 0x10000;
     if (ADDR_IN_RANGE(VRAM_OBJA_START, g_offset) && VRAMCNT_G.MST == 2)
     {
         if (VRAMCNT_G.enabled)
-            *(uint16_t*)&VRAM_G[address & VRAM_G_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_G, address & VRAM_G_MASK, halfword);
     }
 }
 
@@ -344,12 +468,12 @@ void GPU::write_objb(uint32_t address, uint16_t halfword)
     if (ADDR_IN_RANGE(VRAM_OBJB_START, VRAM_D_SIZE) && VRAMCNT_D.MST == 4)
     {
         if (VRAMCNT_D.enabled)
-            *(uint16_t*)&VRAM_D[address & VRAM_D_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_D, address & VRAM_D_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_OBJB_START, VRAM_I_SIZE) && VRAMCNT_I.MST == 2)
     {
         if (VRAMCNT_I.enabled)
-            *(uint16_t*)&VRAM_I[address & VRAM_I_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_I, address & VRAM_I_MASK, halfword);
     }
 }
 
@@ -358,47 +482,47 @@ void GPU::write_lcdc(uint32_t address, uint16_t halfword)
     if (ADDR_IN_RANGE(VRAM_LCDC_A, VRAM_A_SIZE) && VRAMCNT_A.MST == 0)
     {
         if (VRAMCNT_A.enabled)
-            *(uint16_t*)&VRAM_A[address & VRAM_A_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_A, address & VRAM_A_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_B, VRAM_B_SIZE) && VRAMCNT_B.MST == 0)
     {
         if (VRAMCNT_B.enabled)
-            *(uint16_t*)&VRAM_B[address & VRAM_B_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_B, address & VRAM_B_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_C, VRAM_C_SIZE) && VRAMCNT_C.MST == 0)
     {
         if (VRAMCNT_C.enabled)
-            *(uint16_t*)&VRAM_C[address & VRAM_C_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_C, address & VRAM_C_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_D, VRAM_D_SIZE) && VRAMCNT_D.MST == 0)
     {
         if (VRAMCNT_D.enabled)
-            *(uint16_t*)&VRAM_D[address & VRAM_D_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_D, address & VRAM_D_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_E, VRAM_E_SIZE) && VRAMCNT_E.MST == 0)
     {
         if (VRAMCNT_E.enabled)
-            *(uint16_t*)&VRAM_E[address & VRAM_E_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_E, address & VRAM_E_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_F, VRAM_F_SIZE) && VRAMCNT_F.MST == 0)
     {
         if (VRAMCNT_F.enabled)
-            *(uint16_t*)&VRAM_F[address & VRAM_F_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_F, address & VRAM_F_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_G, VRAM_G_SIZE) && VRAMCNT_G.MST == 0)
     {
         if (VRAMCNT_G.enabled)
-            *(uint16_t*)&VRAM_G[address & VRAM_G_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_G, address & VRAM_G_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_H, VRAM_H_SIZE) && VRAMCNT_H.MST == 0)
     {
         if (VRAMCNT_H.enabled)
-            *(uint16_t*)&VRAM_H[address & VRAM_H_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_H, address & VRAM_H_MASK, halfword);
     }
     if (ADDR_IN_RANGE(VRAM_LCDC_I, VRAM_I_SIZE) && VRAMCNT_I.MST == 0)
     {
         if (VRAMCNT_I.enabled)
-            *(uint16_t*)&VRAM_I[address & VRAM_I_MASK] = halfword;
+            write_VRAM<uint16_t>(VRAM_I, address & VRAM_I_MASK, halfword);
     }
 }
 
@@ -410,8 +534,55 @@ void GPU::write_OAM(uint32_t address, uint16_t halfword)
 uint16_t* GPU::get_palette(bool engine_A)
 {
     if (engine_A)
-        return (uint16_t*)&palette_A;
-    return (uint16_t*)&palette_B;
+        return (uint16_t*)palette_A;
+    return (uint16_t*)palette_B;
+}
+
+uint8_t* GPU::get_palette_block(uint32_t address, uint32_t size)
+{
+    if ((address & ~0x3FF) != ((address + size - 1) & ~0x3FF))
+        return nullptr;
+    if ((address & 0x7FF) < 0x400)
+        return &palette_A[address & 0x3FF];
+    return &palette_B[address & 0x3FF];
+}
+
+//Only a single enabled bank in LCDC mode can be accessed as a block
+uint8_t* GPU::get_lcdc_block(uint32_t address, uint32_t size)
+{
+    uint8_t* banks[] = {VRAM_A, VRAM_B, VRAM_C, VRAM_D, VRAM_E, VRAM_F, VRAM_G, VRAM_H, VRAM_I};
+    VRAM_BANKCNT* cnts[] = {&VRAMCNT_A, &VRAMCNT_B, &VRAMCNT_C, &VRAMCNT_D, &VRAMCNT_E,
+                            &VRAMCNT_F, &VRAMCNT_G, &VRAMCNT_H, &VRAMCNT_I};
+    uint32_t starts[] = {VRAM_LCDC_A, VRAM_LCDC_B, VRAM_LCDC_C, VRAM_LCDC_D, VRAM_LCDC_E,
+                         VRAM_LCDC_F, VRAM_LCDC_G, VRAM_LCDC_H, VRAM_LCDC_I, VRAM_LCDC_END};
+    for (int i = 0; i < 9; i++)
+    {
+        if (address < starts[i] || address >= starts[i + 1])
+            continue;
+        if (address + size > starts[i + 1] || !cnts[i]->enabled || cnts[i]->MST != 0)
+            return nullptr;
+        return &banks[i][address - starts[i]];
+    }
+    return nullptr;
+}
+
+uint8_t* GPU::get_OAM_block(uint32_t address, uint32_t size)
+{
+    if ((address & ~0x7FF) != ((address + size - 1) & ~0x7FF))
+        return nullptr;
+    return &OAM[address & 0x7FF];
+}
+
+void GPU::lcdc_block_written(uint32_t address, uint32_t size)
+{
+    if (address >= VRAM_LCDC_A && address < VRAM_LCDC_E)
+        VRAM_block_written((address - VRAM_LCDC_A) / (VRAM_A_SIZE), address - VRAM_LCDC_A, size);
+    else
+    {
+        uint8_t* block = get_lcdc_block(address, size);
+        if (block)
+            guest_memory->mark_dirty(block, size);
+    }
 }
 
 uint16_t* GPU::get_VRAM_block(int id)
@@ -419,13 +590,13 @@ uint16_t* GPU::get_VRAM_block(int id)
     switch (id)
     {
         case 0:
-            return (uint16_t*)&VRAM_A;
+            return (uint16_t*)VRAM_A;
         case 1:
-            return (uint16_t*)&VRAM_B;
+            return (uint16_t*)VRAM_B;
         case 2:
-            return (uint16_t*)&VRAM_C;
+            return (uint16_t*)VRAM_C;
         case 3:
-            return (uint16_t*)&VRAM_D;
+            return (uint16_t*)VRAM_D;
         default:
             return nullptr;
     }
@@ -902,50 +1073,64 @@ void GPU::set_DISPCAPCNT(uint32_t word)
 
 void GPU::set_VRAMCNT_A(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_A;
     VRAMCNT_A.MST = byte & 0x3;
     VRAMCNT_A.offset = (byte >> 3) & 0x3;
     VRAMCNT_A.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_A, 0);
 }
 
 void GPU::set_VRAMCNT_B(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_B;
     VRAMCNT_B.MST = byte & 0x3;
     VRAMCNT_B.offset = (byte >> 3) & 0x3;
     VRAMCNT_B.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_B, 1);
 }
 
 void GPU::set_VRAMCNT_C(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_C;
     VRAMCNT_C.MST = byte & 0x7;
     VRAMCNT_C.offset = (byte >> 3) & 0x3;
     VRAMCNT_C.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_C, 2);
 }
 
 void GPU::set_VRAMCNT_D(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_D;
     VRAMCNT_D.MST = byte & 0x7;
     VRAMCNT_D.offset = (byte >> 3) & 0x3;
     VRAMCNT_D.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_D, 3);
 }
 
 void GPU::set_VRAMCNT_E(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_E;
     VRAMCNT_E.MST = byte & 0x7;
     VRAMCNT_E.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_E, 4);
 }
 
 void GPU::set_VRAMCNT_F(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_F;
     VRAMCNT_F.MST = byte & 0x7;
     VRAMCNT_F.offset = (byte >> 3) & 0x3;
     VRAMCNT_F.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_F, 5);
 }
 
 void GPU::set_VRAMCNT_G(uint8_t byte)
 {
+    VRAM_BANKCNT old_cnt = VRAMCNT_G;
     VRAMCNT_G.MST = byte & 0x7;
     VRAMCNT_G.offset = (byte >> 3) & 0x3;
     VRAMCNT_G.enabled = byte & (1 << 7);
+    remap_VRAM_bank(old_cnt, VRAMCNT_G, 6);
 }
 
 void GPU::set_VRAMCNT_H(uint8_t byte)
@@ -976,6 +1161,11 @@ void GPU::write_GXFIFO(uint32_t word)
     eng_3D.write_GXFIFO(word);
 }
 
+int GPU::write_GXFIFO_block(const uint32_t* words, int count)
+{
+    return eng_3D.write_GXFIFO_block(words, count);
+}
+
 void GPU::write_FIFO_direct(uint32_t address, uint32_t word)
 {
     eng_3D.write_FIFO_direct(address, word);
@@ -1056,6 +1246,46 @@ void GPU::set_TOON_TABLE(uint32_t address, uint16_t color)
     eng_3D.set_TOON_TABLE(address, color);
 }
 
+void GPU::set_EDGE_COLOR(uint32_t address, uint16_t color)
+{
+    eng_3D.set_EDGE_COLOR(address, color);
+}
+
+void GPU::set_ALPHA_TEST_REF(uint16_t halfword)
+{
+    eng_3D.set_ALPHA_TEST_REF(halfword);
+}
+
+void GPU::set_CLRIMAGE_OFFSET(uint16_t halfword)
+{
+    eng_3D.set_CLRIMAGE_OFFSET(halfword);
+}
+
+void GPU::set_FOG_COLOR(uint32_t word)
+{
+    eng_3D.set_FOG_COLOR(word);
+}
+
+void GPU::set_FOG_COLOR_lo(uint16_t halfword)
+{
+    eng_3D.set_FOG_COLOR_lo(halfword);
+}
+
+void GPU::set_FOG_COLOR_hi(uint16_t halfword)
+{
+    eng_3D.set_FOG_COLOR_hi(halfword);
+}
+
+void GPU::set_FOG_OFFSET(uint16_t halfword)
+{
+    eng_3D.set_FOG_OFFSET(halfword);
+}
+
+void GPU::set_FOG_TABLE(uint32_t address, uint8_t byte)
+{
+    eng_3D.set_FOG_TABLE(address, byte);
+}
+
 void GPU::BEGIN_VTXS(uint32_t word)
 {
     eng_3D.BEGIN_VTXS(word);
@@ -10,6 +10,7 @@
 #include <cstdlib>
 #include "gpu3d.hpp"
 #include "gpueng.hpp"
+#include "guestmemory.hpp"
 #include "memconsts.h"
 
 struct DISPSTAT_REG
@@ -42,6 +43,7 @@ struct POWCNT1_REG
 
 class Emulator;
 struct SchedulerEvent;
+class Save_State;
 
 class GPU
 {
@@ -52,23 +54,25 @@ class GPU
 
         bool frame_complete;
         int frames_skipped;
+        bool skip_rendering;
 
         uint64_t cycles;
 
-        uint8_t VRAM_A[VRAM_A_SIZE];
-        uint8_t VRAM_B[VRAM_B_SIZE];
-        uint8_t VRAM_C[VRAM_C_SIZE];
-        uint8_t VRAM_D[VRAM_D_SIZE];
-        uint8_t VRAM_E[VRAM_E_SIZE];
-        uint8_t VRAM_F[VRAM_F_SIZE];
-        uint8_t VRAM_G[VRAM_G_SIZE];
-        uint8_t VRAM_H[VRAM_H_SIZE];
-        uint8_t VRAM_I[VRAM_I_SIZE];
+        uint8_t* VRAM_A;
+        uint8_t* VRAM_B;
+        uint8_t* VRAM_C;
+        uint8_t* VRAM_D;
+        uint8_t* VRAM_E;
+        uint8_t* VRAM_F;
+        uint8_t* VRAM_G;
+        uint8_t* VRAM_H;
+        uint8_t* VRAM_I;
 
-        uint8_t palette_A[1024];
-        uint8_t palette_B[1024];
+        uint8_t* palette_A;
+        uint8_t* palette_B;
 
-        uint8_t OAM[1024 * 2];
+        uint8_t* OAM;
+        Guest_Memory* guest_memory;
 
         DISPSTAT_REG DISPSTAT7, DISPSTAT9;
 
@@ -85,6 +89,10 @@ class GPU
         void draw_sprite_line(bool engine_a);
 
         void draw_scanline();
+
+        void texture_VRAM_written(const VRAM_BANKCNT& cnt, int bank, uint32_t offset, uint32_t size);
+        void remap_VRAM_bank(const VRAM_BANKCNT& old_cnt, const VRAM_BANKCNT& new_cnt, int bank);
+        template <typename T> void write_VRAM(uint8_t* bank, uint32_t offset, T value);
     public:
         GPU(Emulator* e);
 
@@ -93,7 +101,9 @@ class GPU
         void draw_3D_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256], uint8_t bg0_priority);
 
         void power_on();
-        void run_3D(uint64_t cycles);
+        void set_memory(Guest_Memory* memory);
+        void do_state(Save_State& state);
+        void run_3D();
         void handle_event(SchedulerEvent& event);
 
         void get_upper_frame(uint32_t* buffer);
@@ -104,6 +114,7 @@ class GPU
         void check_GXFIFO_DMA();
         void check_GXFIFO_IRQ();
         bool is_frame_complete();
+        void set_skip_rendering(bool skip);
         bool display_swapped();
         uint16_t read_palette_A(uint32_t address);
         uint16_t read_extpal_bga(uint32_t address);
@@ -118,6 +129,8 @@ class GPU
         template <typename T> T read_objb(uint32_t address);
         template <typename T> T read_teximage(uint32_t address);
         template <typename T> T read_texpal(uint32_t address);
+        void copy_texture_VRAM(uint8_t* teximage, uint8_t* texpal);
+        void VRAM_block_written(int id, uint32_t offset, uint32_t size);
         template <typename T> T read_lcdc(uint32_t address);
         template <typename T> T read_OAM(uint32_t address);
         void write_palette_A(uint32_t address, uint16_t halfword);
@@ -132,7 +145,13 @@ class GPU
         template <typename T> T read_ARM7(uint32_t address);
         template <typename T> void write_ARM7(uint32_t address, T value);
 
+        GPU_2D_Engine* get_engine(bool engine_A);
+        GPU_3D* get_3D_engine();
         uint16_t* get_palette(bool engine_A);
+        uint8_t* get_palette_block(uint32_t address, uint32_t size);
+        uint8_t* get_lcdc_block(uint32_t address, uint32_t size);
+        uint8_t* get_OAM_block(uint32_t address, uint32_t size);
+        void lcdc_block_written(uint32_t address, uint32_t size);
         uint16_t* get_VRAM_block(int id);
 
         uint32_t get_DISPCNT_A();
@@ -272,6 +291,7 @@ class GPU
         void set_POWCNT1(uint16_t value);
 
         void write_GXFIFO(uint32_t word);
+        int write_GXFIFO_block(const uint32_t* words, int count);
         void write_FIFO_direct(uint32_t address, uint32_t word);
 
         void set_CLEAR_COLOR(uint32_t word);
@@ -289,6 +309,14 @@ class GPU
         void set_POLYGON_ATTR(uint32_t word);
         void set_TEXIMAGE_PARAM(uint32_t word);
         void set_TOON_TABLE(uint32_t address, uint16_t color);
+        void set_EDGE_COLOR(uint32_t address, uint16_t color);
+        void set_ALPHA_TEST_REF(uint16_t halfword);
+        void set_CLRIMAGE_OFFSET(uint16_t halfword);
+        void set_FOG_COLOR(uint32_t word);
+        void set_FOG_COLOR_lo(uint16_t halfword);
+        void set_FOG_COLOR_hi(uint16_t halfword);
+        void set_FOG_OFFSET(uint16_t halfword);
+        void set_FOG_TABLE(uint32_t address, uint8_t byte);
         void BEGIN_VTXS(uint32_t word);
         void SWAP_BUFFERS(uint32_t word);
         void VIEWPORT(uint32_t word);
@@ -536,18 +564,26 @@ T GPU::read_ARM7(uint32_t address)
     return reg;
 }
 
+//Every CPU write to VRAM goes through here so that snapshots know which pages changed
+template <typename T>
+inline void GPU::write_VRAM(uint8_t* bank, uint32_t offset, T value)
+{
+    *(T*)&bank[offset] = value;
+    guest_memory->mark_dirty(&bank[offset]);
+}
+
 template <typename T>
 void GPU::write_ARM7(uint32_t address, T value)
 {
     if (VRAMCNT_C.enabled)
     {
         if (ADDR_IN_RANGE(0x06000000 + VRAMCNT_C.offset * 0x20000, VRAM_C_SIZE) && VRAMCNT_C.MST == 2)
-            *(T*)&VRAM_C[address & VRAM_C_MASK] = value;
+            write_VRAM<T>(VRAM_C, address & VRAM_C_MASK, value);
     }
     if (VRAMCNT_D.enabled)
     {
         if (ADDR_IN_RANGE(0x06000000 + VRAMCNT_D.offset * 0x20000, VRAM_D_SIZE) && VRAMCNT_D.MST == 2)
-            *(T*)&VRAM_D[address & VRAM_D_MASK] = value;
+            write_VRAM<T>(VRAM_D, address & VRAM_D_MASK, value);
     }
 }
 
@@ -567,6 +603,12 @@ inline bool GPU::is_frame_complete()
     return frame_complete;
 }
 
+//Frames that will never be shown don't need to be drawn
+inline void GPU::set_skip_rendering(bool skip)
+{
+    skip_rendering = skip;
+}
+
 inline bool GPU::display_swapped()
 {
     return POWCNT1.swap_display;
@@ -582,6 +624,16 @@ inline void GPU::set_lower_buffer(uint32_t *buffer)
     eng_B.set_framebuffer(buffer);
 }
 
+inline GPU_2D_Engine* GPU::get_engine(bool engine_A)
+{
+    return engine_A ? &eng_A : &eng_B;
+}
+
+inline GPU_3D* GPU::get_3D_engine()
+{
+    return &eng_3D;
+}
+
 inline uint16_t GPU::get_VCOUNT()
 {
     return VCOUNT;
@@ -8,8 +8,10 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include "config.hpp"
 #include "emulator.hpp"
 #include "gpu3d.hpp"
+#include "savestate.hpp"
 
 using namespace std;
 
@@ -52,11 +54,6 @@ const uint16_t GPU_3D::cmd_cycle_amounts[256] =
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-void MTX::set(const MTX &mtx)
-{
-    memcpy(m, mtx.m, sizeof(MTX));
-}
-
 const MTX GPU_3D::IDENTITY =
 {
     {
@@ -67,23 +64,74 @@ const MTX GPU_3D::IDENTITY =
     }
 };
 
+//X=(X*200h)+((X+1)/8000h)*1FFh
+static uint32_t get_rear_z(uint32_t clear_depth)
+{
+    return (clear_depth * 0x200) + ((clear_depth + 1) / 0x8000) * 0x1FF;
+}
+
+//Polygon ID and fog flag of the rear-plane, in the format of pixel_attr
+static uint8_t get_rear_attr(uint32_t clear_color)
+{
+    return ((clear_color >> 24) & 0x3F) | (((clear_color >> 15) & 0x1) << 7);
+}
+
+//Expands a 15-bit color to the 6-bit components used by the color buffer
+static uint32_t rgb15_to_buffer(uint16_t color)
+{
+    uint32_t r = color & 0x1F;
+    uint32_t g = (color >> 5) & 0x1F;
+    uint32_t b = (color >> 10) & 0x1F;
+    r = ((r << 1) + !(!r)) << 2;
+    g = ((g << 1) + !(!g)) << 2;
+    b = ((b << 1) + !(!b)) << 2;
+    return 0xFF000000 + (0xFF000000 | (r << 16) | (g << 8) | b);
+}
+
 GPU_3D::GPU_3D(Emulator* e, GPU* gpu) : e(e), gpu(gpu)
 {
+    render_threaded = false;
+    render_pending = false;
+    render_thread_exit = false;
+    lines_rendered = 0;
+    line_waiting = SCANLINES;
+
+    geo_vert = vert_buffers[0];
+    rend_vert = vert_buffers[1];
+    geo_poly = poly_buffers[0];
+    rend_poly = poly_buffers[1];
+}
 
+GPU_3D::~GPU_3D()
+{
+    if (render_thread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(render_mutex);
+            render_thread_exit = true;
+        }
+        render_cond.notify_all();
+        render_thread.join();
+    }
 }
 
 void GPU_3D::power_on()
 {
-    //Clear GXPIPE and GXFIFO
-    queue<GX_Command> empty, empty2;
-    swap(empty, GXPIPE);
-    swap(empty2, GXFIFO);
+    wait_for_render();
+    render_threaded = false;
+    GXPIPE.clear();
+    GXFIFO.clear();
     set_DISP3DCNT(0);
     get_identity_mtx(mult_params);
     get_identity_mtx(projection_mtx);
     get_identity_mtx(vector_mtx);
     get_identity_mtx(modelview_mtx);
     get_identity_mtx(texture_mtx);
+    for (int light = 0; light < 4; light++)
+        update_light_mtx(light);
+    memset(light_memo, 0, sizeof(light_memo));
+    vector_mtx_gen = 1;
+    light_gen = 1;
     mult_params_index = 0;
     geo_vert_count = 0;
     geo_poly_count = 0;
@@ -95,6 +143,7 @@ void GPU_3D::power_on()
     clip_dirty = true;
 
     cycles = 0;
+    geo_timestamp = 0;
     param_count = 0;
     cmd_param_count = 0;
     cmd_count = 0;
@@ -109,8 +158,662 @@ void GPU_3D::power_on()
 
     current_color = 0x7FFF;
     CLEAR_DEPTH = 0x7FFF;
+    CLEAR_COLOR = 0;
+    memset(TOON_TABLE, 0, sizeof(TOON_TABLE));
+    memset(EDGE_COLOR, 0, sizeof(EDGE_COLOR));
+    ALPHA_TEST_REF = 0;
+    CLRIMAGE_OFFSET = 0;
+    FOG_COLOR = 0;
+    FOG_OFFSET = 0;
+    memset(FOG_TABLE, 0, sizeof(FOG_TABLE));
+
+    latch_render_regs();
+    lines_rendered = 0;
+    lines_rasterized = 0;
+
+    clear_texture_cache();
+    texture_cache_hits = 0;
+    texture_cache_misses = 0;
+    light_memo_hits = 0;
+    light_memo_misses = 0;
+    span_pixels = 0;
+    culled_pixels = 0;
+    drawn_pixels = 0;
+}
+
+void GPU_3D::do_state(Save_State& state)
+{
+    //The render thread has to finish with the buffers before they are copied
+    wait_for_render();
+
+    state.begin_chunk("3D  ", 1);
+    state.sync(cycles);
+    state.sync(geo_timestamp);
+    state.sync(DISP3DCNT);
+    state.sync(POLYGON_ATTR);
+    state.sync(TEXIMAGE_PARAM);
+    state.sync(TOON_TABLE);
+    state.sync(EDGE_COLOR);
+    state.sync(ALPHA_TEST_REF);
+    state.sync(CLRIMAGE_OFFSET);
+    state.sync(FOG_COLOR);
+    state.sync(FOG_OFFSET);
+    state.sync(FOG_TABLE);
+    state.sync(PLTT_BASE);
+    state.sync(viewport);
+    state.sync(GXSTAT);
+    state.sync(POLYGON_TYPE);
+    state.sync(CLEAR_DEPTH);
+    state.sync(CLEAR_COLOR);
+    state.sync(flush_mode);
+
+    state.sync(GXFIFO);
+    state.sync(GXPIPE);
+    if (state.is_loading() && !state.has_failed() && (!GXFIFO.validate() || !GXPIPE.validate()))
+    {
+        printf("Save state has an invalid GXFIFO (%u entries) or GXPIPE (%u entries)\n", GXFIFO.count, GXPIPE.count);
+        GXFIFO.clear();
+        GXPIPE.clear();
+        state.fail();
+        return;
+    }
+    state.sync(cmd_params);
+    state.sync(param_count);
+    state.sync(cmd_param_count);
+    state.sync(cmd_count);
+    state.sync(total_params);
+    state.sync(current_cmd);
+    state.sync(current_poly_attr);
+    state.sync(current_color);
+    state.sync(current_vertex);
+    state.sync(current_texcoords);
+
+    state.sync(z_buffer);
+    state.sync(z_block_max);
+    state.sync(color_buffer);
+    state.sync(pixel_state);
+    state.sync(pixel_attr);
+    for (int line = 0; line < SCANLINES; line++)
+        state.sync_vector(trans_fragments[line]);
+
+    state.sync(render_DISP3DCNT);
+    state.sync(render_TOON_TABLE);
+    state.sync(render_CLEAR_DEPTH);
+    state.sync(render_CLEAR_COLOR);
+    state.sync(render_EDGE_COLOR);
+    state.sync(render_ALPHA_TEST_REF);
+    state.sync(render_fog);
+    state.sync(render_threaded);
+    int rendered = lines_rendered;
+    state.sync(rendered);
+    lines_rendered = rendered;
+    state.sync(lines_rasterized);
+    state.sync(swap_buffers);
+
+    //Only the used part of vertex and polygon RAM is stored, along with which half is which
+    int geo_vert_half = geo_vert != vert_buffers[0];
+    int geo_poly_half = geo_poly != poly_buffers[0];
+    state.sync(geo_vert_half);
+    state.sync(geo_poly_half);
+    state.sync(geo_vert_count);
+    state.sync(rend_vert_count);
+    state.sync(geo_poly_count);
+    state.sync(rend_poly_count);
+    if (state.is_loading())
+    {
+        if (geo_vert_count < 0 || geo_vert_count > 6188 || rend_vert_count < 0 || rend_vert_count > 6188 ||
+                geo_poly_count < 0 || geo_poly_count > 2048 || rend_poly_count < 0 || rend_poly_count > 2048)
+        {
+            state.fail();
+            return;
+        }
+        geo_vert = vert_buffers[geo_vert_half & 0x1];
+        rend_vert = vert_buffers[!(geo_vert_half & 0x1)];
+        geo_poly = poly_buffers[geo_poly_half & 0x1];
+        rend_poly = poly_buffers[!(geo_poly_half & 0x1)];
+    }
+    state.sync_block(geo_vert, geo_vert_count * sizeof(Vertex));
+    state.sync_block(rend_vert, rend_vert_count * sizeof(Vertex));
+    state.sync_block(geo_poly, geo_poly_count * sizeof(Polygon));
+    state.sync_block(rend_poly, rend_poly_count * sizeof(Polygon));
+    state.sync(vertex_list);
+    state.sync(vertex_list_count);
+    state.sync(consecutive_polygons);
+    state.sync(VTX_16_index);
+
+    state.sync(MTX_MODE);
+    state.sync(projection_mtx);
+    state.sync(vector_mtx);
+    state.sync(modelview_mtx);
+    state.sync(texture_mtx);
+    state.sync(projection_stack);
+    state.sync(texture_stack);
+    state.sync(modelview_stack);
+    state.sync(vector_stack);
+    state.sync(clip_mtx);
+    state.sync(clip_dirty);
+    state.sync(modelview_sp);
+    state.sync(mult_params);
+    state.sync(mult_params_index);
+
+    state.sync(emission_color);
+    state.sync(ambient_color);
+    state.sync(diffuse_color);
+    state.sync(specular_color);
+    state.sync(light_color);
+    state.sync(light_direction);
+    state.sync(diffuse_light_mtx);
+    state.sync(shine_light_mtx);
+    state.sync(normal_vector);
+    state.sync(shine_table);
+    state.sync(using_shine_table);
+    state.sync(vec_test_result);
+    state.sync(vector_mtx_gen);
+    state.sync(light_gen);
+    state.end_chunk();
+
+    //Decoded textures and lit colors may have come from memory the state replaced
+    if (state.is_loading())
+    {
+        clear_texture_cache();
+        memset(light_memo, 0, sizeof(light_memo));
+    }
+}
+
+template <typename T>
+T GPU_3D::read_teximage(uint32_t address)
+{
+    if (render_threaded)
+    {
+        if (address >= TEXIMAGE_SIZE)
+            return 0;
+        return *(T*)&teximage_snapshot[address];
+    }
+    return gpu->read_teximage<T>(address);
+}
+
+template <typename T>
+T GPU_3D::read_texpal(uint32_t address)
+{
+    if (render_threaded)
+    {
+        if (address >= TEXPAL_SIZE)
+            return 0;
+        return *(T*)&texpal_snapshot[address];
+    }
+    return gpu->read_texpal<T>(address);
+}
 
-    last_poly_strip = nullptr;
+void GPU_3D::start_render()
+{
+    //Texture memory may be remapped or rewritten while the frame renders, so the renderer gets its own copy
+    gpu->copy_texture_VRAM(teximage_snapshot, texpal_snapshot);
+
+    lock_guard<mutex> lock(render_mutex);
+    if (!render_thread.joinable())
+        render_thread = thread(&GPU_3D::render_thread_loop, this);
+    lines_rendered = 0;
+    render_pending = true;
+    render_cond.notify_all();
+}
+
+void GPU_3D::wait_for_render()
+{
+    unique_lock<mutex> lock(render_mutex);
+    render_cond.wait(lock, [this] { return !render_pending; });
+}
+
+//Yields for a short while, as the line is usually almost done, then sleeps until the render thread publishes it
+void GPU_3D::wait_for_line(int line)
+{
+    for (int i = 0; i < RENDER_SPIN_LIMIT; i++)
+    {
+        if (lines_rendered.load(memory_order_acquire) > line)
+            return;
+        this_thread::yield();
+    }
+
+    unique_lock<mutex> lock(render_mutex);
+    line_waiting = line;
+    render_cond.wait(lock, [this, line] { return lines_rendered > line; });
+    line_waiting = SCANLINES;
+}
+
+//Both sides use sequentially consistent accesses, so either the waiter sees the new count or this sees the waiter
+void GPU_3D::publish_lines(int count)
+{
+    lines_rendered = count;
+    if (line_waiting < count)
+    {
+        lock_guard<mutex> lock(render_mutex);
+        render_cond.notify_all();
+    }
+}
+
+void GPU_3D::render_thread_loop()
+{
+    unique_lock<mutex> lock(render_mutex);
+    while (true)
+    {
+        render_cond.wait(lock, [this] { return render_pending || render_thread_exit; });
+        if (render_thread_exit)
+            return;
+
+        lock.unlock();
+        //Post-passes need the line below, so each line is finished one line behind the rasterizer
+        for (int line = 0; line < SCANLINES; line++)
+        {
+            render_line(line);
+            if (line > 0)
+            {
+                post_process_line(line - 1);
+                publish_lines(line);
+            }
+        }
+        post_process_line(SCANLINES - 1);
+        publish_lines(SCANLINES);
+        lock.lock();
+
+        render_pending = false;
+        render_cond.notify_all();
+    }
+}
+
+//Decodes a single texel into 6-bit color and 5-bit alpha, or 0 if it is transparent
+uint32_t GPU_3D::decode_texel(const TEXIMAGE_PARAM_REG& texparams, uint32_t pal_base, int s, int t)
+{
+    int tex_width = 8 << texparams.s_size;
+    uint32_t tex_VRAM_offset = texparams.VRAM_offset * 8;
+    uint16_t tr = 0x3E, tg = 0x3E, tb = 0x3E, ta = 0x1F;
+
+    switch (texparams.format)
+    {
+        case 1: //A3I5
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr += tex_VRAM_offset;
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+            int color_index = data & 0x1F;
+            int alpha_index = data >> 5;
+            ta = (alpha_index << 2) + (alpha_index >> 1);
+
+            if (color_index || !texparams.color0_transparent)
+            {
+                uint32_t pal_addr = color_index * 2;
+                pal_addr += pal_base * 0x10;
+                uint16_t pal_color = read_texpal<uint16_t>(pal_addr);
+                tr = (pal_color & 0x1F) << 1;
+                tg = ((pal_color >> 5) & 0x1F) << 1;
+                tb = ((pal_color >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        case 2: //4 color palette
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr /= 4;
+            texel_addr += tex_VRAM_offset;
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+            data = (data >> ((texel_addr & 0x3) * 2)) & 0x3;
+
+            if (data || !texparams.color0_transparent)
+            {
+                uint32_t pal_addr = data * 2;
+                pal_addr += pal_base * 0x8;
+                uint16_t pal_color = read_texpal<uint16_t>(pal_addr);
+                tr = (pal_color & 0x1F) << 1;
+                tg = ((pal_color >> 5) & 0x1F) << 1;
+                tb = ((pal_color >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        case 3: //16 color palette
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr /= 2;
+            texel_addr += tex_VRAM_offset;
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+            if (s & 0x1)
+                data >>= 4;
+            else
+                data &= 0xF;
+
+            if (data || !texparams.color0_transparent)
+            {
+                uint32_t pal_addr = data * 2;
+                pal_addr += pal_base * 0x10;
+                uint16_t pal_color = read_texpal<uint16_t>(pal_addr);
+                tr = (pal_color & 0x1F) << 1;
+                tg = ((pal_color >> 5) & 0x1F) << 1;
+                tb = ((pal_color >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        case 4: //256 color palette
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr += tex_VRAM_offset;
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+
+            if (data || !texparams.color0_transparent)
+            {
+                uint32_t pal_addr = data * 2;
+                pal_addr += pal_base * 0x10;
+                uint16_t pal_color = read_texpal<uint16_t>(pal_addr);
+                tr = (pal_color & 0x1F) << 1;
+                tg = ((pal_color >> 5) & 0x1F) << 1;
+                tb = ((pal_color >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        case 5: //Compressed 4x4
+        {
+            uint32_t texel_addr = s & 0x3FC;
+            texel_addr += (t & 0x3FC) * (tex_width >> 2);
+            texel_addr += tex_VRAM_offset;
+            texel_addr += (t & 0x3);
+
+            uint32_t slot1_addr = 0x20000 + ((texel_addr >> 1) & 0xFFFE);
+            if (texel_addr >= 0x40000)
+                slot1_addr += 0x10000;
+
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+            data >>= 2 * (s & 0x3);
+            data &= 0x3;
+            uint16_t palette_data = read_teximage<uint16_t>(slot1_addr);
+            uint32_t palette_offset = (palette_data & 0x3FFF) << 2;
+
+            uint32_t palette_base = pal_base * 0x10;
+
+            uint16_t color = 0;
+            switch (data)
+            {
+                case 0:
+                    color = read_texpal<uint16_t>(palette_base + palette_offset);
+                    break;
+                case 1:
+                    color = read_texpal<uint16_t>(palette_base + palette_offset + 2);
+                    break;
+                case 2:
+                    if ((palette_data >> 14) == 1)
+                    {
+                        uint16_t color0 = read_texpal<uint16_t>(palette_base + palette_offset);
+                        uint16_t color1 = read_texpal<uint16_t>(palette_base + palette_offset + 2);
+
+                        int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
+                        int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
+                        int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
+
+                        int r = (r0 + r1) >> 1;
+                        int g = (g0 + g1) >> 1;
+                        int b = (b0 + b1) >> 1;
+
+                        color = r | (g << 5) | (b << 10);
+                    }
+                    else if ((palette_data >> 14) == 3)
+                    {
+                        uint16_t color0 = read_texpal<uint16_t>(palette_base + palette_offset);
+                        uint16_t color1 = read_texpal<uint16_t>(palette_base + palette_offset + 2);
+
+                        int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
+                        int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
+                        int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
+
+                        int r = (r0 * 5 + r1 * 3) >> 3;
+                        int g = (g0 * 5 + g1 * 3) >> 3;
+                        int b = (b0 * 5 + b1 * 3) >> 3;
+
+                        color = r | (g << 5) | (b << 10);
+                    }
+                    else
+                        color = read_texpal<uint16_t>(palette_base + palette_offset + 4);
+                    break;
+                case 3:
+                    if ((palette_data >> 14) == 2)
+                        color = read_texpal<uint16_t>(palette_base + palette_offset + 6);
+                    else if ((palette_data >> 14) == 3)
+                    {
+                        uint16_t color0 = read_texpal<uint16_t>(palette_base + palette_offset);
+                        uint16_t color1 = read_texpal<uint16_t>(palette_base + palette_offset + 2);
+
+                        int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
+                        int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
+                        int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
+
+                        int r = (r0 * 3 + r1 * 5) >> 3;
+                        int g = (g0 * 3 + g1 * 5) >> 3;
+                        int b = (b0 * 3 + b1 * 5) >> 3;
+
+                        color = r | (g << 5) | (b << 10);
+                    }
+                    else
+                    {
+                        color = 0;
+                        ta = 0;
+                    }
+                    break;
+                default:
+                    printf("\nUnrecognized 4x4 texel data type %d", data);
+                    exit(1);
+            }
+
+            tr = (color & 0x1F) << 1;
+            tg = ((color >> 5) & 0x1F) << 1;
+            tb = ((color >> 10) & 0x1F) << 1;
+        }
+            break;
+        case 6: //A5I3
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr += tex_VRAM_offset;
+            uint8_t data = read_teximage<uint8_t>(texel_addr);
+            int color_index = data & 0x7;
+            ta = data >> 3;
+
+            if (color_index || !texparams.color0_transparent)
+            {
+                uint32_t pal_addr = color_index * 2;
+                pal_addr += pal_base * 0x10;
+                uint16_t pal_color = read_texpal<uint16_t>(pal_addr);
+                tr = (pal_color & 0x1F) << 1;
+                tg = ((pal_color >> 5) & 0x1F) << 1;
+                tb = ((pal_color >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        case 7: //Direct color
+        {
+            uint32_t texel_addr = s;
+            texel_addr += t * tex_width;
+            texel_addr *= 2;
+            texel_addr += tex_VRAM_offset;
+            uint16_t data = read_teximage<uint16_t>(texel_addr);
+            if (data & (1 << 15))
+            {
+                tr = (data & 0x1F) << 1;
+                tg = ((data >> 5) & 0x1F) << 1;
+                tb = ((data >> 10) & 0x1F) << 1;
+            }
+            else
+                ta = 0;
+        }
+            break;
+        default:
+            printf("\nUnrecognized texture format %d", texparams.format);
+            exit(1);
+    }
+
+    if (!ta)
+        return 0;
+    return (ta << 24) | (tr << 16) | (tg << 8) | tb;
+}
+
+uint32_t* GPU_3D::get_texture(const Polygon& poly)
+{
+    //The render thread only sees changes flushed at VBLANK
+    if (!render_threaded && texture_dirty)
+        flush_dirty_textures();
+
+    const TEXIMAGE_PARAM_REG& texparams = poly.texparams;
+    uint32_t pal_base = (texparams.format == 7) ? 0 : poly.palette_base;
+    uint64_t key = texparams.VRAM_offset;
+    key |= texparams.format << 16;
+    key |= texparams.s_size << 19;
+    key |= texparams.t_size << 22;
+    key |= texparams.color0_transparent << 25;
+    key |= (uint64_t)pal_base << 26;
+
+    auto cached = texture_cache.find(key);
+    if (cached != texture_cache.end())
+    {
+        texture_cache_hits++;
+        texture_lru.splice(texture_lru.begin(), texture_lru, cached->second.lru_pos);
+        return cached->second.texels.data();
+    }
+    texture_cache_misses++;
+
+    int tex_width = 8 << texparams.s_size;
+    int tex_height = 8 << texparams.t_size;
+    uint32_t texel_count = tex_width * tex_height;
+
+    //Evict least recently used textures
+    while (texture_lru.size() && texture_cache_texels + texel_count > TEXTURE_CACHE_TEXELS)
+    {
+        auto victim = texture_cache.find(texture_lru.back());
+        texture_cache_texels -= victim->second.texels.size();
+        texture_cache.erase(victim);
+        texture_lru.pop_back();
+    }
+
+    Cached_Texture& tex = texture_cache[key];
+    tex.texels.resize(texel_count);
+    for (int t = 0; t < tex_height; t++)
+    {
+        for (int s = 0; s < tex_width; s++)
+            tex.texels[s + t * tex_width] = decode_texel(texparams, pal_base, s, t);
+    }
+    texture_cache_texels += texel_count;
+    texture_lru.push_front(key);
+    tex.lru_pos = texture_lru.begin();
+
+    uint32_t image_size = 0, pal_size = 0;
+    uint32_t pal_start = pal_base * 0x10;
+    switch (texparams.format)
+    {
+        case 1:
+            image_size = texel_count;
+            pal_size = 32 * 2;
+            break;
+        case 2:
+            image_size = texel_count / 4;
+            pal_start = pal_base * 0x8;
+            pal_size = 4 * 2;
+            break;
+        case 3:
+            image_size = texel_count / 2;
+            pal_size = 16 * 2;
+            break;
+        case 4:
+            image_size = texel_count;
+            pal_size = 256 * 2;
+            break;
+        case 5:
+            //Palette offsets come from slot 1, so any palette entry past the base may be used
+            image_size = texel_count / 4;
+            pal_size = TEXPAL_SIZE;
+            break;
+        case 6:
+            image_size = texel_count;
+            pal_size = 8 * 2;
+            break;
+        case 7:
+            image_size = texel_count * 2;
+            break;
+    }
+    tex.image_start = texparams.VRAM_offset * 8;
+    tex.image_end = tex.image_start + image_size;
+    tex.slot1_start = 0;
+    tex.slot1_end = 0;
+    if (texparams.format == 5)
+    {
+        tex.slot1_start = (tex.image_start >= 0x40000) ? 0x30000 : 0x20000;
+        tex.slot1_end = tex.slot1_start + 0x10000;
+    }
+    tex.pal_start = pal_start;
+    tex.pal_end = pal_start + pal_size;
+    return tex.texels.data();
+}
+
+void GPU_3D::flush_dirty_textures()
+{
+    auto range_dirty = [](bool* pages, uint32_t page_count, uint32_t page_size, uint32_t start, uint32_t end)
+    {
+        for (uint32_t page = start / page_size; page * page_size < end && page < page_count; page++)
+        {
+            if (pages[page])
+                return true;
+        }
+        return false;
+    };
+
+    auto it = texture_cache.begin();
+    while (it != texture_cache.end())
+    {
+        Cached_Texture& tex = it->second;
+        if (range_dirty(teximage_dirty, TEXIMAGE_PAGES, TEXIMAGE_PAGE_SIZE, tex.image_start, tex.image_end) ||
+            range_dirty(teximage_dirty, TEXIMAGE_PAGES, TEXIMAGE_PAGE_SIZE, tex.slot1_start, tex.slot1_end) ||
+            range_dirty(texpal_dirty, TEXPAL_PAGES, TEXPAL_PAGE_SIZE, tex.pal_start, tex.pal_end))
+        {
+            texture_cache_texels -= tex.texels.size();
+            texture_lru.erase(tex.lru_pos);
+            it = texture_cache.erase(it);
+        }
+        else
+            it++;
+    }
+
+    memset(teximage_dirty, 0, sizeof(teximage_dirty));
+    memset(texpal_dirty, 0, sizeof(texpal_dirty));
+    texture_dirty = false;
+}
+
+void GPU_3D::clear_texture_cache()
+{
+    texture_cache.clear();
+    texture_lru.clear();
+    texture_cache_texels = 0;
+    memset(teximage_dirty, 0, sizeof(teximage_dirty));
+    memset(texpal_dirty, 0, sizeof(texpal_dirty));
+    texture_dirty = false;
+}
+
+void GPU_3D::invalidate_teximage(uint32_t address, uint32_t size)
+{
+    for (uint32_t page = address / TEXIMAGE_PAGE_SIZE; page * TEXIMAGE_PAGE_SIZE < address + size && page < TEXIMAGE_PAGES; page++)
+        teximage_dirty[page] = true;
+    texture_dirty = true;
+}
+
+void GPU_3D::invalidate_texpal(uint32_t address, uint32_t size)
+{
+    for (uint32_t page = address / TEXPAL_PAGE_SIZE; page * TEXPAL_PAGE_SIZE < address + size && page < TEXPAL_PAGES; page++)
+        texpal_dirty[page] = true;
+    texture_dirty = true;
 }
 
 //Applies perspective correction interpolation on a pixel with attributes u1, u2
@@ -127,21 +830,40 @@ int64_t GPU_3D::interpolate(uint64_t pixel, uint64_t pixel_range, int64_t u1, in
     return bark / denom;
 }
 
+void GPU_3D::update_z_block_max(int line, int left_x, int right_x)
+{
+    for (int block = left_x / Z_BLOCK_WIDTH; block <= right_x / Z_BLOCK_WIDTH; block++)
+    {
+        uint32_t* z = &z_buffer[line][block * Z_BLOCK_WIDTH];
+        uint32_t max_z = z[0];
+        for (int i = 1; i < Z_BLOCK_WIDTH; i++)
+            max_z = max(max_z, z[i]);
+        z_block_max[line][block] = max_z;
+    }
+}
+
 //((1-a)(u0*w1) + a(u1*w0)) / ((1-a)*w1 + a*w0)
 //finalZ = (((vertexZ * 0x4000) / vertexW) + 0x3FFF) * 0x200
-void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256], uint8_t bg0_priority)
+void GPU_3D::render_line(int line)
 {
-    int line = gpu->get_VCOUNT();
+    uint8_t trans_poly_ids[PIXELS_PER_LINE];
+    uint8_t highlight[PIXELS_PER_LINE];
+    GX_Span span;
+    uint32_t alpha_ref = render_DISP3DCNT.alpha_test ? render_ALPHA_TEST_REF : 0;
+
     //Draw the rear-plane
-    //X=(X*200h)+((X+1)/8000h)*1FFh
-    uint32_t rear_z = (CLEAR_DEPTH * 0x200) + ((CLEAR_DEPTH + 1) / 0x8000) * 0x1FF;
+    uint32_t rear_z = get_rear_z(render_CLEAR_DEPTH);
 
     for (int i = 0; i < PIXELS_PER_LINE; i++)
     {
         z_buffer[line][i] = rear_z;
         trans_poly_ids[i] = 0xFF;
     }
-    int y_coord = line * PIXELS_PER_LINE;
+    for (int i = 0; i < Z_BLOCKS; i++)
+        z_block_max[line][i] = rear_z;
+    memset(pixel_state[line], PIXEL_EMPTY, PIXELS_PER_LINE);
+    memset(pixel_attr[line], get_rear_attr(render_CLEAR_COLOR), PIXELS_PER_LINE);
+    trans_fragments[line].clear();
     for (int i = 0; i < rend_poly_count; i++)
     {
         if (line < rend_poly[i].top_y || line > rend_poly[i].bottom_y)
@@ -157,33 +879,33 @@ void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256],
         int32_t left_w, right_w;
         int16_t left_s, left_t, right_s, right_t;
 
-        uint32_t vert_pointer = rend_poly[i].vert_index;
+        const uint16_t* vert_indices = rend_poly[i].vert_indices;
 
         //Figure out the leftmost/rightmost points on the polygon on this scanline
         //Using a variation of Bresenham's line algorithm
         for (int vert = 0; vert < rend_poly[i].vertices; vert++)
         {
-            int x1 = rend_vert[vert_pointer + vert].coords[0],
-                y1 = rend_vert[vert_pointer + vert].coords[1],
-                x2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].coords[0],
-                y2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].coords[1];
-
-            int16_t s1 = (int16_t)rend_vert[vert_pointer + vert].texcoords[0],
-                    s2 = (int16_t)rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].texcoords[0],
-                    t1 = (int16_t)rend_vert[vert_pointer + vert].texcoords[1],
-                    t2 = (int16_t)rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].texcoords[1];
-
-            int32_t z1 = rend_vert[vert_pointer + vert].coords[2],
-                    z2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].coords[2];
-            int32_t w1 = rend_vert[vert_pointer + vert].coords[3],
-                    w2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].coords[3];
-
-            uint32_t r1 = rend_vert[vert_pointer + vert].final_colors[0],
-                     g1 = rend_vert[vert_pointer + vert].final_colors[1],
-                     b1 = rend_vert[vert_pointer + vert].final_colors[2],
-                     r2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].final_colors[0],
-                     g2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].final_colors[1],
-                     b2 = rend_vert[vert_pointer + ((vert + 1) % rend_poly[i].vertices)].final_colors[2];
+            int x1 = rend_vert[vert_indices[vert]].coords[0],
+                y1 = rend_vert[vert_indices[vert]].coords[1],
+                x2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].coords[0],
+                y2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].coords[1];
+
+            int16_t s1 = (int16_t)rend_vert[vert_indices[vert]].texcoords[0],
+                    s2 = (int16_t)rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].texcoords[0],
+                    t1 = (int16_t)rend_vert[vert_indices[vert]].texcoords[1],
+                    t2 = (int16_t)rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].texcoords[1];
+
+            int32_t z1 = rend_vert[vert_indices[vert]].coords[2],
+                    z2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].coords[2];
+            int32_t w1 = rend_vert[vert_indices[vert]].coords[3],
+                    w2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].coords[3];
+
+            uint32_t r1 = rend_vert[vert_indices[vert]].final_colors[0],
+                     g1 = rend_vert[vert_indices[vert]].final_colors[1],
+                     b1 = rend_vert[vert_indices[vert]].final_colors[2],
+                     r2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].final_colors[0],
+                     g2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].final_colors[1],
+                     b2 = rend_vert[vert_indices[((vert + 1) % rend_poly[i].vertices)]].final_colors[2];
 
             //Transpose steep lines (lines with a positive slope greater than one)
             bool steep = abs(y2 - y1) > abs(x2 - x1);
@@ -296,49 +1018,81 @@ void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256],
 
         //Calculate texture stuff in advance
         TEXIMAGE_PARAM_REG texparams = rend_poly[i].texparams;
-        bool texture_mapping = DISP3DCNT.texture_mapping && texparams.format;
+        bool texture_mapping = render_DISP3DCNT.texture_mapping && texparams.format;
         int tex_width = 8 << texparams.s_size;
         int tex_height = 8 << texparams.t_size;
-        uint32_t tex_VRAM_offset = texparams.VRAM_offset * 8;
+        uint32_t* texels = nullptr;
+        if (texture_mapping)
+            texels = get_texture(rend_poly[i]);
 
-        //Fill the polygon
-        for (int x = left_x; x <= right_x; x++)
+        //Fill the polygon one span at a time
+        span.count = line_len;
+        if (span.count <= 0)
+            continue;
+
+        //Depth for every pixel, stepping the numerator and denominator of interpolate() across the span
+        uint64_t z_start = line_len * (uint64_t)((int64_t)left_z * right_w);
+        uint64_t z_step = (uint64_t)((int64_t)right_z * left_w) - (uint64_t)((int64_t)left_z * right_w);
+        uint64_t denom_start = line_len * (uint64_t)(int64_t)right_w;
+        uint64_t denom_step = (uint64_t)(int64_t)left_w - (uint64_t)(int64_t)right_w;
+
+        //With positive w and no overflow, depth along the span is monotonic,
+        //so the ends of a block bound every pixel in between
+        bool coarse_test = !rend_poly[i].attributes.depth_test_equal &&
+                left_w > 0 && right_w > 0 && left_w < (1 << 29) && right_w < (1 << 29) &&
+                left_z < (1 << 24) && right_z < (1 << 24);
+
+        span_pixels += span.count;
+        int block_start = 0;
+        while (block_start < span.count)
         {
-            //Depth test
-            int pix_pos = x - left_x;
-            uint32_t pix_z = interpolate(pix_pos, line_len, left_z, right_z, left_w, right_w);
-            if (rend_poly[i].attributes.depth_test_equal)
+            int block = (left_x + block_start) / Z_BLOCK_WIDTH;
+            int block_end = min(span.count, (block + 1) * Z_BLOCK_WIDTH - left_x);
+            uint64_t z_num = z_start + block_start * z_step;
+            uint64_t denom = denom_start + block_start * denom_step;
+
+            if (coarse_test)
             {
-                uint32_t low_z = z_buffer[line][x] - 0x200;
-                uint32_t high_z = z_buffer[line][x] + 0x200;
-                if (pix_z < low_z || pix_z > high_z)
+                uint64_t last = block_end - 1 - block_start;
+                uint32_t first_z = (int64_t)z_num / (int64_t)denom;
+                uint32_t last_z = (int64_t)(z_num + last * z_step) / (int64_t)(denom + last * denom_step);
+                if (min(first_z, last_z) > z_block_max[line][block])
+                {
+                    //Nothing here can pass the depth test. Maximum depth makes the test fail without dividing.
+                    for (int pix_pos = block_start; pix_pos < block_end; pix_pos++)
+                        span.z[pix_pos] = 0xFFFFFFFF;
+                    culled_pixels += block_end - block_start;
+                    block_start = block_end;
                     continue;
+                }
             }
-            else
+
+            for (int pix_pos = block_start; pix_pos < block_end; pix_pos++)
             {
-                if (pix_z > z_buffer[line][x])
-                    continue;
+                span.z[pix_pos] = (int64_t)z_num / (int64_t)denom;
+                z_num += z_step;
+                denom += denom_step;
             }
-            uint32_t final_color = 0xFF000000;
-            uint32_t vr = 0, vg = 0, vb = 0, va = 0;
-            uint16_t tr = 0x3E, tg = 0x3E, tb = 0x3E, ta = 0x1F;
+            block_start = block_end;
+        }
+
+        GX_Math::depth_test_span(span, &z_buffer[line][left_x], rend_poly[i].attributes.depth_test_equal);
+
+        //Colors and texels for the pixels that passed
+        for (int pix_pos = 0; pix_pos < span.count; pix_pos++)
+        {
+            if (!span.mask[pix_pos])
+                continue;
 
             //Handle wireframe drawing
-            if (rend_poly[i].attributes.alpha == 0)
+            int x = left_x + pix_pos;
+            if (rend_poly[i].attributes.alpha == 0 && x != left_x && x != right_x)
             {
-                if (x == left_x || x == right_x)
-                    va = 0x1F;
-                else
-                    continue;
-            }
-            else
-            {
-                //Normal alpha rules
-                va = rend_poly[i].attributes.alpha;
+                span.mask[pix_pos] = 0;
+                continue;
             }
 
-            //printf("\nvr: $%08X vg: $%08X vb: $%08X", vr, vg, vb);
-
+            uint32_t vr, vg, vb;
             vr = interpolate(pix_pos, line_len, left_r, right_r, left_w, right_w) >> 4;
             vg = interpolate(pix_pos, line_len, left_g, right_g, left_w, right_w) >> 4;
             vb = interpolate(pix_pos, line_len, left_b, right_b, left_w, right_w) >> 4;
@@ -358,7 +1112,7 @@ void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256],
             if (vb)
                 vb++;*/
 
-            uint32_t r, g, b;
+            uint32_t texel = 0x1F3E3E3E;
             if (texture_mapping)
             {
                 int16_t s, t;
@@ -395,270 +1149,24 @@ void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256],
                     else
                         t &= tex_height - 1;
                 }
-                //printf("\n(%d, %d): ($%04X, $%04X)", x, line, s, t);
-                switch (texparams.format)
-                {
-                    case 1: //A3I5
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr += tex_VRAM_offset;
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-                        int color_index = data & 0x1F;
-                        int alpha_index = data >> 5;
-                        ta = (alpha_index << 2) + (alpha_index >> 1);
-
-                        if (color_index || !texparams.color0_transparent)
-                        {
-                            uint32_t pal_addr = color_index * 2;
-                            pal_addr += rend_poly[i].palette_base * 0x10;
-                            uint16_t pal_color = gpu->read_texpal<uint16_t>(pal_addr);
-                            tr = (pal_color & 0x1F) << 1;
-                            tg = ((pal_color >> 5) & 0x1F) << 1;
-                            tb = ((pal_color >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    case 2: //4 color palette
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr /= 4;
-                        texel_addr += tex_VRAM_offset;
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-                        data = (data >> ((texel_addr & 0x3) * 2)) & 0x3;
-
-                        if (data || !texparams.color0_transparent)
-                        {
-                            uint32_t pal_addr = data * 2;
-                            pal_addr += rend_poly[i].palette_base * 0x8;
-                            uint16_t pal_color = gpu->read_texpal<uint16_t>(pal_addr);
-                            tr = (pal_color & 0x1F) << 1;
-                            tg = ((pal_color >> 5) & 0x1F) << 1;
-                            tb = ((pal_color >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    case 3: //16 color palette
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr /= 2;
-                        texel_addr += tex_VRAM_offset;
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-                        if (s & 0x1)
-                            data >>= 4;
-                        else
-                            data &= 0xF;
-
-                        if (data || !texparams.color0_transparent)
-                        {
-                            uint32_t pal_addr = data * 2;
-                            pal_addr += rend_poly[i].palette_base * 0x10;
-                            uint16_t pal_color = gpu->read_texpal<uint16_t>(pal_addr);
-                            tr = (pal_color & 0x1F) << 1;
-                            tg = ((pal_color >> 5) & 0x1F) << 1;
-                            tb = ((pal_color >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    case 4: //256 color palette
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr += tex_VRAM_offset;
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-
-                        if (data || !texparams.color0_transparent)
-                        {
-                            uint32_t pal_addr = data * 2;
-                            pal_addr += rend_poly[i].palette_base * 0x10;
-                            uint16_t pal_color = gpu->read_texpal<uint16_t>(pal_addr);
-                            tr = (pal_color & 0x1F) << 1;
-                            tg = ((pal_color >> 5) & 0x1F) << 1;
-                            tb = ((pal_color >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    case 5: //Compressed 4x4
-                    {
-                        uint32_t texel_addr = s & 0x3FC;
-                        texel_addr += (t & 0x3FC) * (tex_width >> 2);
-                        texel_addr += tex_VRAM_offset;
-                        texel_addr += (t & 0x3);
-
-                        uint32_t slot1_addr = 0x20000 + ((texel_addr >> 1) & 0xFFFE);
-                        if (texel_addr >= 0x40000)
-                            slot1_addr += 0x10000;
-
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-                        data >>= 2 * (s & 0x3);
-                        data &= 0x3;
-                        uint16_t palette_data = gpu->read_teximage<uint16_t>(slot1_addr);
-                        uint32_t palette_offset = (palette_data & 0x3FFF) << 2;
-
-                        uint32_t palette_base = rend_poly[i].palette_base * 0x10;
-
-                        uint16_t color = 0;
-                        switch (data)
-                        {
-                            case 0:
-                                color = gpu->read_texpal<uint16_t>(palette_base + palette_offset);
-                                break;
-                            case 1:
-                                color = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 2);
-                                break;
-                            case 2:
-                                if ((palette_data >> 14) == 1)
-                                {
-                                    uint16_t color0 = gpu->read_texpal<uint16_t>(palette_base + palette_offset);
-                                    uint16_t color1 = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 2);
-
-                                    int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
-                                    int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
-                                    int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
-
-                                    int r = (r0 + r1) >> 1;
-                                    int g = (g0 + g1) >> 1;
-                                    int b = (b0 + b1) >> 1;
-
-                                    color = r | (g << 5) | (b << 10);
-                                }
-                                else if ((palette_data >> 14) == 3)
-                                {
-                                    uint16_t color0 = gpu->read_texpal<uint16_t>(palette_base + palette_offset);
-                                    uint16_t color1 = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 2);
-
-                                    int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
-                                    int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
-                                    int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
-
-                                    int r = (r0 * 5 + r1 * 3) >> 3;
-                                    int g = (g0 * 5 + g1 * 3) >> 3;
-                                    int b = (b0 * 5 + b1 * 3) >> 3;
-
-                                    color = r | (g << 5) | (b << 10);
-                                }
-                                else
-                                    color = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 4);
-                                break;
-                            case 3:
-                                if ((palette_data >> 14) == 2)
-                                    color = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 6);
-                                else if ((palette_data >> 14) == 3)
-                                {
-                                    uint16_t color0 = gpu->read_texpal<uint16_t>(palette_base + palette_offset);
-                                    uint16_t color1 = gpu->read_texpal<uint16_t>(palette_base + palette_offset + 2);
-
-                                    int r0 = color0 & 0x1F, r1 = color1 & 0x1F;
-                                    int g0 = (color0 >> 5) & 0x1F, g1 = (color1 >> 5) & 0x1F;
-                                    int b0 = (color0 >> 10) & 0x1F, b1 = (color1 >> 10) & 0x1F;
-
-                                    int r = (r0 * 3 + r1 * 5) >> 3;
-                                    int g = (g0 * 3 + g1 * 5) >> 3;
-                                    int b = (b0 * 3 + b1 * 5) >> 3;
-
-                                    color = r | (g << 5) | (b << 10);
-                                }
-                                else
-                                {
-                                    color = 0;
-                                    ta = 0;
-                                }
-                                break;
-                            default:
-                                printf("\nUnrecognized 4x4 texel data type %d", data);
-                                exit(1);
-                        }
-
-                        tr = (color & 0x1F) << 1;
-                        tg = ((color >> 5) & 0x1F) << 1;
-                        tb = ((color >> 10) & 0x1F) << 1;
-                    }
-                        break;
-                    case 6: //A5I3
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr += tex_VRAM_offset;
-                        uint8_t data = gpu->read_teximage<uint8_t>(texel_addr);
-                        int color_index = data & 0x7;
-                        ta = data >> 3;
-
-                        if (color_index || !texparams.color0_transparent)
-                        {
-                            uint32_t pal_addr = color_index * 2;
-                            pal_addr += rend_poly[i].palette_base * 0x10;
-                            uint16_t pal_color = gpu->read_texpal<uint16_t>(pal_addr);
-                            tr = (pal_color & 0x1F) << 1;
-                            tg = ((pal_color >> 5) & 0x1F) << 1;
-                            tb = ((pal_color >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    case 7: //Direct color
-                    {
-                        uint32_t texel_addr = s;
-                        texel_addr += t * tex_width;
-                        texel_addr *= 2;
-                        texel_addr += tex_VRAM_offset;
-                        uint16_t data = gpu->read_teximage<uint16_t>(texel_addr);
-                        if (data & (1 << 15))
-                        {
-                            tr = (data & 0x1F) << 1;
-                            tg = ((data >> 5) & 0x1F) << 1;
-                            tb = ((data >> 10) & 0x1F) << 1;
-                        }
-                        else
-                            ta = 0;
-                    }
-                        break;
-                    default:
-                        printf("\nUnrecognized texture format %d", rend_poly[i].texparams.format);
-                        exit(1);
-                }
-            }
-
-            tr += !(!tr);
-            tg += !(!tg);
-            tb += !(!tb);
-
-            /*if (tr)
-                tr++;
-            if (tg)
-                tg++;
-            if (tb)
-                tb++;*/
-
-            int alpha;
+                texel = texels[s + t * tex_width];
+            }
 
             switch (rend_poly[i].attributes.polygon_mode)
             {
                 case 0:
-                    r = (((tr + 1) * (vr + 1) - 1) / 64) << 2;
-                    g = (((tg + 1) * (vg + 1) - 1) / 64) << 2;
-                    b = (((tb + 1) * (vb + 1) - 1) / 64) << 2;
-                    alpha = (((ta + 1) * (va + 1) - 1)) / 32;
                     break;
                 case 2:
-                    if (DISP3DCNT.highlight_shading)
+                    if (render_DISP3DCNT.highlight_shading)
                     {
+                        //The toon color is added after texture modulation
+                        highlight[pix_pos] = vr >> 1;
                         vg = vr;
                         vb = vr;
                     }
                     else
                     {
-                        uint16_t toon_color = TOON_TABLE[vr >> 1];
+                        uint16_t toon_color = render_TOON_TABLE[vr >> 1];
 
                         vr = (toon_color & 0x1F) << 1;
                         vg = ((toon_color >> 5) & 0x1F) << 1;
@@ -671,50 +1179,248 @@ void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256],
                         if (vb)
                             vb++;
                     }
-                    r = (((tr + 1) * (vr + 1) - 1) / 64) << 2;
-                    g = (((tg + 1) * (vg + 1) - 1) / 64) << 2;
-                    b = (((tb + 1) * (vb + 1) - 1) / 64) << 2;
-                    alpha = (((ta + 1) * (va + 1) - 1)) / 32;
                     break;
                 default:
                     printf("\nUnrecognized polygon rendering mode %d", rend_poly[i].attributes.polygon_mode);
                     exit(1);
             }
 
-            if (!alpha)
-                continue;
+            span.r[pix_pos] = vr;
+            span.g[pix_pos] = vg;
+            span.b[pix_pos] = vb;
+            span.texel[pix_pos] = texel;
+        }
 
-            if (!rend_poly[i].translucent || rend_poly[i].attributes.set_new_trans_depth)
-                z_buffer[line][x] = pix_z;
+        //Wireframe edges are drawn fully opaque
+        uint32_t va = rend_poly[i].attributes.alpha;
+        if (!va)
+            va = 0x1F;
+        GX_Math::shade_span(span, va, alpha_ref);
 
-            if (DISP3DCNT.alpha_blending && rend_poly[i].translucent)
+        if (rend_poly[i].attributes.polygon_mode == 2 && render_DISP3DCNT.highlight_shading)
+        {
+            for (int pix_pos = 0; pix_pos < span.count; pix_pos++)
             {
-                //printf("\nAlpha: $%02X", alpha);
-                //Don't draw translucent polygons over each other if they share the same ID
-                if (trans_poly_ids[x] == rend_poly[i].attributes.id)
+                if (!span.mask[pix_pos])
                     continue;
+                uint32_t toon_color = rgb15_to_buffer(render_TOON_TABLE[highlight[pix_pos]]);
+                span.r[pix_pos] = min(span.r[pix_pos] + ((toon_color >> 16) & 0xFF), 0xFCU);
+                span.g[pix_pos] = min(span.g[pix_pos] + ((toon_color >> 8) & 0xFF), 0xFCU);
+                span.b[pix_pos] = min(span.b[pix_pos] + (toon_color & 0xFF), 0xFCU);
+            }
+        }
+
+        uint8_t attr = rend_poly[i].attributes.id | (rend_poly[i].attributes.fog_enable << 7);
+        if (!(render_DISP3DCNT.alpha_blending && rend_poly[i].translucent))
+        {
+            bool write_z = !rend_poly[i].translucent || rend_poly[i].attributes.set_new_trans_depth;
+            GX_Math::write_span(span, &z_buffer[line][left_x], &color_buffer[line][left_x],
+                                &pixel_state[line][left_x], PIXEL_OPAQUE, &pixel_attr[line][left_x], attr, write_z);
+            for (int pix_pos = 0; pix_pos < span.count; pix_pos++)
+                drawn_pixels += span.mask[pix_pos] & 1;
+            if (write_z)
+                update_z_block_max(line, left_x, right_x);
+            continue;
+        }
+
+        for (int pix_pos = 0; pix_pos < span.count; pix_pos++)
+        {
+            if (!span.mask[pix_pos])
+                continue;
+
+            int x = left_x + pix_pos;
+            uint32_t final_color = 0xFF000000;
+            uint32_t r = span.r[pix_pos], g = span.g[pix_pos], b = span.b[pix_pos];
+            int alpha = span.alpha[pix_pos];
+
+            if (rend_poly[i].attributes.set_new_trans_depth)
+                z_buffer[line][x] = span.z[pix_pos];
 
-                trans_poly_ids[x] = rend_poly[i].attributes.id;
+            //printf("\nAlpha: $%02X", alpha);
+            //Don't draw translucent polygons over each other if they share the same ID
+            if (trans_poly_ids[x] == rend_poly[i].attributes.id)
+                continue;
 
-                int pr = (framebuffer[x + y_coord] >> 16) & 0xFF;
-                int pg = (framebuffer[x + y_coord] >> 8) & 0xFF;
-                int pb = framebuffer[x + y_coord] & 0xFF;
+            trans_poly_ids[x] = rend_poly[i].attributes.id;
 
-                r = (((alpha + 1) * r) + (31 - alpha) * pr) / 32;
-                g = (((alpha + 1) * g) + (31 - alpha) * pg) / 32;
-                b = (((alpha + 1) * b) + (31 - alpha) * pb) / 32;
+            //Blending over the 2D layer has to wait until the line is composited
+            if (pixel_state[line][x] != PIXEL_OPAQUE)
+            {
+                Trans_Fragment frag;
+                frag.x = x;
+                frag.alpha = alpha;
+                frag.color = final_color | (r << 16) | (g << 8) | b;
+                trans_fragments[line].push_back(frag);
+                pixel_state[line][x] = PIXEL_TRANSLUCENT;
+                continue;
             }
 
+            int pr = (color_buffer[line][x] >> 16) & 0xFF;
+            int pg = (color_buffer[line][x] >> 8) & 0xFF;
+            int pb = color_buffer[line][x] & 0xFF;
+
+            r = (((alpha + 1) * r) + (31 - alpha) * pr) / 32;
+            g = (((alpha + 1) * g) + (31 - alpha) * pg) / 32;
+            b = (((alpha + 1) * b) + (31 - alpha) * pb) / 32;
+
             final_color |= r << 16;
             final_color |= g << 8;
             final_color |= b;
 
-            framebuffer[x + y_coord] = 0xFF000000 + final_color;
+            color_buffer[line][x] = 0xFF000000 + final_color;
+            pixel_state[line][x] = PIXEL_OPAQUE;
+
+            //The opaque polygon keeps its ID for edge marking, but fog needs both polygons to enable it
+            pixel_attr[line][x] &= attr | 0x7F;
+        }
+        for (int pix_pos = 0; pix_pos < span.count; pix_pos++)
+            drawn_pixels += span.mask[pix_pos] & 1;
+        if (rend_poly[i].attributes.set_new_trans_depth)
+            update_z_block_max(line, left_x, right_x);
+    }
+}
+
+//Edge marking, fog and anti-aliasing on a finished line. The lines above and below must be rasterized.
+void GPU_3D::post_process_line(int line)
+{
+    bool fog = render_DISP3DCNT.fog_enable && !render_DISP3DCNT.fog_color_mode;
+    bool edges = render_DISP3DCNT.edge_marking || render_DISP3DCNT.anti_aliasing;
+    if (!fog && !edges)
+        return;
+
+    uint32_t edge_mask[PIXELS_PER_LINE];
+    if (edges)
+    {
+        //Rows padded by one pixel on either side, with the rear-plane beyond the edges of the screen
+        uint32_t rear_z = get_rear_z(render_CLEAR_DEPTH);
+        uint8_t rear_attr = get_rear_attr(render_CLEAR_COLOR);
+        uint32_t z_rows[3][PIXELS_PER_LINE + 2];
+        uint8_t attr_rows[3][PIXELS_PER_LINE + 2];
+        const uint32_t* z_row_ptrs[3];
+        const uint8_t* attr_row_ptrs[3];
+        for (int row = 0; row < 3; row++)
+        {
+            int y = line + row - 1;
+            z_rows[row][0] = rear_z;
+            z_rows[row][PIXELS_PER_LINE + 1] = rear_z;
+            attr_rows[row][0] = rear_attr;
+            attr_rows[row][PIXELS_PER_LINE + 1] = rear_attr;
+            if (y >= 0 && y < SCANLINES)
+            {
+                memcpy(&z_rows[row][1], z_buffer[y], sizeof(z_buffer[y]));
+                memcpy(&attr_rows[row][1], pixel_attr[y], sizeof(pixel_attr[y]));
+            }
+            else
+            {
+                for (int x = 1; x <= PIXELS_PER_LINE; x++)
+                    z_rows[row][x] = rear_z;
+                memset(&attr_rows[row][1], rear_attr, PIXELS_PER_LINE);
+            }
+            z_row_ptrs[row] = &z_rows[row][1];
+            attr_row_ptrs[row] = &attr_rows[row][1];
+        }
+        GX_Math::find_edges(edge_mask, z_row_ptrs, attr_row_ptrs, pixel_state[line], PIXEL_OPAQUE);
+
+        if (render_DISP3DCNT.edge_marking)
+        {
+            for (int x = 0; x < PIXELS_PER_LINE; x++)
+            {
+                if (edge_mask[x])
+                    color_buffer[line][x] = rgb15_to_buffer(render_EDGE_COLOR[(pixel_attr[line][x] & 0x3F) >> 3]);
+            }
+        }
+    }
+
+    //Only the color part of fog is emulated, as the 3D layer has no alpha channel yet
+    if (fog)
+        GX_Math::fog_line(color_buffer[line], z_buffer[line], pixel_attr[line], pixel_state[line], PIXEL_OPAQUE, render_fog);
+
+    //Simplified anti-aliasing: edges are averaged with the opaque pixel they are in front of on the same line
+    if (render_DISP3DCNT.anti_aliasing)
+    {
+        uint32_t colors[PIXELS_PER_LINE];
+        memcpy(colors, color_buffer[line], sizeof(colors));
+        for (int x = 0; x < PIXELS_PER_LINE; x++)
+        {
+            if (!edge_mask[x])
+                continue;
+            int neighbour = -1;
+            if (x > 0 && pixel_state[line][x - 1] == PIXEL_OPAQUE && z_buffer[line][x - 1] > z_buffer[line][x])
+                neighbour = x - 1;
+            else if (x < PIXELS_PER_LINE - 1 && pixel_state[line][x + 1] == PIXEL_OPAQUE &&
+                     z_buffer[line][x + 1] > z_buffer[line][x])
+                neighbour = x + 1;
+            if (neighbour < 0)
+                continue;
+
+            uint32_t a = colors[x], b = colors[neighbour];
+            uint32_t r = (((a >> 16) & 0xFF) + ((b >> 16) & 0xFF)) >> 1;
+            uint32_t g = (((a >> 8) & 0xFF) + ((b >> 8) & 0xFF)) >> 1;
+            uint32_t bl = ((a & 0xFF) + (b & 0xFF)) >> 1;
+            color_buffer[line][x] = (a & 0xFF000000) | (r << 16) | (g << 8) | bl;
+        }
+    }
+}
+
+void GPU_3D::render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256], uint8_t bg0_priority)
+{
+    int line = gpu->get_VCOUNT();
+    if (render_threaded)
+        wait_for_line(line);
+    else
+    {
+        //Edge marking and anti-aliasing compare against the lines above and below
+        int last_line = line;
+        if (render_DISP3DCNT.edge_marking || render_DISP3DCNT.anti_aliasing)
+        {
+            lines_rasterized = max(lines_rasterized, line - 1);
+            last_line = min(line + 1, SCANLINES - 1);
+        }
+        else
+            lines_rasterized = max(lines_rasterized, line);
+        while (lines_rasterized <= last_line)
+            render_line(lines_rasterized++);
+
+        if (lines_rendered <= line)
+        {
+            post_process_line(line);
+            lines_rendered = line + 1;
+        }
+    }
+
+    int y_coord = line * PIXELS_PER_LINE;
+
+    //Translucent pixels with nothing opaque beneath them blend with the 2D layer
+    for (unsigned int i = 0; i < trans_fragments[line].size(); i++)
+    {
+        Trans_Fragment& frag = trans_fragments[line][i];
+        if (pixel_state[line][frag.x] == PIXEL_OPAQUE)
+            continue;
+
+        int pr = (framebuffer[frag.x + y_coord] >> 16) & 0xFF;
+        int pg = (framebuffer[frag.x + y_coord] >> 8) & 0xFF;
+        int pb = framebuffer[frag.x + y_coord] & 0xFF;
+
+        int r = (((frag.alpha + 1) * ((frag.color >> 16) & 0xFF)) + (31 - frag.alpha) * pr) / 32;
+        int g = (((frag.alpha + 1) * ((frag.color >> 8) & 0xFF)) + (31 - frag.alpha) * pg) / 32;
+        int b = (((frag.alpha + 1) * (frag.color & 0xFF)) + (31 - frag.alpha) * pb) / 32;
+
+        uint32_t final_color = 0xFF000000 | (r << 16) | (g << 8) | b;
+        framebuffer[frag.x + y_coord] = 0xFF000000 + final_color;
+        bg_priorities[frag.x] = bg0_priority;
+    }
+
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+    {
+        if (pixel_state[line][x] == PIXEL_OPAQUE)
+        {
+            framebuffer[x + y_coord] = color_buffer[line][x];
             bg_priorities[x] = bg0_priority;
         }
     }
 }
 
+
 void GPU_3D::run(uint64_t cycles_to_run)
 {
     if (swap_buffers)
@@ -725,10 +1431,35 @@ void GPU_3D::run(uint64_t cycles_to_run)
         return;
     }
     cycles -= cycles_to_run;
-    while (cycles <= 0 && GXPIPE.size())
+    while (cycles <= 0 && GXPIPE.size() && !swap_buffers)
         exec_command();
 }
 
+//Runs every command whose cycles have elapsed since the last sync.
+//Called by the scheduler, at VBLANK, and before the ARM9 touches the geometry engine
+void GPU_3D::sync()
+{
+    uint64_t now = e->get_arm9_timestamp();
+    if (now > geo_timestamp)
+    {
+        run(now - geo_timestamp);
+        geo_timestamp = now;
+    }
+    schedule_commands();
+}
+
+//Wakes the engine up when the next queued command is due
+void GPU_3D::schedule_commands()
+{
+    if (swap_buffers || !GXPIPE.size())
+        return;
+    uint64_t due = geo_timestamp;
+    if (cycles > 0)
+        due += cycles;
+    uint64_t now = e->get_timestamp();
+    e->add_GX_event((due > now) ? due - now : 0);
+}
+
 void GPU_3D::check_FIFO_DMA()
 {
     if (GXFIFO.size() < 128)
@@ -756,6 +1487,37 @@ void GPU_3D::check_FIFO_IRQ()
 void GPU_3D::write_GXFIFO(uint32_t word)
 {
     //printf("\nWrite GXFIFO: $%08X", word);
+    sync();
+
+    //A single word can complete up to four packed commands
+    GX_Command batch[4];
+    int batch_count = parse_GXFIFO_word(word, batch);
+    write_commands(batch, batch_count);
+}
+
+//Feeds a block of words written to GXFIFO, stopping before the FIFO would have to stall.
+//Returns the number of words consumed.
+int GPU_3D::write_GXFIFO_block(const uint32_t* words, int count)
+{
+    sync();
+
+    GX_Command batch[256];
+    int space = GXFIFO.space();
+    int batch_count = 0;
+    int consumed = 0;
+    while (consumed < count && batch_count + 4 <= space)
+    {
+        batch_count += parse_GXFIFO_word(words[consumed], batch + batch_count);
+        consumed++;
+    }
+    if (batch_count)
+        write_commands(batch, batch_count);
+    return consumed;
+}
+
+//Decodes one word of packed commands and parameters into cmds, returning how many were completed
+int GPU_3D::parse_GXFIFO_word(uint32_t word, GX_Command* cmds)
+{
     if (cmd_count == 0)
     {
         cmd_count = 4;
@@ -764,19 +1526,19 @@ void GPU_3D::write_GXFIFO(uint32_t word)
         total_params = cmd_param_amounts[word & 0xFF];
 
         if (total_params > 0)
-            return;
+            return 0;
     }
     else
         param_count++;
 
+    int count = 0;
     while (true)
     {
         if ((current_cmd & 0xFF) || (cmd_count == 4 && current_cmd == 0))
         {
-            GX_Command cmd;
-            cmd.command = current_cmd & 0xFF;
-            cmd.param = word;
-            write_command(cmd);
+            cmds[count].command = current_cmd & 0xFF;
+            cmds[count].param = word;
+            count++;
         }
         if (param_count >= total_params)
         {
@@ -791,10 +1553,12 @@ void GPU_3D::write_GXFIFO(uint32_t word)
         if (param_count < total_params)
             break;
     }
+    return count;
 }
 
 void GPU_3D::write_FIFO_direct(uint32_t address, uint32_t word)
 {
+    sync();
     GX_Command cmd;
     cmd.command = (address >> 2) & 0x7F;
     cmd.param = word;
@@ -849,18 +1613,29 @@ GX_Command GPU_3D::read_command()
 void GPU_3D::write_command(GX_Command &cmd)
 {
     //printf("\nWrite command: $%02X:%08X", cmd.command, cmd.param);
-    if (!GXFIFO.size() && GXPIPE.size() < 4)
-        GXPIPE.push(cmd);
-    else
+    write_commands(&cmd, 1);
+}
+
+void GPU_3D::write_commands(const GX_Command* cmds, int count)
+{
+    int index = 0;
+
+    //Commands skip the FIFO while it is empty and the pipe has room
+    while (index < count && !GXFIFO.size() && GXPIPE.size() < 4)
     {
-        if (GXFIFO.size() >= 256)
-        {
-            //printf("\nGXFIFO full!");
-            while (GXFIFO.size() >= 256)
-                exec_command();
-        }
-        GXFIFO.push(cmd);
+        GXPIPE.push(cmds[index]);
+        index++;
+    }
+
+    while (index < count)
+    {
+        while (!GXFIFO.space())
+            exec_command();
+        int amount = min(count - index, (int)GXFIFO.space());
+        GXFIFO.push(cmds + index, amount);
+        index += amount;
     }
+    schedule_commands();
 }
 
 void GPU_3D::exec_command()
@@ -909,6 +1684,7 @@ void GPU_3D::exec_command()
                         {
                             modelview_mtx.set(modelview_stack[modelview_sp & 0x1F]);
                             vector_mtx.set(vector_stack[modelview_sp & 0x1F]);
+                            vector_mtx_gen++;
                         }
                         modelview_sp &= 0x3F;
                         break;
@@ -966,6 +1742,7 @@ void GPU_3D::exec_command()
                         {
                             modelview_mtx.set(modelview_stack[offset]);
                             vector_mtx.set(vector_stack[offset]);
+                            vector_mtx_gen++;
                         }
                         else
                             GXSTAT.mtx_overflow = true;
@@ -1005,6 +1782,7 @@ void GPU_3D::exec_command()
                             for (int j = 0; j < 4; j++)
                                 vector_mtx.m[i][j] = cmd_params[(i * 4) + j];
                         }
+                        vector_mtx_gen++;
                         break;
                     case 3:
                         current_mtx = &texture_mtx;
@@ -1048,6 +1826,7 @@ void GPU_3D::exec_command()
                         vector_mtx.m[3][0] = cmd_params[9];
                         vector_mtx.m[3][1] = cmd_params[10];
                         vector_mtx.m[3][2] = cmd_params[11];
+                        vector_mtx_gen++;
                         break;
                     case 3:
                         current_mtx = &texture_mtx;
@@ -1209,35 +1988,35 @@ void GPU_3D::exec_command()
                 ambient_color = (cmd_params[0] >> 16) & 0x7FFF;
                 if (cmd_params[0] & (1 << 15))
                     current_color = diffuse_color;
+                light_gen++;
                 break;
             case 0x31:
                 //printf("\nSPE_EMI");
                 specular_color = cmd_params[0] & 0x7FFF;
                 emission_color = (cmd_params[0] >> 16) & 0x7FFF;
                 using_shine_table = cmd_params[0] & (1 << 15);
+                light_gen++;
                 break;
             case 0x32:
                 //printf("\nLIGHT_VECTOR");
             {
-                int16_t light_vector[3];
+                int32_t light_vector[4], direction[4];
                 light_vector[0] = (int16_t)((cmd_params[0] & 0x3FF) << 6) >> 6;
                 light_vector[1] = (int16_t)(((cmd_params[0] >> 10) & 0x3FF) << 6) >> 6;
                 light_vector[2] = (int16_t)(((cmd_params[0] >> 20) & 0x3FF) << 6) >> 6;
+                light_vector[3] = 0;
                 int index = cmd_params[0] >> 30;
-                light_direction[index][0] = (light_vector[0] * vector_mtx.m[0][0] +
-                        light_vector[1] * vector_mtx.m[1][0] +
-                        light_vector[2] * vector_mtx.m[2][0]) >> 12;
-                light_direction[index][1] = (light_vector[0] * vector_mtx.m[0][1] +
-                        light_vector[1] * vector_mtx.m[1][1] +
-                        light_vector[2] * vector_mtx.m[2][1]) >> 12;
-                light_direction[index][2] = (light_vector[0] * vector_mtx.m[0][2] +
-                        light_vector[1] * vector_mtx.m[1][2] +
-                        light_vector[2] * vector_mtx.m[2][2]) >> 12;
+                GX_Math::vec4_transform32(direction, light_vector, vector_mtx, 12);
+                light_direction[index][0] = direction[0];
+                light_direction[index][1] = direction[1];
+                light_direction[index][2] = direction[2];
+                update_light_mtx(index);
             }
                 break;
             case 0x33:
                 //printf("\nLIGHT_COLOR: $%08X", cmd_params[0]);
                 light_color[cmd_params[0] >> 30] = cmd_params[0] & 0x7FFF;
+                light_gen++;
                 break;
             case 0x34:
                 //printf("\nSHININESS");
@@ -1249,6 +2028,7 @@ void GPU_3D::exec_command()
                     shine_table[index + 2] = (cmd_params[i] >> 16) & 0xFF;
                     shine_table[index + 3] = cmd_params[i] >> 24;
                 }
+                light_gen++;
                 break;
             case 0x40:
                 //printf("\nBEGIN_VTXS");
@@ -1472,56 +2252,19 @@ void GPU_3D::add_polygon()
     }
 
     //Clip the fuck out of that polygon
-    int clip_start = 0;
     int clipped_count = vertex_list_count;
     Vertex clipped_list[10];
-    Vertex reused_list[2];
 
-    //Attempt to attach vertices from last strip polygon to new one, if possible
-    if (POLYGON_TYPE >= 2 && last_poly_strip)
+    //Vertices not stored yet remember their place in vertex_list as -(index + 2),
+    //so unclipped ones can be found again after clipping
+    for (int i = 0; i < clipped_count; i++)
     {
-        int v0, v1;
-        int vertices;
-        if (POLYGON_TYPE == 2)
-        {
-            if (consecutive_polygons & 0x1)
-            {
-                v0 = 2;
-                v1 = 1;
-            }
-            else
-            {
-                v0 = 0;
-                v1 = 2;
-            }
-            vertices = 3;
-        }
-        else
-        {
-            v0 = 3;
-            v1 = 2;
-
-            vertices = 4;
-        }
-
-        int v = last_poly_strip->vert_index;
-
-        if (last_poly_strip->vertices == vertices &&
-            !geo_vert[v + v0].clipped &&
-            !geo_vert[v + v1].clipped)
-        {
-            /*reused_list[0] = geo_vert[v + v0];
-            reused_list[1] = geo_vert[v + v1];
-            clipped_list[0] = geo_vert[v + v0];
-            clipped_list[1] = geo_vert[v + v1];
-            clip_start = 2;*/
-        }
-    }
-
-    for (int i = clip_start; i < clipped_count; i++)
+        if (vertex_list[i].vert_index < 0)
+            vertex_list[i].vert_index = -(i + 2);
         clipped_list[i] = vertex_list[i];
+    }
 
-    clipped_count = clip(clipped_list, clipped_count, clip_start, true);
+    clipped_count = clip(clipped_list, clipped_count, 0, true);
     if (!clipped_count)
         return;
 
@@ -1534,15 +2277,27 @@ void GPU_3D::add_polygon()
         while ((clipped_list[i].coords[3] >> w_len) && w_len < 32)
             w_len += 4;
     }
+    Polygon& poly = geo_poly[geo_poly_count];
     for (int i = 0; i < clipped_count; i++)
     {
-        int v = i + geo_vert_count;
+        //Unclipped vertices already stored by the previous polygon of a strip are shared
+        if (!clipped_list[i].clipped && clipped_list[i].vert_index >= 0)
+        {
+            poly.vert_indices[i] = clipped_list[i].vert_index;
+            continue;
+        }
+
+        int v = geo_vert_count;
         if (v >= 6188)
         {
             printf("\nVertex count exceeded!");
             DISP3DCNT.RAM_overflow = true;
             return;
         }
+        geo_vert_count++;
+        poly.vert_indices[i] = v;
+        if (!clipped_list[i].clipped)
+            vertex_list[-clipped_list[i].vert_index - 2].vert_index = v;
         geo_vert[v] = clipped_list[i];
 
         //Convert z values
@@ -1582,59 +2337,46 @@ void GPU_3D::add_polygon()
             }
         }
     }
-    geo_poly[geo_poly_count].vertices = clipped_count;
-    geo_poly[geo_poly_count].vert_index = geo_vert_count;
-    geo_poly[geo_poly_count].attributes = current_poly_attr;
-    geo_poly[geo_poly_count].texparams = TEXIMAGE_PARAM;
-    geo_poly[geo_poly_count].palette_base = PLTT_BASE;
+    poly.vertices = clipped_count;
+    poly.attributes = current_poly_attr;
+    poly.texparams = TEXIMAGE_PARAM;
+    poly.palette_base = PLTT_BASE;
     if ((current_poly_attr.alpha > 0 && current_poly_attr.alpha < 0x1F) ||
          TEXIMAGE_PARAM.format == 1 || TEXIMAGE_PARAM.format == 6)
-        geo_poly[geo_poly_count].translucent = true;
+        poly.translucent = true;
     else
-        geo_poly[geo_poly_count].translucent = false;
+        poly.translucent = false;
     geo_poly_count++;
-    geo_vert_count += clipped_count;
     if (POLYGON_TYPE >= 2)
-    {
         vertex_list_count = 2;
-        last_poly_strip = &geo_poly[geo_poly_count - 1];
-    }
-    else
-        last_poly_strip = nullptr;
 }
 
 void GPU_3D::add_vertex()
 {
     if (geo_vert_count >= 6188)
         return;
-    int64_t coords[4];
-    coords[0] = (int64_t)(int16_t)current_vertex[0];
-    coords[1] = (int64_t)(int16_t)current_vertex[1];
-    coords[2] = (int64_t)(int16_t)current_vertex[2];
+    int32_t coords[4];
+    coords[0] = (int16_t)current_vertex[0];
+    coords[1] = (int16_t)current_vertex[1];
+    coords[2] = (int16_t)current_vertex[2];
     coords[3] = 0x1000;
 
     update_clip_mtx();
 
     Vertex* vtx = &vertex_list[vertex_list_count];
 
-    vtx->coords[0] = (coords[0]*clip_mtx.m[0][0] + coords[1]*clip_mtx.m[1][0] +
-            coords[2]*clip_mtx.m[2][0] + coords[3]*clip_mtx.m[3][0]) >> 12;
-    vtx->coords[1] = (coords[0]*clip_mtx.m[0][1] + coords[1]*clip_mtx.m[1][1] +
-            coords[2]*clip_mtx.m[2][1] + coords[3]*clip_mtx.m[3][1]) >> 12;
-    vtx->coords[2] = (coords[0]*clip_mtx.m[0][2] + coords[1]*clip_mtx.m[1][2] +
-            coords[2]*clip_mtx.m[2][2] + coords[3]*clip_mtx.m[3][2]) >> 12;
-    vtx->coords[3] = (coords[0]*clip_mtx.m[0][3] + coords[1]*clip_mtx.m[1][3] +
-            coords[2]*clip_mtx.m[2][3] + coords[3]*clip_mtx.m[3][3]) >> 12;
+    GX_Math::vec4_transform(vtx->coords, coords, clip_mtx);
 
     if (TEXIMAGE_PARAM.transformation_mode == 3)
     {
+        int64_t x = coords[0], y = coords[1], z = coords[2];
         int16_t texcoords[2];
         texcoords[0] = current_texcoords[0];
         texcoords[1] = current_texcoords[1];
-        current_texcoords[0] = ((coords[0] * texture_mtx.m[0][0] + coords[1] * texture_mtx.m[1][0]
-                + coords[2] * texture_mtx.m[2][0]) >> 24) + texcoords[0];
-        current_texcoords[1] = ((coords[0] * texture_mtx.m[0][1] + coords[1] * texture_mtx.m[1][1]
-                + coords[2] * texture_mtx.m[2][1]) >> 24) + texcoords[1];
+        current_texcoords[0] = ((x * texture_mtx.m[0][0] + y * texture_mtx.m[1][0]
+                + z * texture_mtx.m[2][0]) >> 24) + texcoords[0];
+        current_texcoords[1] = ((x * texture_mtx.m[0][1] + y * texture_mtx.m[1][1]
+                + z * texture_mtx.m[2][1]) >> 24) + texcoords[1];
     }
 
     vtx->colors[0] = ((current_color & 0x1F) << 12) + 0xFFF;
@@ -1643,6 +2385,7 @@ void GPU_3D::add_vertex()
     vtx->texcoords[0] = (int16_t)current_texcoords[0];
     vtx->texcoords[1] = (int16_t)current_texcoords[1];
     vtx->clipped = false;
+    vtx->vert_index = -1;
 
     vertex_list_count++;
     switch (POLYGON_TYPE)
@@ -1706,115 +2449,167 @@ void GPU_3D::request_FIFO_DMA()
         e->GXFIFO_DMA_request();
 }
 
-bool y_sort(Polygon a, Polygon b)
+//Stable sort of rend_poly[start, end) by bottom_y, then top_y, using geo_poly as scratch space
+void GPU_3D::y_sort_polygons(int start, int end)
 {
-    if (a.translucent != b.translucent)
-        return a.translucent < b.translucent;
-    if (a.bottom_y != b.bottom_y)
-        return a.bottom_y < b.bottom_y;
-    return a.top_y < b.top_y;
+    if (end - start < 2)
+        return;
+
+    //Two counting sort passes: top_y into the scratch buffer, then bottom_y back into rend_poly
+    int offsets[257];
+
+    memset(offsets, 0, sizeof(offsets));
+    for (int i = start; i < end; i++)
+        offsets[rend_poly[i].top_y]++;
+    for (int y = 0, index = start; y < 257; y++)
+    {
+        int count = offsets[y];
+        offsets[y] = index;
+        index += count;
+    }
+    for (int i = start; i < end; i++)
+        geo_poly[offsets[rend_poly[i].top_y]++] = rend_poly[i];
+
+    memset(offsets, 0, sizeof(offsets));
+    for (int i = start; i < end; i++)
+        offsets[geo_poly[i].bottom_y]++;
+    for (int y = 0, index = start; y < 257; y++)
+    {
+        int count = offsets[y];
+        offsets[y] = index;
+        index += count;
+    }
+    for (int i = start; i < end; i++)
+        rend_poly[offsets[geo_poly[i].bottom_y]++] = geo_poly[i];
 }
 
 void GPU_3D::end_of_frame()
 {
+    //The render lists belong to the render thread until it finishes the previous frame
+    wait_for_render();
+
     if (swap_buffers)
     {
         //printf("\nSWAP_BUFFERS");
 
-        memcpy(rend_vert, geo_vert, sizeof(Vertex) * geo_vert_count);
-        memcpy(rend_poly, geo_poly, sizeof(Polygon) * geo_poly_count);
+        swap(geo_vert, rend_vert);
+        swap(geo_poly, rend_poly);
         //printf("\nGeo_poly_count: %d", geo_poly_count);
         //printf("\nGeo_vert_count: %d", geo_vert_count);
         rend_vert_count = geo_vert_count;
         rend_poly_count = geo_poly_count;
         geo_vert_count = 0;
         geo_poly_count = 0;
+        //A strip continuing after the swap can't share vertices with the old buffer
+        for (int i = 0; i < 4; i++)
+            vertex_list[i].vert_index = -1;
 
-        for (int i = 0; i < rend_poly_count; i++)
+        //Strip polygons share vertices, so each one is converted to screen space once
+        int width = (viewport.x2 - viewport.x1 + 1) & 0x1FF;
+        int height = (viewport.y1 - viewport.y2 + 1) & 0xFF;
+        for (int i = 0; i < rend_vert_count; i++)
         {
-            uint32_t vert_index = rend_poly[i].vert_index;
-            rend_poly[i].top_y = 256;
-            rend_poly[i].bottom_y = 0;
-            for (int j = 0; j < rend_poly[i].vertices; j++)
-            {
-                //printf("\nColor: $%04X", rend_vert[vert_index + j].color & 0xFFFF);
-                int64_t xx = rend_vert[vert_index + j].coords[0],
-                        yy = rend_vert[vert_index + j].coords[1],
-                        ww = rend_vert[vert_index + j].coords[3];
-
-                //printf("\nCoords: (%lld, %lld, %lld, %lld)", xx, yy, zz, ww);
+            int64_t xx = rend_vert[i].coords[0],
+                    yy = rend_vert[i].coords[1],
+                    ww = rend_vert[i].coords[3];
 
-                int32_t final_x, final_y;
-
-                if (ww == 0)
-                {
-                    final_x = 0;
-                    final_y = 0;
-                    printf("\npoly%d ww equals 0??", i);
-                }
-                else
-                {
-                    int width = (viewport.x2 - viewport.x1 + 1) & 0x1FF;
-                    int height = (viewport.y1 - viewport.y2 + 1) & 0xFF;
-                    int64_t screen_x = (((xx + ww) * width) / (ww << 1)) + viewport.x1;
-                    int64_t screen_y = (((-yy + ww) * height) / (ww << 1)) + viewport.y2;
-
-                    final_x = screen_x & 0x1FF;
-                    final_y = screen_y & 0xFF;
-
-                    //printf("\nScreen shit: (%d, %d)", final_x, final_y);
-                }
+            int32_t final_x, final_y;
 
-                if (final_y < rend_poly[i].top_y)
-                    rend_poly[i].top_y = final_y;
-                if (final_y > rend_poly[i].bottom_y)
-                    rend_poly[i].bottom_y = final_y;
+            if (ww == 0)
+            {
+                final_x = 0;
+                final_y = 0;
+                printf("\nvertex%d ww equals 0??", i);
+            }
+            else
+            {
+                int64_t screen_x = (((xx + ww) * width) / (ww << 1)) + viewport.x1;
+                int64_t screen_y = (((-yy + ww) * height) / (ww << 1)) + viewport.y2;
 
-                rend_vert[vert_index + j].coords[0] = final_x;
-                rend_vert[vert_index + j].coords[1] = final_y;
-                if (flush_mode & 0x2)
-                    rend_vert[vert_index + j].coords[2] = ww;
+                final_x = screen_x & 0x1FF;
+                final_y = screen_y & 0xFF;
             }
+
+            rend_vert[i].coords[0] = final_x;
+            rend_vert[i].coords[1] = final_y;
+            if (flush_mode & 0x2)
+                rend_vert[i].coords[2] = ww;
         }
 
-        //Sort polygons by translucency
-        int index = 0;
         int opaque_count = 0;
-        Polygon temp[2048];
         for (int i = 0; i < rend_poly_count; i++)
         {
             if (!rend_poly[i].translucent)
-            {
-                temp[index] = rend_poly[i];
-                index++;
                 opaque_count++;
+
+            rend_poly[i].top_y = 256;
+            rend_poly[i].bottom_y = 0;
+            for (int j = 0; j < rend_poly[i].vertices; j++)
+            {
+                uint16_t y = rend_vert[rend_poly[i].vert_indices[j]].coords[1];
+                if (y < rend_poly[i].top_y)
+                    rend_poly[i].top_y = y;
+                if (y > rend_poly[i].bottom_y)
+                    rend_poly[i].bottom_y = y;
             }
         }
 
+        //Sort polygons by translucency, partitioning into the now unused geometry buffer
+        int opaque_index = 0, trans_index = opaque_count;
         for (int i = 0; i < rend_poly_count; i++)
         {
             if (rend_poly[i].translucent)
-            {
-                temp[index] = rend_poly[i];
-                index++;
-            }
+                geo_poly[trans_index++] = rend_poly[i];
+            else
+                geo_poly[opaque_index++] = rend_poly[i];
         }
-
-        memcpy(rend_poly, temp, rend_poly_count * sizeof(Polygon));
+        swap(geo_poly, rend_poly);
 
         //y-sorting
-        if (flush_mode & 0x1)
-            stable_sort(rend_poly, rend_poly + opaque_count, y_sort);
-        else
-            stable_sort(rend_poly, rend_poly + rend_poly_count, y_sort);
+        y_sort_polygons(0, opaque_count);
+        if (!(flush_mode & 0x1))
+            y_sort_polygons(opaque_count, rend_poly_count);
     }
     swap_buffers = false;
+
+    latch_render_regs();
+    lines_rendered = 0;
+    lines_rasterized = 0;
+
+    flush_dirty_textures();
+    render_threaded = Config::threaded_3D;
+    if (render_threaded)
+        start_render();
+    //Geometry commands stalled behind SWAP_BUFFERS can run again
+    schedule_commands();
+}
+
+//Latch the rendering registers for the next frame
+void GPU_3D::latch_render_regs()
+{
+    render_DISP3DCNT = DISP3DCNT;
+    render_CLEAR_DEPTH = CLEAR_DEPTH;
+    render_CLEAR_COLOR = CLEAR_COLOR;
+    memcpy(render_TOON_TABLE, TOON_TABLE, sizeof(TOON_TABLE));
+    memcpy(render_EDGE_COLOR, EDGE_COLOR, sizeof(EDGE_COLOR));
+    render_ALPHA_TEST_REF = ALPHA_TEST_REF;
+
+    //FOG_OFFSET is in the units of CLEAR_DEPTH
+    render_fog.offset = FOG_OFFSET * 0x200;
+    render_fog.shift = DISP3DCNT.fog_depth_shift;
+    render_fog.density[0] = FOG_TABLE[0];
+    for (int i = 0; i < 32; i++)
+        render_fog.density[i + 1] = FOG_TABLE[i];
+    render_fog.density[33] = FOG_TABLE[31];
+    uint32_t fog_color = rgb15_to_buffer(FOG_COLOR & 0x7FFF);
+    render_fog.r = (fog_color >> 16) & 0xFF;
+    render_fog.g = (fog_color >> 8) & 0xFF;
+    render_fog.b = fog_color & 0xFF;
 }
 
 void GPU_3D::MTX_MULT(bool update_vector)
 {
     MTX temp;
-    int64_t temp_calc;
     MTX* target = nullptr;
     if (MTX_MODE != 3)
         clip_dirty = true;
@@ -1832,17 +2627,8 @@ void GPU_3D::MTX_MULT(bool update_vector)
             if (update_vector)
             {
                 temp.set(vector_mtx);
-
-                for (int i = 0; i < 4; i++)
-                {
-                    for (int j = 0; j < 4; j++)
-                    {
-                        temp_calc = 0;
-                        for (int k = 0; k < 4; k++)
-                            temp_calc += (int64_t)mult_params.m[i][k] * temp.m[k][j];
-                        vector_mtx.m[i][j] = (int32_t)(temp_calc >> 12);
-                    }
-                }
+                GX_Math::mtx_mult(vector_mtx, mult_params, temp);
+                vector_mtx_gen++;
             }
             break;
         case 3:
@@ -1854,17 +2640,7 @@ void GPU_3D::MTX_MULT(bool update_vector)
     }
 
     temp.set(*target);
-
-    for (int i = 0; i < 4; i++)
-    {
-        for (int j = 0; j < 4; j++)
-        {
-            temp_calc = 0;
-            for (int k = 0; k < 4; k++)
-                temp_calc += (int64_t)mult_params.m[i][k] * temp.m[k][j];
-            target->m[i][j] = (int32_t)(temp_calc >> 12);
-        }
-    }
+    GX_Math::mtx_mult(*target, mult_params, temp);
 
     //Reset the mult matrix for further use
     get_identity_mtx(mult_params);
@@ -1875,22 +2651,25 @@ void GPU_3D::update_clip_mtx()
 {
     if (clip_dirty || true)
     {
-        int64_t temp_calc;
-
-        for (int i = 0; i < 4; i++)
-        {
-            for (int j = 0; j < 4; j++)
-            {
-                temp_calc = 0;
-                for (int k = 0; k < 4; k++)
-                    temp_calc += (int64_t)modelview_mtx.m[i][k] * projection_mtx.m[k][j];
-                clip_mtx.m[i][j] = (int32_t)(temp_calc >> 12);
-            }
-        }
+        GX_Math::mtx_mult(clip_mtx, modelview_mtx, projection_mtx);
         clip_dirty = false;
     }
 }
 
+void GPU_3D::update_light_mtx(int light)
+{
+    for (int i = 0; i < 3; i++)
+        diffuse_light_mtx.m[i][light] = light_direction[light][i];
+    diffuse_light_mtx.m[3][light] = 0;
+
+    //Specular uses the half vector between the light and the line of sight (0, 0, -1)
+    shine_light_mtx.m[0][light] = light_direction[light][0] >> 1;
+    shine_light_mtx.m[1][light] = light_direction[light][1] >> 1;
+    shine_light_mtx.m[2][light] = (light_direction[light][2] - 0x200) >> 1;
+    shine_light_mtx.m[3][light] = 0;
+    light_gen++;
+}
+
 uint16_t GPU_3D::get_DISP3DCNT()
 {
     uint16_t reg = 0;
@@ -1911,6 +2690,7 @@ uint16_t GPU_3D::get_DISP3DCNT()
 
 uint32_t GPU_3D::get_GXSTAT()
 {
+    sync();
     //printf("\nGet GXSTAT");
     uint32_t reg = 0;
     reg |= GXSTAT.box_pos_vec_busy;
@@ -1927,21 +2707,60 @@ uint32_t GPU_3D::get_GXSTAT()
 
 uint16_t GPU_3D::get_vert_count()
 {
+    sync();
     return geo_vert_count;
 }
 
 uint16_t GPU_3D::get_poly_count()
 {
+    sync();
     return geo_poly_count;
 }
 
 uint16_t GPU_3D::read_vec_test(uint32_t address)
 {
+    sync();
     return vec_test_result[(address - 0x04000630) / 2];
 }
 
+uint64_t GPU_3D::get_texture_cache_hits()
+{
+    return texture_cache_hits;
+}
+
+uint64_t GPU_3D::get_texture_cache_misses()
+{
+    return texture_cache_misses;
+}
+
+uint64_t GPU_3D::get_light_memo_hits()
+{
+    return light_memo_hits;
+}
+
+uint64_t GPU_3D::get_light_memo_misses()
+{
+    return light_memo_misses;
+}
+
+uint64_t GPU_3D::get_span_pixels()
+{
+    return span_pixels;
+}
+
+uint64_t GPU_3D::get_culled_pixels()
+{
+    return culled_pixels;
+}
+
+uint64_t GPU_3D::get_drawn_pixels()
+{
+    return drawn_pixels;
+}
+
 uint32_t GPU_3D::read_clip_mtx(uint32_t address)
 {
+    sync();
     update_clip_mtx();
     int x = (address - 0x04000640) % 4;
     int y = (address - 0x04000640) / 4;
@@ -1950,6 +2769,7 @@ uint32_t GPU_3D::read_clip_mtx(uint32_t address)
 
 uint32_t GPU_3D::read_vec_mtx(uint32_t address)
 {
+    sync();
     uint32_t addr = address - 0x04000680;
     int x = addr % 3;
     int y = addr / 3;
@@ -2054,6 +2874,7 @@ void GPU_3D::MTX_IDENTITY()
         case 2:
             get_identity_mtx(modelview_mtx);
             get_identity_mtx(vector_mtx);
+            vector_mtx_gen++;
             break;
         case 3:
             get_identity_mtx(texture_mtx);
@@ -2126,25 +2947,36 @@ void GPU_3D::NORMAL()
     normal_vector[0] = (int16_t)((cmd_params[0] & 0x3FF) << 6) >> 6;
     normal_vector[1] = (int16_t)(((cmd_params[0] >> 10) & 0x3FF) << 6) >> 6;
     normal_vector[2] = (int16_t)(((cmd_params[0] >> 20) & 0x3FF) << 6) >> 6;
+
+    int32_t vec[4] = {normal_vector[0], normal_vector[1], normal_vector[2], 0};
     if (TEXIMAGE_PARAM.transformation_mode == 2)
     {
-        int32_t texcoords[2];
-        texcoords[0] = current_texcoords[0];
-        texcoords[1] = current_texcoords[1];
-        current_texcoords[0] += (normal_vector[0] * texture_mtx.m[0][0] + normal_vector[1] * texture_mtx.m[1][0]
-                + normal_vector[2] * texture_mtx.m[2][0]) >> 21;
-        current_texcoords[1] += (normal_vector[0] * texture_mtx.m[0][1] + normal_vector[1] * texture_mtx.m[1][1]
-                + normal_vector[2] * texture_mtx.m[2][1]) >> 21;
+        int32_t texcoords[4];
+        GX_Math::vec4_transform32(texcoords, vec, texture_mtx, 21);
+        current_texcoords[0] += texcoords[0];
+        current_texcoords[1] += texcoords[1];
+    }
+
+    uint32_t normal_param = cmd_params[0] & 0x3FFFFFFF;
+    uint8_t light_enable = POLYGON_ATTR.light_enable;
+    Light_Memo& memo = light_memo[(((normal_param ^ (light_enable << 26)) * 0x9E3779B1) >> 24) & (LIGHT_MEMO_SIZE - 1)];
+    if (memo.normal == normal_param && memo.light_enable == light_enable &&
+        memo.vector_mtx_gen == vector_mtx_gen && memo.light_gen == light_gen)
+    {
+        light_memo_hits++;
+        current_color = memo.color;
+        return;
     }
+    light_memo_misses++;
 
-    int32_t normal[3];
+    int32_t normal[4];
+    GX_Math::vec4_transform32(normal, vec, vector_mtx, 12);
+    normal[3] = 0;
 
-    normal[0] = (normal_vector[0] * vector_mtx.m[0][0] + normal_vector[1] * vector_mtx.m[1][0] +
-            normal_vector[2] * vector_mtx.m[2][0]) >> 12;
-    normal[1] = (normal_vector[0] * vector_mtx.m[0][1] + normal_vector[1] * vector_mtx.m[1][1] +
-            normal_vector[2] * vector_mtx.m[2][1]) >> 12;
-    normal[2] = (normal_vector[0] * vector_mtx.m[0][2] + normal_vector[1] * vector_mtx.m[1][2] +
-            normal_vector[2] * vector_mtx.m[2][2]) >> 12;
+    //Dot products of the normal with all four lights at once
+    int32_t diffuse_dot[4], shine_dot[4];
+    GX_Math::vec4_transform32(diffuse_dot, normal, diffuse_light_mtx, 0);
+    GX_Math::vec4_transform32(shine_dot, normal, shine_light_mtx, 0);
 
     uint32_t r, g, b, lr, lg, lb;
     r = emission_color & 0x1F;
@@ -2161,9 +2993,7 @@ void GPU_3D::NORMAL()
         lg = (light_color[light] >> 5) & 0x1F;
         lb = (light_color[light] >> 10) & 0x1F;
 
-        int32_t diffuse_level = (-(light_direction[light][0] * normal[0] +
-                light_direction[light][1] * normal[1] +
-                light_direction[light][2] * normal[2])) >> 10;
+        int32_t diffuse_level = (-diffuse_dot[light]) >> 10;
 
         //Overflow handling taken from melonDS (same goes for specular)
         if (diffuse_level < 0)
@@ -2171,9 +3001,7 @@ void GPU_3D::NORMAL()
         if (diffuse_level > 0xFF)
             diffuse_level = 0xFF;
 
-        int32_t shine_level = -((((light_direction[light][0] >> 1) * normal[0] +
-                (light_direction[light][1] >> 1) * normal[1] +
-                ((light_direction[light][2] - 0x200) >> 1) * normal[2])) >> 10);
+        int32_t shine_level = -(shine_dot[light] >> 10);
 
         if (shine_level < 0)
             shine_level = 0;
@@ -2213,6 +3041,12 @@ void GPU_3D::NORMAL()
     }
 
     current_color = r + (g << 5) + (b << 10);
+
+    memo.normal = normal_param;
+    memo.light_enable = light_enable;
+    memo.vector_mtx_gen = vector_mtx_gen;
+    memo.light_gen = light_gen;
+    memo.color = current_color;
 }
 
 void GPU_3D::set_POLYGON_ATTR(uint32_t word)
@@ -2251,6 +3085,46 @@ void GPU_3D::set_TOON_TABLE(uint32_t address, uint16_t color)
     TOON_TABLE[address] = color;
 }
 
+void GPU_3D::set_EDGE_COLOR(uint32_t address, uint16_t color)
+{
+    EDGE_COLOR[address] = color & 0x7FFF;
+}
+
+void GPU_3D::set_ALPHA_TEST_REF(uint16_t halfword)
+{
+    ALPHA_TEST_REF = halfword & 0x1F;
+}
+
+void GPU_3D::set_CLRIMAGE_OFFSET(uint16_t halfword)
+{
+    CLRIMAGE_OFFSET = halfword;
+}
+
+void GPU_3D::set_FOG_COLOR(uint32_t word)
+{
+    FOG_COLOR = word & 0x1F7FFF;
+}
+
+void GPU_3D::set_FOG_COLOR_lo(uint16_t halfword)
+{
+    FOG_COLOR = (FOG_COLOR & 0x1F0000) | (halfword & 0x7FFF);
+}
+
+void GPU_3D::set_FOG_COLOR_hi(uint16_t halfword)
+{
+    FOG_COLOR = (FOG_COLOR & 0x7FFF) | ((halfword & 0x1F) << 16);
+}
+
+void GPU_3D::set_FOG_OFFSET(uint16_t halfword)
+{
+    FOG_OFFSET = halfword & 0x7FFF;
+}
+
+void GPU_3D::set_FOG_TABLE(uint32_t address, uint8_t byte)
+{
+    FOG_TABLE[address] = byte & 0x7F;
+}
+
 void GPU_3D::BEGIN_VTXS(uint32_t word)
 {
     printf("\nBEGIN_VTXS: $%08X", word);
@@ -2307,18 +3181,8 @@ void GPU_3D::BOX_TEST()
 
     for (int i = 0; i < 8; i++)
     {
-        int32_t x = cube[i].coords[0];
-        int32_t y = cube[i].coords[1];
-        int32_t z = cube[i].coords[2];
-
-        cube[i].coords[0] = (x * clip_mtx.m[0][0] + y * clip_mtx.m[1][0] +
-                z * clip_mtx.m[2][0] + 0x1000 * clip_mtx.m[3][0]) >> 12;
-        cube[i].coords[1] = (x*clip_mtx.m[0][1] + y * clip_mtx.m[1][1] +
-                z * clip_mtx.m[2][1] + 0x1000 * clip_mtx.m[3][1]) >> 12;
-        cube[i].coords[2] = (x*clip_mtx.m[0][2] + y * clip_mtx.m[1][2] +
-                z * clip_mtx.m[2][2] + 0x1000 * clip_mtx.m[3][2]) >> 12;
-        cube[i].coords[3] = (x*clip_mtx.m[0][3] + y * clip_mtx.m[1][3] +
-                z * clip_mtx.m[2][3] + 0x1000 * clip_mtx.m[3][3]) >> 12;
+        cube[i].coords[3] = 0x1000;
+        GX_Math::vec4_transform32(cube[i].coords, cube[i].coords, clip_mtx, 12);
     }
 
     int vertices;
@@ -2381,14 +3245,16 @@ void GPU_3D::BOX_TEST()
 void GPU_3D::VEC_TEST()
 {
     //printf("\nVEC_TEST");
-    int16_t bark[3];
+    int32_t bark[4], result[4];
     bark[0] = (int16_t)((cmd_params[0] & 0x3FF) << 6) >> 6;
     bark[1] = (int16_t)(((cmd_params[0] >> 9) & 0x3FF) << 6) >> 6;
     bark[2] = (int16_t)(((cmd_params[0] >> 18) & 0x3FF) << 6) >> 6;
+    bark[3] = 0;
 
-    vec_test_result[0] = (bark[0] * vector_mtx.m[0][0] + bark[1] * vector_mtx.m[1][0] + bark[2] * vector_mtx.m[2][0]) >> 9;
-    vec_test_result[1] = (bark[0] * vector_mtx.m[0][1] + bark[1] * vector_mtx.m[1][1] + bark[2] * vector_mtx.m[2][1]) >> 9;
-    vec_test_result[2] = (bark[0] * vector_mtx.m[0][2] + bark[1] * vector_mtx.m[1][2] + bark[2] * vector_mtx.m[2][2]) >> 9;
+    GX_Math::vec4_transform32(result, bark, vector_mtx, 9);
+    vec_test_result[0] = result[0];
+    vec_test_result[1] = result[1];
+    vec_test_result[2] = result[2];
 
     vec_test_result[0] |= (vec_test_result[0] & 0x1000) * 0xF;
     vec_test_result[1] |= (vec_test_result[1] & 0x1000) * 0xF;
@@ -2397,6 +3263,7 @@ void GPU_3D::VEC_TEST()
 
 void GPU_3D::set_GXSTAT(uint32_t word)
 {
+    sync();
     GXSTAT.GXFIFO_irq_stat = (word >> 30) & 0x3;
     check_FIFO_IRQ();
 }
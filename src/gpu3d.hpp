@@ -6,10 +6,37 @@
 
 #ifndef GPU3D_HPP
 #define GPU3D_HPP
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
-#include <queue>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "gpu3dmath.hpp"
 #include "memconsts.h"
 
+#define TEXIMAGE_SIZE           0x80000
+#define TEXPAL_SIZE             0x18000
+#define TEXIMAGE_PAGE_SIZE      0x1000
+#define TEXPAL_PAGE_SIZE        0x400
+#define TEXIMAGE_PAGES          128
+#define TEXPAL_PAGES            96
+
+//Maximum number of decoded texels kept in the texture cache
+#define TEXTURE_CACHE_TEXELS    0x400000
+
+//Entries in the memo of lit NORMAL colors
+#define LIGHT_MEMO_SIZE         256
+
+//Width in pixels of the blocks tracked by the coarse depth buffer
+#define Z_BLOCK_WIDTH           8
+#define Z_BLOCKS                32
+
+//Times the main thread yields waiting for a threaded line before it sleeps on render_cond
+#define RENDER_SPIN_LIMIT       64
+
 struct DISP3DCNT_REG
 {
     bool texture_mapping;
@@ -70,13 +97,6 @@ struct GXSTAT_REG
     int GXFIFO_irq_stat;
 };
 
-struct MTX
-{
-    int32_t m[4][4];
-
-    void set(const MTX& mtx);
-};
-
 struct Vertex
 {
     int32_t coords[4];
@@ -86,11 +106,14 @@ struct Vertex
     bool clipped;
 
     int32_t texcoords[2];
+
+    //Entry in geo_vert once stored, so strip polygons can share it
+    int32_t vert_index;
 };
 
 struct Polygon
 {
-    uint16_t vert_index;
+    uint16_t vert_indices[10];
     uint8_t vertices;
 
     uint16_t top_y, bottom_y;
@@ -108,9 +131,72 @@ struct GX_Command
     uint32_t param;
 };
 
+//Fixed-capacity command ring, used for GXFIFO and GXPIPE. Capacity must be a power of two
+template <unsigned int capacity>
+struct GX_Ring
+{
+    GX_Command entries[capacity];
+    unsigned int head, count;
+
+    void clear() { head = 0; count = 0; }
+    //Used after loading a ring from a save state, which may not be trustworthy
+    bool validate() { head &= capacity - 1; return count <= capacity; }
+    unsigned int size() const { return count; }
+    unsigned int space() const { return capacity - count; }
+    GX_Command& front() { return entries[head]; }
+    void pop() { head = (head + 1) & (capacity - 1); count--; }
+    void push(const GX_Command& cmd)
+    {
+        entries[(head + count) & (capacity - 1)] = cmd;
+        count++;
+    }
+    void push(const GX_Command* cmds, unsigned int amount)
+    {
+        for (unsigned int i = 0; i < amount; i++)
+            entries[(head + count + i) & (capacity - 1)] = cmds[i];
+        count += amount;
+    }
+};
+
+//Translucent pixel drawn over the 2D layer, blended when the scanline is composited
+struct Trans_Fragment
+{
+    uint16_t x;
+    uint8_t alpha;
+    uint32_t color;
+};
+
+struct Cached_Texture
+{
+    std::vector<uint32_t> texels;
+
+    //Texture memory the decoded data depends on
+    uint32_t image_start, image_end;
+    uint32_t slot1_start, slot1_end;
+    uint32_t pal_start, pal_end;
+
+    std::list<uint64_t>::iterator lru_pos;
+};
+
+struct Light_Memo
+{
+    uint32_t normal; //NORMAL parameter
+    uint8_t light_enable;
+    uint64_t vector_mtx_gen, light_gen;
+    uint16_t color;
+};
+
+enum PIXEL_STATE
+{
+    PIXEL_EMPTY,
+    PIXEL_TRANSLUCENT,
+    PIXEL_OPAQUE
+};
+
 class Emulator;
 
 class GPU;
+class Save_State;
 
 class GPU_3D
 {
@@ -118,10 +204,17 @@ class GPU_3D
         Emulator* e;
         GPU* gpu;
         int cycles;
+        uint64_t geo_timestamp;
         DISP3DCNT_REG DISP3DCNT;
         POLYGON_ATTR_REG POLYGON_ATTR;
         TEXIMAGE_PARAM_REG TEXIMAGE_PARAM;
         uint16_t TOON_TABLE[32];
+        uint16_t EDGE_COLOR[8];
+        uint16_t ALPHA_TEST_REF;
+        uint16_t CLRIMAGE_OFFSET;
+        uint32_t FOG_COLOR;
+        uint16_t FOG_OFFSET;
+        uint8_t FOG_TABLE[32];
         uint32_t PLTT_BASE;
         VIEWPORT_REG viewport;
         GXSTAT_REG GXSTAT;
@@ -129,8 +222,8 @@ class GPU_3D
         uint32_t CLEAR_DEPTH, CLEAR_COLOR;
         int flush_mode;
 
-        std::queue<GX_Command> GXFIFO;
-        std::queue<GX_Command> GXPIPE;
+        GX_Ring<256> GXFIFO;
+        GX_Ring<4> GXPIPE;
 
         uint32_t cmd_params[32];
         uint8_t param_count;
@@ -145,16 +238,67 @@ class GPU_3D
         int16_t current_texcoords[2];
 
         uint32_t z_buffer[SCANLINES][PIXELS_PER_LINE];
-        uint8_t trans_poly_ids[PIXELS_PER_LINE];
+
+        //Upper bound of z_buffer for each block, so spans hidden behind drawn geometry can be skipped
+        uint32_t z_block_max[SCANLINES][Z_BLOCKS];
+
+        //Finished 3D layer, composited onto BG0 one scanline at a time
+        uint32_t color_buffer[SCANLINES][PIXELS_PER_LINE];
+        uint8_t pixel_state[SCANLINES][PIXELS_PER_LINE];
+        uint8_t pixel_attr[SCANLINES][PIXELS_PER_LINE]; //Polygon ID in bits 0-5, fog flag in bit 7
+        std::vector<Trans_Fragment> trans_fragments[SCANLINES];
+
+        //Registers latched at VBLANK for the frame being rendered
+        DISP3DCNT_REG render_DISP3DCNT;
+        uint16_t render_TOON_TABLE[32];
+        uint32_t render_CLEAR_DEPTH;
+        uint32_t render_CLEAR_COLOR;
+        uint16_t render_EDGE_COLOR[8];
+        uint16_t render_ALPHA_TEST_REF;
+        GX_Fog render_fog;
+
+        //Threaded renderer: draws frame N while the CPUs emulate frame N+1
+        bool render_threaded;
+        std::thread render_thread;
+        std::mutex render_mutex;
+        std::condition_variable render_cond;
+        bool render_pending;
+        bool render_thread_exit;
+        std::atomic<int> lines_rendered;
+        std::atomic<int> line_waiting; //Line the main thread sleeps on, SCANLINES when it isn't sleeping
+        int lines_rasterized;
+        uint8_t teximage_snapshot[TEXIMAGE_SIZE];
+        uint8_t texpal_snapshot[TEXPAL_SIZE];
+
+        //Decoded textures, keyed by TEXIMAGE_PARAM and PLTT_BASE
+        std::unordered_map<uint64_t, Cached_Texture> texture_cache;
+        std::list<uint64_t> texture_lru;
+        uint32_t texture_cache_texels;
+        bool teximage_dirty[TEXIMAGE_PAGES];
+        bool texpal_dirty[TEXPAL_PAGES];
+        bool texture_dirty;
+        uint64_t texture_cache_hits, texture_cache_misses;
+
+        //Lit colors of recent NORMAL commands. Generations change whenever the vector matrix
+        //or the material/light registers do, so stale entries never match.
+        Light_Memo light_memo[LIGHT_MEMO_SIZE];
+        uint64_t vector_mtx_gen, light_gen;
+        uint64_t light_memo_hits, light_memo_misses;
+
+        //Overdraw statistics: pixels covered by spans, pixels rejected by the coarse depth buffer,
+        //and pixels that passed the depth and alpha tests
+        uint64_t span_pixels, culled_pixels, drawn_pixels;
 
         bool swap_buffers;
 
         static const uint8_t cmd_param_amounts[256];
         static const uint16_t cmd_cycle_amounts[256];
 
-        Vertex geo_vert[6188], rend_vert[6188];
-        Polygon geo_poly[2048], rend_poly[2048];
-        Polygon* last_poly_strip;
+        //Polygon and vertex RAM are double-buffered; SWAP_BUFFERS exchanges the pointers
+        Vertex vert_buffers[2][6188];
+        Polygon poly_buffers[2][2048];
+        Vertex *geo_vert, *rend_vert;
+        Polygon *geo_poly, *rend_poly;
 
         Vertex vertex_list[10];
         int vertex_list_count;
@@ -179,6 +323,9 @@ class GPU_3D
         uint16_t emission_color, ambient_color, diffuse_color, specular_color;
         uint16_t light_color[4];
         int16_t light_direction[4][3];
+
+        //light_direction laid out so a single transform gives every light's dot product with the normal
+        MTX diffuse_light_mtx, shine_light_mtx;
         int16_t normal_vector[3];
         uint8_t shine_table[128];
         bool using_shine_table;
@@ -196,11 +343,18 @@ class GPU_3D
 
         GX_Command read_command();
         void write_command(GX_Command& cmd);
+        void write_commands(const GX_Command* cmds, int count);
+        int parse_GXFIFO_word(uint32_t word, GX_Command* cmds);
+        void run(uint64_t cycles_to_run);
+        void schedule_commands();
         void exec_command();
 
         void add_mult_param(uint32_t word);
         void MTX_MULT(bool update_vector = true);
         void update_clip_mtx();
+        void update_light_mtx(int light);
+        void y_sort_polygons(int start, int end);
+        void update_z_block_max(int line, int left_x, int right_x);
 
         int clip(Vertex* v_list, int v_len, int clip_start, bool add_attributes = false);
         int clip_plane(int plane, Vertex* v_list, int v_len, int clip_start, bool add_attributes);
@@ -209,16 +363,34 @@ class GPU_3D
         void add_polygon();
 
         void request_FIFO_DMA();
+
+        template <typename T> T read_teximage(uint32_t address);
+        template <typename T> T read_texpal(uint32_t address);
+        uint32_t decode_texel(const TEXIMAGE_PARAM_REG& texparams, uint32_t pal_base, int s, int t);
+        uint32_t* get_texture(const Polygon& poly);
+        void flush_dirty_textures();
+        void clear_texture_cache();
+        void render_line(int line);
+        void post_process_line(int line);
+        void latch_render_regs();
+        void start_render();
+        void wait_for_render();
+        void wait_for_line(int line);
+        void publish_lines(int count);
+        void render_thread_loop();
     public:
         GPU_3D(Emulator* e, GPU* gpu);
+        ~GPU_3D();
         void power_on();
+        void do_state(Save_State& state);
         void render_scanline(uint32_t* framebuffer, uint8_t bg_priorities[256], uint8_t bg0_priority);
-        void run(uint64_t cycles_to_run);
+        void sync();
         void end_of_frame();
         void check_FIFO_DMA();
         void check_FIFO_IRQ();
 
         void write_GXFIFO(uint32_t word);
+        int write_GXFIFO_block(const uint32_t* words, int count);
         void write_FIFO_direct(uint32_t address, uint32_t word);
 
         uint16_t get_DISP3DCNT();
@@ -228,6 +400,16 @@ class GPU_3D
         uint32_t read_clip_mtx(uint32_t address);
         uint32_t read_vec_mtx(uint32_t address);
         uint16_t read_vec_test(uint32_t address);
+        uint64_t get_texture_cache_hits();
+        uint64_t get_texture_cache_misses();
+        uint64_t get_light_memo_hits();
+        uint64_t get_light_memo_misses();
+        uint64_t get_span_pixels();
+        uint64_t get_culled_pixels();
+        uint64_t get_drawn_pixels();
+
+        void invalidate_teximage(uint32_t address, uint32_t size);
+        void invalidate_texpal(uint32_t address, uint32_t size);
 
         void set_DISP3DCNT(uint16_t halfword);
 
@@ -246,6 +428,14 @@ class GPU_3D
         void set_POLYGON_ATTR(uint32_t word);
         void set_TEXIMAGE_PARAM(uint32_t word);
         void set_TOON_TABLE(uint32_t address, uint16_t color);
+        void set_EDGE_COLOR(uint32_t address, uint16_t color);
+        void set_ALPHA_TEST_REF(uint16_t halfword);
+        void set_CLRIMAGE_OFFSET(uint16_t halfword);
+        void set_FOG_COLOR(uint32_t word);
+        void set_FOG_COLOR_lo(uint16_t halfword);
+        void set_FOG_COLOR_hi(uint16_t halfword);
+        void set_FOG_OFFSET(uint16_t halfword);
+        void set_FOG_TABLE(uint32_t address, uint8_t byte);
         void BEGIN_VTXS(uint32_t word);
         void SWAP_BUFFERS(uint32_t word);
         void VIEWPORT(uint32_t word);
@@ -0,0 +1,806 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <cstring>
+#include "gpu3dmath.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define GX_MATH_X86
+#include <immintrin.h>
+#endif
+
+void MTX::set(const MTX &mtx)
+{
+    memcpy(m, mtx.m, sizeof(MTX));
+}
+
+static void vec4_transform_scalar(int32_t* out, const int32_t* vec, const MTX& mtx)
+{
+    int32_t result[4];
+    for (int j = 0; j < 4; j++)
+    {
+        //Sums wrap at 64 bits like the SIMD versions, and only bits 12-43 are kept, so the shift can be logical
+        uint64_t temp_calc = 0;
+        for (int k = 0; k < 4; k++)
+            temp_calc += (uint64_t)((int64_t)vec[k] * mtx.m[k][j]);
+        result[j] = (int32_t)(temp_calc >> 12);
+    }
+    memcpy(out, result, sizeof(result));
+}
+
+static void vec4_transform32_scalar(int32_t* out, const int32_t* vec, const MTX& mtx, int shift)
+{
+    int32_t result[4];
+    for (int j = 0; j < 4; j++)
+    {
+        //Products wrap at 32 bits, the same as the hardware
+        uint32_t temp_calc = 0;
+        for (int k = 0; k < 4; k++)
+            temp_calc += (uint32_t)vec[k] * (uint32_t)mtx.m[k][j];
+        result[j] = (int32_t)temp_calc >> shift;
+    }
+    memcpy(out, result, sizeof(result));
+}
+
+static void mtx_mult_scalar(MTX& dest, const MTX& a, const MTX& b)
+{
+    for (int i = 0; i < 4; i++)
+        vec4_transform_scalar(dest.m[i], a.m[i], b);
+}
+
+static inline bool depth_test_pixel(uint32_t z, uint32_t buffer_z, bool test_equal)
+{
+    if (test_equal)
+    {
+        uint32_t low_z = buffer_z - 0x200;
+        uint32_t high_z = buffer_z + 0x200;
+        return !(z < low_z || z > high_z);
+    }
+    return z <= buffer_z;
+}
+
+static inline void shade_pixel(GX_Span& span, int i, uint32_t vertex_alpha, uint32_t alpha_ref)
+{
+    uint32_t texel = span.texel[i];
+    uint32_t ta = texel >> 24;
+    uint32_t tr = (texel >> 16) & 0xFF;
+    uint32_t tg = (texel >> 8) & 0xFF;
+    uint32_t tb = texel & 0xFF;
+
+    tr += !(!tr);
+    tg += !(!tg);
+    tb += !(!tb);
+
+    span.r[i] = (((tr + 1) * (span.r[i] + 1) - 1) / 64) << 2;
+    span.g[i] = (((tg + 1) * (span.g[i] + 1) - 1) / 64) << 2;
+    span.b[i] = (((tb + 1) * (span.b[i] + 1) - 1) / 64) << 2;
+    span.alpha[i] = ((ta + 1) * (vertex_alpha + 1) - 1) / 32;
+    if (span.alpha[i] <= alpha_ref)
+        span.mask[i] = 0;
+}
+
+static inline void write_pixel(const GX_Span& span, int i, uint32_t* z_buffer, uint32_t* color_buffer,
+                               uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z)
+{
+    if (!span.mask[i])
+        return;
+    if (write_z)
+        z_buffer[i] = span.z[i];
+    uint32_t final_color = 0xFF000000 | (span.r[i] << 16) | (span.g[i] << 8) | span.b[i];
+    color_buffer[i] = 0xFF000000 + final_color;
+    pixel_state[i] = state;
+    pixel_attr[i] = attr;
+}
+
+static void depth_test_span_scalar(GX_Span& span, const uint32_t* z_buffer, bool test_equal)
+{
+    for (int i = 0; i < span.count; i++)
+        span.mask[i] = depth_test_pixel(span.z[i], z_buffer[i], test_equal) ? 0xFFFFFFFF : 0;
+}
+
+static void shade_span_scalar(GX_Span& span, uint32_t vertex_alpha, uint32_t alpha_ref)
+{
+    for (int i = 0; i < span.count; i++)
+    {
+        if (span.mask[i])
+            shade_pixel(span, i, vertex_alpha, alpha_ref);
+    }
+}
+
+static void write_span_scalar(const GX_Span& span, uint32_t* z_buffer, uint32_t* color_buffer,
+                              uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z)
+{
+    for (int i = 0; i < span.count; i++)
+        write_pixel(span, i, z_buffer, color_buffer, pixel_state, state, pixel_attr, attr, write_z);
+}
+
+static inline bool in_front(uint32_t z, uint8_t attr, uint32_t neighbour_z, uint8_t neighbour_attr)
+{
+    return (attr & 0x3F) != (neighbour_attr & 0x3F) && z < neighbour_z;
+}
+
+static inline uint32_t find_edge_pixel(int x, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                                       const uint8_t* pixel_state, uint8_t opaque_state)
+{
+    if (pixel_state[x] != opaque_state)
+        return 0;
+    uint32_t z = z_rows[1][x];
+    uint8_t attr = attr_rows[1][x];
+    if (in_front(z, attr, z_rows[1][x - 1], attr_rows[1][x - 1]) ||
+        in_front(z, attr, z_rows[1][x + 1], attr_rows[1][x + 1]) ||
+        in_front(z, attr, z_rows[0][x], attr_rows[0][x]) ||
+        in_front(z, attr, z_rows[2][x], attr_rows[2][x]))
+        return 0xFFFFFFFF;
+    return 0;
+}
+
+static void find_edges_scalar(uint32_t* edges, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                              const uint8_t* pixel_state, uint8_t opaque_state)
+{
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+        edges[x] = find_edge_pixel(x, z_rows, attr_rows, pixel_state, opaque_state);
+}
+
+//Density from 0 to 128, interpolated between the two table entries around the depth
+static inline uint32_t fog_density(uint32_t z, const GX_Fog& fog)
+{
+    uint32_t index = 0, frac = 0;
+    if (z >= fog.offset)
+    {
+        uint32_t depth = ((z - fog.offset) >> 2) << fog.shift;
+        index = depth >> 17;
+        frac = depth & 0x1FFFF;
+        if (index >= 32)
+        {
+            index = 32;
+            frac = 0;
+        }
+    }
+    uint32_t density = (fog.density[index] * (0x20000 - frac) + fog.density[index + 1] * frac) >> 17;
+    if (density >= 127)
+        density = 128;
+    return density;
+}
+
+static inline void fog_pixel(uint32_t* color_buffer, int x, uint32_t z, const GX_Fog& fog)
+{
+    uint32_t density = fog_density(z, fog);
+    uint32_t color = color_buffer[x];
+    uint32_t r = (color >> 16) & 0xFF;
+    uint32_t g = (color >> 8) & 0xFF;
+    uint32_t b = color & 0xFF;
+    r = (fog.r * density + r * (128 - density)) >> 7;
+    g = (fog.g * density + g * (128 - density)) >> 7;
+    b = (fog.b * density + b * (128 - density)) >> 7;
+    color_buffer[x] = (color & 0xFF000000) | (r << 16) | (g << 8) | b;
+}
+
+static void fog_line_scalar(uint32_t* color_buffer, const uint32_t* z_buffer, const uint8_t* pixel_attr,
+                            const uint8_t* pixel_state, uint8_t opaque_state, const GX_Fog& fog)
+{
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+    {
+        if (pixel_state[x] == opaque_state && (pixel_attr[x] & 0x80))
+            fog_pixel(color_buffer, x, z_buffer[x], fog);
+    }
+}
+
+#ifdef GX_MATH_X86
+
+//The 64-bit sums are truncated to 32 bits after the shift, so a logical shift gives the same bits as an arithmetic one.
+__attribute__((target("sse4.1")))
+static inline __m128i vec4_transform_sse41_row(const int32_t* vec, const MTX& mtx)
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i scalar = _mm_set1_epi32(vec[k]);
+        __m128i row = _mm_loadu_si128((const __m128i*)mtx.m[k]);
+        lo = _mm_add_epi64(lo, _mm_mul_epi32(scalar, _mm_cvtepi32_epi64(row)));
+        hi = _mm_add_epi64(hi, _mm_mul_epi32(scalar, _mm_cvtepi32_epi64(_mm_srli_si128(row, 8))));
+    }
+    lo = _mm_srli_epi64(lo, 12);
+    hi = _mm_srli_epi64(hi, 12);
+    return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+__attribute__((target("sse4.1")))
+static void vec4_transform_sse41(int32_t* out, const int32_t* vec, const MTX& mtx)
+{
+    _mm_storeu_si128((__m128i*)out, vec4_transform_sse41_row(vec, mtx));
+}
+
+__attribute__((target("sse4.1")))
+static void mtx_mult_sse41(MTX& dest, const MTX& a, const MTX& b)
+{
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*)dest.m[i], vec4_transform_sse41_row(a.m[i], b));
+}
+
+__attribute__((target("sse4.1")))
+static void vec4_transform32_sse41(int32_t* out, const int32_t* vec, const MTX& mtx, int shift)
+{
+    __m128i sum = _mm_setzero_si128();
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i row = _mm_loadu_si128((const __m128i*)mtx.m[k]);
+        sum = _mm_add_epi32(sum, _mm_mullo_epi32(_mm_set1_epi32(vec[k]), row));
+    }
+    _mm_storeu_si128((__m128i*)out, _mm_sra_epi32(sum, _mm_cvtsi32_si128(shift)));
+}
+
+__attribute__((target("avx2")))
+static inline __m128i vec4_transform_avx2_row(const int32_t* vec, const MTX& mtx)
+{
+    __m256i sum = _mm256_setzero_si256();
+    for (int k = 0; k < 4; k++)
+    {
+        __m256i row = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)mtx.m[k]));
+        sum = _mm256_add_epi64(sum, _mm256_mul_epi32(_mm256_set1_epi64x(vec[k]), row));
+    }
+    sum = _mm256_srli_epi64(sum, 12);
+    sum = _mm256_permutevar8x32_epi32(sum, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+    return _mm256_castsi256_si128(sum);
+}
+
+__attribute__((target("avx2")))
+static void vec4_transform_avx2(int32_t* out, const int32_t* vec, const MTX& mtx)
+{
+    _mm_storeu_si128((__m128i*)out, vec4_transform_avx2_row(vec, mtx));
+}
+
+__attribute__((target("avx2")))
+static void mtx_mult_avx2(MTX& dest, const MTX& a, const MTX& b)
+{
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*)dest.m[i], vec4_transform_avx2_row(a.m[i], b));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i depth_test_sse41(__m128i z, __m128i buffer_z, bool test_equal)
+{
+    if (test_equal)
+    {
+        __m128i low_z = _mm_sub_epi32(buffer_z, _mm_set1_epi32(0x200));
+        __m128i high_z = _mm_add_epi32(buffer_z, _mm_set1_epi32(0x200));
+        __m128i above_low = _mm_cmpeq_epi32(_mm_max_epu32(z, low_z), z);
+        __m128i below_high = _mm_cmpeq_epi32(_mm_min_epu32(z, high_z), z);
+        return _mm_and_si128(above_low, below_high);
+    }
+    return _mm_cmpeq_epi32(_mm_min_epu32(z, buffer_z), z);
+}
+
+__attribute__((target("sse4.1")))
+static void depth_test_span_sse41(GX_Span& span, const uint32_t* z_buffer, bool test_equal)
+{
+    int i = 0;
+    for (; i + 4 <= span.count; i += 4)
+    {
+        __m128i z = _mm_loadu_si128((const __m128i*)&span.z[i]);
+        __m128i buffer_z = _mm_loadu_si128((const __m128i*)&z_buffer[i]);
+        _mm_storeu_si128((__m128i*)&span.mask[i], depth_test_sse41(z, buffer_z, test_equal));
+    }
+    for (; i < span.count; i++)
+        span.mask[i] = depth_test_pixel(span.z[i], z_buffer[i], test_equal) ? 0xFFFFFFFF : 0;
+}
+
+//(component + 1) with the hardware's "add one to non-zero components" expansion, i.e. c + 2 when c != 0
+__attribute__((target("sse4.1")))
+static inline __m128i expand_plus_one_sse41(__m128i c)
+{
+    return _mm_add_epi32(_mm_add_epi32(c, _mm_set1_epi32(2)), _mm_cmpeq_epi32(c, _mm_setzero_si128()));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i modulate_sse41(__m128i t_plus_one, __m128i v)
+{
+    __m128i product = _mm_mullo_epi32(t_plus_one, _mm_add_epi32(v, _mm_set1_epi32(1)));
+    product = _mm_sub_epi32(product, _mm_set1_epi32(1));
+    return _mm_slli_epi32(_mm_srli_epi32(product, 6), 2);
+}
+
+__attribute__((target("sse4.1")))
+static void shade_span_sse41(GX_Span& span, uint32_t vertex_alpha, uint32_t alpha_ref)
+{
+    const __m128i byte_mask = _mm_set1_epi32(0xFF);
+    const __m128i va_plus_one = _mm_set1_epi32(vertex_alpha + 1);
+    const __m128i ref = _mm_set1_epi32(alpha_ref);
+    int i = 0;
+    for (; i + 4 <= span.count; i += 4)
+    {
+        __m128i depth_mask = _mm_loadu_si128((const __m128i*)&span.mask[i]);
+        if (_mm_testz_si128(depth_mask, depth_mask))
+            continue;
+        __m128i texel = _mm_loadu_si128((const __m128i*)&span.texel[i]);
+        __m128i tr = expand_plus_one_sse41(_mm_and_si128(_mm_srli_epi32(texel, 16), byte_mask));
+        __m128i tg = expand_plus_one_sse41(_mm_and_si128(_mm_srli_epi32(texel, 8), byte_mask));
+        __m128i tb = expand_plus_one_sse41(_mm_and_si128(texel, byte_mask));
+        __m128i ta = _mm_add_epi32(_mm_srli_epi32(texel, 24), _mm_set1_epi32(1));
+
+        __m128i r = modulate_sse41(tr, _mm_loadu_si128((const __m128i*)&span.r[i]));
+        __m128i g = modulate_sse41(tg, _mm_loadu_si128((const __m128i*)&span.g[i]));
+        __m128i b = modulate_sse41(tb, _mm_loadu_si128((const __m128i*)&span.b[i]));
+        __m128i alpha = _mm_mullo_epi32(ta, va_plus_one);
+        alpha = _mm_srli_epi32(_mm_sub_epi32(alpha, _mm_set1_epi32(1)), 5);
+        __m128i mask = _mm_and_si128(_mm_cmpgt_epi32(alpha, ref), depth_mask);
+
+        //Pixels that failed the depth test keep their old contents, same as the scalar path
+        _mm_storeu_si128((__m128i*)&span.r[i], _mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&span.r[i]), r, depth_mask));
+        _mm_storeu_si128((__m128i*)&span.g[i], _mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&span.g[i]), g, depth_mask));
+        _mm_storeu_si128((__m128i*)&span.b[i], _mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&span.b[i]), b, depth_mask));
+        _mm_storeu_si128((__m128i*)&span.alpha[i], _mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&span.alpha[i]), alpha, depth_mask));
+        _mm_storeu_si128((__m128i*)&span.mask[i], mask);
+    }
+    for (; i < span.count; i++)
+    {
+        if (span.mask[i])
+            shade_pixel(span, i, vertex_alpha, alpha_ref);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline void write_pixels_sse41(const GX_Span& span, int i, __m128i mask, uint32_t* z_buffer, uint32_t* color_buffer,
+                                      bool write_z)
+{
+    if (write_z)
+    {
+        __m128i z = _mm_loadu_si128((const __m128i*)&span.z[i]);
+        __m128i old_z = _mm_loadu_si128((const __m128i*)&z_buffer[i]);
+        _mm_storeu_si128((__m128i*)&z_buffer[i], _mm_blendv_epi8(old_z, z, mask));
+    }
+    __m128i color = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)&span.r[i]), 16);
+    color = _mm_or_si128(color, _mm_slli_epi32(_mm_loadu_si128((const __m128i*)&span.g[i]), 8));
+    color = _mm_or_si128(color, _mm_loadu_si128((const __m128i*)&span.b[i]));
+    color = _mm_or_si128(color, _mm_set1_epi32(0xFF000000));
+    color = _mm_add_epi32(color, _mm_set1_epi32(0xFF000000));
+    __m128i old_color = _mm_loadu_si128((const __m128i*)&color_buffer[i]);
+    _mm_storeu_si128((__m128i*)&color_buffer[i], _mm_blendv_epi8(old_color, color, mask));
+}
+
+//Sets four bytes to value where byte_mask is set
+__attribute__((target("sse4.1")))
+static inline void write_bytes_sse41(uint8_t* bytes, uint8_t value, __m128i byte_mask)
+{
+    uint32_t old_bytes;
+    memcpy(&old_bytes, bytes, sizeof(old_bytes));
+    old_bytes = _mm_cvtsi128_si32(_mm_blendv_epi8(_mm_cvtsi32_si128(old_bytes), _mm_set1_epi8(value), byte_mask));
+    memcpy(bytes, &old_bytes, sizeof(old_bytes));
+}
+
+__attribute__((target("sse4.1")))
+static void write_span_sse41(const GX_Span& span, uint32_t* z_buffer, uint32_t* color_buffer,
+                             uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z)
+{
+    int i = 0;
+    for (; i + 4 <= span.count; i += 4)
+    {
+        __m128i mask = _mm_loadu_si128((const __m128i*)&span.mask[i]);
+        if (_mm_testz_si128(mask, mask))
+            continue;
+        write_pixels_sse41(span, i, mask, z_buffer, color_buffer, write_z);
+
+        //Narrow the mask to bytes for the pixel states and attributes
+        __m128i byte_mask = _mm_packs_epi16(_mm_packs_epi32(mask, mask), _mm_setzero_si128());
+        write_bytes_sse41(&pixel_state[i], state, byte_mask);
+        write_bytes_sse41(&pixel_attr[i], attr, byte_mask);
+    }
+    for (; i < span.count; i++)
+        write_pixel(span, i, z_buffer, color_buffer, pixel_state, state, pixel_attr, attr, write_z);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i load_bytes_sse41(const uint8_t* bytes)
+{
+    uint32_t four_bytes;
+    memcpy(&four_bytes, bytes, sizeof(four_bytes));
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(four_bytes));
+}
+
+//Returns all ones where the pixel is NOT in front of the neighbour
+__attribute__((target("sse4.1")))
+static inline __m128i not_in_front_sse41(__m128i z, __m128i id, const uint32_t* neighbour_z, const uint8_t* neighbour_attr)
+{
+    __m128i nz = _mm_loadu_si128((const __m128i*)neighbour_z);
+    __m128i nid = _mm_and_si128(load_bytes_sse41(neighbour_attr), _mm_set1_epi32(0x3F));
+    return _mm_or_si128(_mm_cmpeq_epi32(id, nid), _mm_cmpeq_epi32(_mm_min_epu32(nz, z), nz));
+}
+
+__attribute__((target("sse4.1")))
+static void find_edges_sse41(uint32_t* edges, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                             const uint8_t* pixel_state, uint8_t opaque_state)
+{
+    const __m128i id_mask = _mm_set1_epi32(0x3F);
+    const __m128i opaque = _mm_set1_epi32(opaque_state);
+    for (int x = 0; x < PIXELS_PER_LINE; x += 4)
+    {
+        __m128i z = _mm_loadu_si128((const __m128i*)&z_rows[1][x]);
+        __m128i id = _mm_and_si128(load_bytes_sse41(&attr_rows[1][x]), id_mask);
+        __m128i hidden = not_in_front_sse41(z, id, &z_rows[1][x - 1], &attr_rows[1][x - 1]);
+        hidden = _mm_and_si128(hidden, not_in_front_sse41(z, id, &z_rows[1][x + 1], &attr_rows[1][x + 1]));
+        hidden = _mm_and_si128(hidden, not_in_front_sse41(z, id, &z_rows[0][x], &attr_rows[0][x]));
+        hidden = _mm_and_si128(hidden, not_in_front_sse41(z, id, &z_rows[2][x], &attr_rows[2][x]));
+        __m128i is_opaque = _mm_cmpeq_epi32(load_bytes_sse41(&pixel_state[x]), opaque);
+        _mm_storeu_si128((__m128i*)&edges[x], _mm_andnot_si128(hidden, is_opaque));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i fog_blend_sse41(__m128i color, __m128i density, __m128i inverse, uint32_t fog_component, int shift)
+{
+    __m128i c = _mm_and_si128(_mm_srli_epi32(color, shift), _mm_set1_epi32(0xFF));
+    __m128i result = _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(fog_component), density), _mm_mullo_epi32(c, inverse));
+    return _mm_slli_epi32(_mm_srli_epi32(result, 7), shift);
+}
+
+__attribute__((target("sse4.1")))
+static void fog_line_sse41(uint32_t* color_buffer, const uint32_t* z_buffer, const uint8_t* pixel_attr,
+                           const uint8_t* pixel_state, uint8_t opaque_state, const GX_Fog& fog)
+{
+    const __m128i offset = _mm_set1_epi32(fog.offset);
+    const __m128i shift = _mm_cvtsi32_si128(fog.shift);
+    for (int x = 0; x < PIXELS_PER_LINE; x += 4)
+    {
+        __m128i mask = _mm_cmpeq_epi32(load_bytes_sse41(&pixel_state[x]), _mm_set1_epi32(opaque_state));
+        __m128i fog_flag = _mm_and_si128(load_bytes_sse41(&pixel_attr[x]), _mm_set1_epi32(0x80));
+        mask = _mm_and_si128(mask, _mm_cmpeq_epi32(fog_flag, _mm_set1_epi32(0x80)));
+        if (_mm_testz_si128(mask, mask))
+            continue;
+
+        __m128i z = _mm_loadu_si128((const __m128i*)&z_buffer[x]);
+        __m128i past_offset = _mm_cmpeq_epi32(_mm_max_epu32(z, offset), z);
+        __m128i depth = _mm_sll_epi32(_mm_srli_epi32(_mm_sub_epi32(z, offset), 2), shift);
+        __m128i index = _mm_and_si128(_mm_srli_epi32(depth, 17), past_offset);
+        __m128i frac = _mm_and_si128(_mm_and_si128(depth, _mm_set1_epi32(0x1FFFF)), past_offset);
+        __m128i past_table = _mm_cmpgt_epi32(index, _mm_set1_epi32(31));
+        index = _mm_blendv_epi8(index, _mm_set1_epi32(32), past_table);
+        frac = _mm_andnot_si128(past_table, frac);
+
+        uint32_t indices[4];
+        _mm_storeu_si128((__m128i*)indices, index);
+        __m128i d0 = _mm_setr_epi32(fog.density[indices[0]], fog.density[indices[1]],
+                                    fog.density[indices[2]], fog.density[indices[3]]);
+        __m128i d1 = _mm_setr_epi32(fog.density[indices[0] + 1], fog.density[indices[1] + 1],
+                                    fog.density[indices[2] + 1], fog.density[indices[3] + 1]);
+        __m128i density = _mm_add_epi32(_mm_mullo_epi32(d0, _mm_sub_epi32(_mm_set1_epi32(0x20000), frac)),
+                                        _mm_mullo_epi32(d1, frac));
+        density = _mm_srli_epi32(density, 17);
+        density = _mm_blendv_epi8(density, _mm_set1_epi32(128), _mm_cmpgt_epi32(density, _mm_set1_epi32(126)));
+        __m128i inverse = _mm_sub_epi32(_mm_set1_epi32(128), density);
+
+        __m128i color = _mm_loadu_si128((const __m128i*)&color_buffer[x]);
+        __m128i fogged = _mm_and_si128(color, _mm_set1_epi32(0xFF000000));
+        fogged = _mm_or_si128(fogged, fog_blend_sse41(color, density, inverse, fog.r, 16));
+        fogged = _mm_or_si128(fogged, fog_blend_sse41(color, density, inverse, fog.g, 8));
+        fogged = _mm_or_si128(fogged, fog_blend_sse41(color, density, inverse, fog.b, 0));
+        _mm_storeu_si128((__m128i*)&color_buffer[x], _mm_blendv_epi8(color, fogged, mask));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load_bytes_avx2(const uint8_t* bytes)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)bytes));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i not_in_front_avx2(__m256i z, __m256i id, const uint32_t* neighbour_z, const uint8_t* neighbour_attr)
+{
+    __m256i nz = _mm256_loadu_si256((const __m256i*)neighbour_z);
+    __m256i nid = _mm256_and_si256(load_bytes_avx2(neighbour_attr), _mm256_set1_epi32(0x3F));
+    return _mm256_or_si256(_mm256_cmpeq_epi32(id, nid), _mm256_cmpeq_epi32(_mm256_min_epu32(nz, z), nz));
+}
+
+__attribute__((target("avx2")))
+static void find_edges_avx2(uint32_t* edges, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                            const uint8_t* pixel_state, uint8_t opaque_state)
+{
+    const __m256i id_mask = _mm256_set1_epi32(0x3F);
+    const __m256i opaque = _mm256_set1_epi32(opaque_state);
+    for (int x = 0; x < PIXELS_PER_LINE; x += 8)
+    {
+        __m256i z = _mm256_loadu_si256((const __m256i*)&z_rows[1][x]);
+        __m256i id = _mm256_and_si256(load_bytes_avx2(&attr_rows[1][x]), id_mask);
+        __m256i hidden = not_in_front_avx2(z, id, &z_rows[1][x - 1], &attr_rows[1][x - 1]);
+        hidden = _mm256_and_si256(hidden, not_in_front_avx2(z, id, &z_rows[1][x + 1], &attr_rows[1][x + 1]));
+        hidden = _mm256_and_si256(hidden, not_in_front_avx2(z, id, &z_rows[0][x], &attr_rows[0][x]));
+        hidden = _mm256_and_si256(hidden, not_in_front_avx2(z, id, &z_rows[2][x], &attr_rows[2][x]));
+        __m256i is_opaque = _mm256_cmpeq_epi32(load_bytes_avx2(&pixel_state[x]), opaque);
+        _mm256_storeu_si256((__m256i*)&edges[x], _mm256_andnot_si256(hidden, is_opaque));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fog_blend_avx2(__m256i color, __m256i density, __m256i inverse, uint32_t fog_component, int shift)
+{
+    __m256i c = _mm256_and_si256(_mm256_srli_epi32(color, shift), _mm256_set1_epi32(0xFF));
+    __m256i result = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(fog_component), density),
+                                      _mm256_mullo_epi32(c, inverse));
+    return _mm256_slli_epi32(_mm256_srli_epi32(result, 7), shift);
+}
+
+__attribute__((target("avx2")))
+static void fog_line_avx2(uint32_t* color_buffer, const uint32_t* z_buffer, const uint8_t* pixel_attr,
+                          const uint8_t* pixel_state, uint8_t opaque_state, const GX_Fog& fog)
+{
+    const __m256i offset = _mm256_set1_epi32(fog.offset);
+    const __m128i shift = _mm_cvtsi32_si128(fog.shift);
+    for (int x = 0; x < PIXELS_PER_LINE; x += 8)
+    {
+        __m256i mask = _mm256_cmpeq_epi32(load_bytes_avx2(&pixel_state[x]), _mm256_set1_epi32(opaque_state));
+        __m256i fog_flag = _mm256_and_si256(load_bytes_avx2(&pixel_attr[x]), _mm256_set1_epi32(0x80));
+        mask = _mm256_and_si256(mask, _mm256_cmpeq_epi32(fog_flag, _mm256_set1_epi32(0x80)));
+        if (_mm256_testz_si256(mask, mask))
+            continue;
+
+        __m256i z = _mm256_loadu_si256((const __m256i*)&z_buffer[x]);
+        __m256i past_offset = _mm256_cmpeq_epi32(_mm256_max_epu32(z, offset), z);
+        __m256i depth = _mm256_sll_epi32(_mm256_srli_epi32(_mm256_sub_epi32(z, offset), 2), shift);
+        __m256i index = _mm256_and_si256(_mm256_srli_epi32(depth, 17), past_offset);
+        __m256i frac = _mm256_and_si256(_mm256_and_si256(depth, _mm256_set1_epi32(0x1FFFF)), past_offset);
+        __m256i past_table = _mm256_cmpgt_epi32(index, _mm256_set1_epi32(31));
+        index = _mm256_blendv_epi8(index, _mm256_set1_epi32(32), past_table);
+        frac = _mm256_andnot_si256(past_table, frac);
+
+        __m256i d0 = _mm256_i32gather_epi32((const int*)fog.density, index, 4);
+        __m256i d1 = _mm256_i32gather_epi32((const int*)(fog.density + 1), index, 4);
+        __m256i density = _mm256_add_epi32(_mm256_mullo_epi32(d0, _mm256_sub_epi32(_mm256_set1_epi32(0x20000), frac)),
+                                           _mm256_mullo_epi32(d1, frac));
+        density = _mm256_srli_epi32(density, 17);
+        density = _mm256_blendv_epi8(density, _mm256_set1_epi32(128), _mm256_cmpgt_epi32(density, _mm256_set1_epi32(126)));
+        __m256i inverse = _mm256_sub_epi32(_mm256_set1_epi32(128), density);
+
+        __m256i color = _mm256_loadu_si256((const __m256i*)&color_buffer[x]);
+        __m256i fogged = _mm256_and_si256(color, _mm256_set1_epi32(0xFF000000));
+        fogged = _mm256_or_si256(fogged, fog_blend_avx2(color, density, inverse, fog.r, 16));
+        fogged = _mm256_or_si256(fogged, fog_blend_avx2(color, density, inverse, fog.g, 8));
+        fogged = _mm256_or_si256(fogged, fog_blend_avx2(color, density, inverse, fog.b, 0));
+        _mm256_storeu_si256((__m256i*)&color_buffer[x], _mm256_blendv_epi8(color, fogged, mask));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i depth_test_avx2(__m256i z, __m256i buffer_z, bool test_equal)
+{
+    if (test_equal)
+    {
+        __m256i low_z = _mm256_sub_epi32(buffer_z, _mm256_set1_epi32(0x200));
+        __m256i high_z = _mm256_add_epi32(buffer_z, _mm256_set1_epi32(0x200));
+        __m256i above_low = _mm256_cmpeq_epi32(_mm256_max_epu32(z, low_z), z);
+        __m256i below_high = _mm256_cmpeq_epi32(_mm256_min_epu32(z, high_z), z);
+        return _mm256_and_si256(above_low, below_high);
+    }
+    return _mm256_cmpeq_epi32(_mm256_min_epu32(z, buffer_z), z);
+}
+
+__attribute__((target("avx2")))
+static void depth_test_span_avx2(GX_Span& span, const uint32_t* z_buffer, bool test_equal)
+{
+    int i = 0;
+    for (; i + 8 <= span.count; i += 8)
+    {
+        __m256i z = _mm256_loadu_si256((const __m256i*)&span.z[i]);
+        __m256i buffer_z = _mm256_loadu_si256((const __m256i*)&z_buffer[i]);
+        _mm256_storeu_si256((__m256i*)&span.mask[i], depth_test_avx2(z, buffer_z, test_equal));
+    }
+    for (; i < span.count; i++)
+        span.mask[i] = depth_test_pixel(span.z[i], z_buffer[i], test_equal) ? 0xFFFFFFFF : 0;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i expand_plus_one_avx2(__m256i c)
+{
+    return _mm256_add_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(2)), _mm256_cmpeq_epi32(c, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i modulate_avx2(__m256i t_plus_one, __m256i v)
+{
+    __m256i product = _mm256_mullo_epi32(t_plus_one, _mm256_add_epi32(v, _mm256_set1_epi32(1)));
+    product = _mm256_sub_epi32(product, _mm256_set1_epi32(1));
+    return _mm256_slli_epi32(_mm256_srli_epi32(product, 6), 2);
+}
+
+__attribute__((target("avx2")))
+static void shade_span_avx2(GX_Span& span, uint32_t vertex_alpha, uint32_t alpha_ref)
+{
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    const __m256i va_plus_one = _mm256_set1_epi32(vertex_alpha + 1);
+    const __m256i ref = _mm256_set1_epi32(alpha_ref);
+    int i = 0;
+    for (; i + 8 <= span.count; i += 8)
+    {
+        __m256i depth_mask = _mm256_loadu_si256((const __m256i*)&span.mask[i]);
+        if (_mm256_testz_si256(depth_mask, depth_mask))
+            continue;
+        __m256i texel = _mm256_loadu_si256((const __m256i*)&span.texel[i]);
+        __m256i tr = expand_plus_one_avx2(_mm256_and_si256(_mm256_srli_epi32(texel, 16), byte_mask));
+        __m256i tg = expand_plus_one_avx2(_mm256_and_si256(_mm256_srli_epi32(texel, 8), byte_mask));
+        __m256i tb = expand_plus_one_avx2(_mm256_and_si256(texel, byte_mask));
+        __m256i ta = _mm256_add_epi32(_mm256_srli_epi32(texel, 24), _mm256_set1_epi32(1));
+
+        __m256i r = modulate_avx2(tr, _mm256_loadu_si256((const __m256i*)&span.r[i]));
+        __m256i g = modulate_avx2(tg, _mm256_loadu_si256((const __m256i*)&span.g[i]));
+        __m256i b = modulate_avx2(tb, _mm256_loadu_si256((const __m256i*)&span.b[i]));
+        __m256i alpha = _mm256_mullo_epi32(ta, va_plus_one);
+        alpha = _mm256_srli_epi32(_mm256_sub_epi32(alpha, _mm256_set1_epi32(1)), 5);
+        __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(alpha, ref), depth_mask);
+
+        _mm256_storeu_si256((__m256i*)&span.r[i], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)&span.r[i]), r, depth_mask));
+        _mm256_storeu_si256((__m256i*)&span.g[i], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)&span.g[i]), g, depth_mask));
+        _mm256_storeu_si256((__m256i*)&span.b[i], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)&span.b[i]), b, depth_mask));
+        _mm256_storeu_si256((__m256i*)&span.alpha[i], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)&span.alpha[i]), alpha, depth_mask));
+        _mm256_storeu_si256((__m256i*)&span.mask[i], mask);
+    }
+    for (; i < span.count; i++)
+    {
+        if (span.mask[i])
+            shade_pixel(span, i, vertex_alpha, alpha_ref);
+    }
+}
+
+__attribute__((target("avx2")))
+static void write_span_avx2(const GX_Span& span, uint32_t* z_buffer, uint32_t* color_buffer,
+                            uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z)
+{
+    int i = 0;
+    for (; i + 8 <= span.count; i += 8)
+    {
+        __m256i mask = _mm256_loadu_si256((const __m256i*)&span.mask[i]);
+        if (_mm256_testz_si256(mask, mask))
+            continue;
+        if (write_z)
+        {
+            __m256i z = _mm256_loadu_si256((const __m256i*)&span.z[i]);
+            __m256i old_z = _mm256_loadu_si256((const __m256i*)&z_buffer[i]);
+            _mm256_storeu_si256((__m256i*)&z_buffer[i], _mm256_blendv_epi8(old_z, z, mask));
+        }
+        __m256i color = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i*)&span.r[i]), 16);
+        color = _mm256_or_si256(color, _mm256_slli_epi32(_mm256_loadu_si256((const __m256i*)&span.g[i]), 8));
+        color = _mm256_or_si256(color, _mm256_loadu_si256((const __m256i*)&span.b[i]));
+        color = _mm256_or_si256(color, _mm256_set1_epi32(0xFF000000));
+        color = _mm256_add_epi32(color, _mm256_set1_epi32(0xFF000000));
+        __m256i old_color = _mm256_loadu_si256((const __m256i*)&color_buffer[i]);
+        _mm256_storeu_si256((__m256i*)&color_buffer[i], _mm256_blendv_epi8(old_color, color, mask));
+
+        __m128i word_mask = _mm_packs_epi32(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+        __m128i byte_mask = _mm_packs_epi16(word_mask, _mm_setzero_si128());
+        __m128i states = _mm_loadl_epi64((const __m128i*)&pixel_state[i]);
+        _mm_storel_epi64((__m128i*)&pixel_state[i], _mm_blendv_epi8(states, _mm_set1_epi8(state), byte_mask));
+        __m128i attrs = _mm_loadl_epi64((const __m128i*)&pixel_attr[i]);
+        _mm_storel_epi64((__m128i*)&pixel_attr[i], _mm_blendv_epi8(attrs, _mm_set1_epi8(attr), byte_mask));
+    }
+    for (; i < span.count; i++)
+        write_pixel(span, i, z_buffer, color_buffer, pixel_state, state, pixel_attr, attr, write_z);
+}
+
+#endif
+
+namespace GX_Math
+{
+
+struct Kernels
+{
+    void (*mtx_mult)(MTX&, const MTX&, const MTX&);
+    void (*vec4_transform)(int32_t*, const int32_t*, const MTX&);
+    void (*vec4_transform32)(int32_t*, const int32_t*, const MTX&, int);
+    void (*depth_test_span)(GX_Span&, const uint32_t*, bool);
+    void (*shade_span)(GX_Span&, uint32_t, uint32_t);
+    void (*write_span)(const GX_Span&, uint32_t*, uint32_t*, uint8_t*, uint8_t, uint8_t*, uint8_t, bool);
+    void (*find_edges)(uint32_t*, const uint32_t* const*, const uint8_t* const*, const uint8_t*, uint8_t);
+    void (*fog_line)(uint32_t*, const uint32_t*, const uint8_t*, const uint8_t*, uint8_t, const GX_Fog&);
+    const char* name;
+};
+
+static int get_supported_level()
+{
+#ifdef GX_MATH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return KERNEL_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return KERNEL_SSE41;
+#endif
+    return KERNEL_SCALAR;
+}
+
+static Kernels select_kernels(int level)
+{
+    Kernels k = {mtx_mult_scalar, vec4_transform_scalar, vec4_transform32_scalar,
+                 depth_test_span_scalar, shade_span_scalar, write_span_scalar,
+                 find_edges_scalar, fog_line_scalar, "scalar"};
+#ifdef GX_MATH_X86
+    if (level >= KERNEL_SSE41)
+    {
+        k.mtx_mult = mtx_mult_sse41;
+        k.vec4_transform = vec4_transform_sse41;
+        k.vec4_transform32 = vec4_transform32_sse41;
+        k.depth_test_span = depth_test_span_sse41;
+        k.shade_span = shade_span_sse41;
+        k.write_span = write_span_sse41;
+        k.find_edges = find_edges_sse41;
+        k.fog_line = fog_line_sse41;
+        k.name = "SSE4.1";
+    }
+    //vec4_transform32 only has four lanes of work, so it stays on SSE4.1
+    if (level >= KERNEL_AVX2)
+    {
+        k.mtx_mult = mtx_mult_avx2;
+        k.vec4_transform = vec4_transform_avx2;
+        k.depth_test_span = depth_test_span_avx2;
+        k.shade_span = shade_span_avx2;
+        k.write_span = write_span_avx2;
+        k.find_edges = find_edges_avx2;
+        k.fog_line = fog_line_avx2;
+        k.name = "AVX2";
+    }
+#endif
+    return k;
+}
+
+static Kernels& kernels()
+{
+    static Kernels k = select_kernels(get_supported_level());
+    return k;
+}
+
+bool force_kernels(int level)
+{
+    if (level < KERNEL_SCALAR || level > get_supported_level())
+        return false;
+    kernels() = select_kernels(level);
+    return true;
+}
+
+void mtx_mult(MTX& dest, const MTX& a, const MTX& b)
+{
+    kernels().mtx_mult(dest, a, b);
+}
+
+void vec4_transform(int32_t* out, const int32_t* vec, const MTX& mtx)
+{
+    kernels().vec4_transform(out, vec, mtx);
+}
+
+void vec4_transform32(int32_t* out, const int32_t* vec, const MTX& mtx, int shift)
+{
+    kernels().vec4_transform32(out, vec, mtx, shift);
+}
+
+void depth_test_span(GX_Span& span, const uint32_t* z_buffer, bool test_equal)
+{
+    kernels().depth_test_span(span, z_buffer, test_equal);
+}
+
+void shade_span(GX_Span& span, uint32_t vertex_alpha, uint32_t alpha_ref)
+{
+    kernels().shade_span(span, vertex_alpha, alpha_ref);
+}
+
+void write_span(const GX_Span& span, uint32_t* z_buffer, uint32_t* color_buffer,
+                uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z)
+{
+    kernels().write_span(span, z_buffer, color_buffer, pixel_state, state, pixel_attr, attr, write_z);
+}
+
+void find_edges(uint32_t* edges, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                const uint8_t* pixel_state, uint8_t opaque_state)
+{
+    kernels().find_edges(edges, z_rows, attr_rows, pixel_state, opaque_state);
+}
+
+void fog_line(uint32_t* color_buffer, const uint32_t* z_buffer, const uint8_t* pixel_attr,
+              const uint8_t* pixel_state, uint8_t opaque_state, const GX_Fog& fog)
+{
+    kernels().fog_line(color_buffer, z_buffer, pixel_attr, pixel_state, opaque_state, fog);
+}
+
+const char* get_kernel_name()
+{
+    return kernels().name;
+}
+
+};
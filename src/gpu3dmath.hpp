@@ -0,0 +1,86 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef GPU3DMATH_HPP
+#define GPU3DMATH_HPP
+#include <cstdint>
+#include "memconsts.h"
+
+struct MTX
+{
+    int32_t m[4][4];
+
+    void set(const MTX& mtx);
+};
+
+//Per-pixel working set for one polygon span on a scanline
+struct GX_Span
+{
+    int count;
+    uint32_t z[PIXELS_PER_LINE];
+    uint32_t mask[PIXELS_PER_LINE]; //0 or 0xFFFFFFFF
+    uint32_t r[PIXELS_PER_LINE], g[PIXELS_PER_LINE], b[PIXELS_PER_LINE];
+    uint32_t texel[PIXELS_PER_LINE];
+    uint32_t alpha[PIXELS_PER_LINE];
+};
+
+//Fog settings latched for a frame, in the units of the depth and color buffers
+struct GX_Fog
+{
+    uint32_t offset;
+    int shift;
+    uint32_t density[34]; //FOG_TABLE with its first and last entries repeated at either end
+    uint32_t r, g, b;
+};
+
+//Fixed-point kernels for the geometry engine and rasterizer.
+//SSE4.1/AVX2 versions are picked at startup when the host supports them, and all versions give identical results.
+namespace GX_Math
+{
+    //dest = a * b, 64-bit products, each element >> 12. dest must not be b.
+    void mtx_mult(MTX& dest, const MTX& a, const MTX& b);
+
+    //out = vec * mtx, 64-bit products, each element >> 12
+    void vec4_transform(int32_t* out, const int32_t* vec, const MTX& mtx);
+
+    //out = vec * mtx with 32-bit products, as used by NORMAL, LIGHT_VECTOR, BOX_TEST and VEC_TEST
+    void vec4_transform32(int32_t* out, const int32_t* vec, const MTX& mtx, int shift);
+
+    //Sets the span mask for pixels passing the depth test against z_buffer
+    void depth_test_span(GX_Span& span, const uint32_t* z_buffer, bool test_equal);
+
+    //Modulates the vertex colors in r/g/b with the texels and computes alpha.
+    //Pixels with alpha less than or equal to alpha_ref leave the mask.
+    void shade_span(GX_Span& span, uint32_t vertex_alpha, uint32_t alpha_ref);
+
+    //Writes the masked pixels of a shaded span without blending
+    void write_span(const GX_Span& span, uint32_t* z_buffer, uint32_t* color_buffer,
+                    uint8_t* pixel_state, uint8_t state, uint8_t* pixel_attr, uint8_t attr, bool write_z);
+
+    //Marks opaque pixels in front of a neighbour with a different polygon ID (bits 0-5 of the attributes).
+    //Rows are the lines above, at and below the current one, readable from index -1 to PIXELS_PER_LINE.
+    void find_edges(uint32_t* edges, const uint32_t* const z_rows[3], const uint8_t* const attr_rows[3],
+                    const uint8_t* pixel_state, uint8_t opaque_state);
+
+    //Blends fog into opaque pixels with the fog flag (bit 7 of the attributes)
+    void fog_line(uint32_t* color_buffer, const uint32_t* z_buffer, const uint8_t* pixel_attr,
+                  const uint8_t* pixel_state, uint8_t opaque_state, const GX_Fog& fog);
+
+    const char* get_kernel_name();
+
+    enum KERNEL_LEVEL
+    {
+        KERNEL_SCALAR,
+        KERNEL_SSE41,
+        KERNEL_AVX2
+    };
+
+    //Switches every kernel to the given level, so that the versions can be checked against each other.
+    //Returns false if the host can't run it. Not safe while the 3D engine is running.
+    bool force_kernels(int level);
+};
+
+#endif // GPU3DMATH_HPP
@@ -0,0 +1,392 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include "gpu3dmath.hpp"
+
+//Checks that the SSE4.1 and AVX2 kernels give exactly the same results as the scalar ones.
+//Inputs are seeded random values, with some cases made of nothing but extreme values to catch overflow differences.
+
+#define RANDOM_CASES 20000
+#define EXTREME_CASES 5000
+#define SPAN_CASES 5000
+#define LINE_CASES 2000
+#define MAX_REPORTED_FAILURES 10
+
+static const char* level_names[] = {"scalar", "SSE4.1", "AVX2"};
+static const int shifts[] = {0, 9, 12, 21};
+static const int32_t extremes[] = {INT32_MIN, INT32_MIN + 1, INT32_MAX, INT32_MAX - 1, -1, 0, 1, 0x1000, -0x1000};
+
+static uint32_t seed = 0x12345678;
+static int failures = 0;
+
+//xorshift32, so the cases are the same on every host
+static uint32_t random_word()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+//A mix of full-range values and the small fixed-point values games actually use
+static int32_t random_value(bool extreme)
+{
+    if (extreme)
+        return extremes[random_word() % (sizeof(extremes) / sizeof(extremes[0]))];
+    switch (random_word() % 3)
+    {
+        case 0:
+            return (int32_t)random_word();
+        case 1:
+            return (int32_t)(random_word() & 0x1FFFF) - 0x10000;
+        default:
+            return (int32_t)(random_word() & 0x7FFFFFF) - 0x4000000;
+    }
+}
+
+static void random_mtx(MTX& mtx, bool extreme)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+            mtx.m[i][j] = random_value(extreme);
+    }
+}
+
+static void random_vec(int32_t* vec, bool extreme)
+{
+    for (int i = 0; i < 4; i++)
+        vec[i] = random_value(extreme);
+}
+
+static void check(const char* kernel, int level, int index, int shift, const int32_t* expected, const int32_t* actual, int count)
+{
+    if (!memcmp(expected, actual, count * sizeof(int32_t)))
+        return;
+    failures++;
+    if (failures > MAX_REPORTED_FAILURES)
+        return;
+    printf("%s %s differs from scalar in case %d", level_names[level], kernel, index);
+    if (shift >= 0)
+        printf(" with shift %d", shift);
+    printf("\n");
+    for (int i = 0; i < count; i++)
+    {
+        if (expected[i] != actual[i])
+            printf("  element %d: $%08X, expected $%08X\n", i, actual[i], expected[i]);
+    }
+}
+
+//For outputs that aren't arrays of words, reports the first byte that differs
+static void check_bytes(const char* kernel, const char* output, int level, int index, const void* expected, const void* actual, int size)
+{
+    if (!memcmp(expected, actual, size))
+        return;
+    failures++;
+    if (failures > MAX_REPORTED_FAILURES)
+        return;
+    const uint8_t* expected_bytes = (const uint8_t*)expected;
+    const uint8_t* actual_bytes = (const uint8_t*)actual;
+    int i = 0;
+    while (expected_bytes[i] == actual_bytes[i])
+        i++;
+    printf("%s %s differs from scalar in %s in case %d, from byte %d: $%02X, expected $%02X\n", level_names[level], kernel,
+           output, index, i, actual_bytes[i], expected_bytes[i]);
+}
+
+static void test_case(int level, int index, bool extreme)
+{
+    MTX a, b, expected_mtx, actual_mtx;
+    int32_t vec[4], expected[4], actual[4];
+    random_mtx(a, extreme);
+    random_mtx(b, extreme);
+    random_vec(vec, extreme);
+
+    //Every input at the same limit gives the largest sums either way
+    if (extreme && index % 8 < 2)
+    {
+        int32_t limit = index % 8 ? INT32_MAX : INT32_MIN;
+        for (int i = 0; i < 16; i++)
+        {
+            a.m[i / 4][i % 4] = limit;
+            b.m[i / 4][i % 4] = limit;
+        }
+        for (int i = 0; i < 4; i++)
+            vec[i] = limit;
+    }
+
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::mtx_mult(expected_mtx, a, b);
+    GX_Math::force_kernels(level);
+    GX_Math::mtx_mult(actual_mtx, a, b);
+    check("mtx_mult", level, index, -1, &expected_mtx.m[0][0], &actual_mtx.m[0][0], 16);
+
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::vec4_transform(expected, vec, a);
+    GX_Math::force_kernels(level);
+    GX_Math::vec4_transform(actual, vec, a);
+    check("vec4_transform", level, index, -1, expected, actual, 4);
+
+    for (unsigned int i = 0; i < sizeof(shifts) / sizeof(shifts[0]); i++)
+    {
+        GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+        GX_Math::vec4_transform32(expected, vec, a, shifts[i]);
+        GX_Math::force_kernels(level);
+        GX_Math::vec4_transform32(actual, vec, a, shifts[i]);
+        check("vec4_transform32", level, index, shifts[i], expected, actual, 4);
+    }
+}
+
+//Depths around the buffer value, including both edges of the test_equal window and 24-bit wraparound
+static uint32_t random_depth(uint32_t buffer_z)
+{
+    static const int32_t offsets[] = {0, 1, -1, 0x1FF, -0x1FF, 0x200, -0x200, 0x201, -0x201};
+    switch (random_word() % 4)
+    {
+        case 0:
+            return random_word() & 0xFFFFFF;
+        case 1:
+            return 0xFFFFFFFF;
+        default:
+            return buffer_z + offsets[random_word() % (sizeof(offsets) / sizeof(offsets[0]))];
+    }
+}
+
+static uint32_t random_buffer_depth()
+{
+    switch (random_word() % 4)
+    {
+        case 0:
+            return random_word() & 0x1FF;
+        case 1:
+            return 0xFFFFFF - (random_word() & 0x1FF);
+        default:
+            return random_word() & 0xFFFFFF;
+    }
+}
+
+//Runs depth_test_span, shade_span and write_span at the given level, each on the scalar output of the stage before it
+static void test_span_case(int level, int index)
+{
+    static const int counts[] = {1, 2, 3, 4, 5, 7, 8, 9, 15, 17, 31, 33, 63, 255, PIXELS_PER_LINE};
+    static GX_Span input, expected, actual;
+    static uint32_t z_buffer[PIXELS_PER_LINE], color_buffer[PIXELS_PER_LINE];
+    static uint8_t pixel_state[PIXELS_PER_LINE], pixel_attr[PIXELS_PER_LINE];
+    static uint32_t expected_z[PIXELS_PER_LINE], expected_color[PIXELS_PER_LINE];
+    static uint8_t expected_state[PIXELS_PER_LINE], expected_attr[PIXELS_PER_LINE];
+    static uint32_t actual_z[PIXELS_PER_LINE], actual_color[PIXELS_PER_LINE];
+    static uint8_t actual_state[PIXELS_PER_LINE], actual_attr[PIXELS_PER_LINE];
+
+    int count;
+    if (index % 2)
+        count = counts[random_word() % (sizeof(counts) / sizeof(counts[0]))];
+    else
+        count = 1 + random_word() % PIXELS_PER_LINE;
+    //Spans start anywhere on the line, so the buffers usually aren't aligned
+    int left = random_word() % (PIXELS_PER_LINE - count + 1);
+    bool test_equal = index & 2;
+    uint32_t alpha_ref = (index & 4) ? random_word() % 31 : 0;
+    bool write_z = index & 8;
+    uint32_t vertex_alpha = 1 + random_word() % 31;
+    uint8_t state = random_word(), attr = random_word();
+
+    for (int i = 0; i < PIXELS_PER_LINE; i++)
+    {
+        z_buffer[i] = random_buffer_depth();
+        color_buffer[i] = random_word();
+        pixel_state[i] = random_word();
+        pixel_attr[i] = random_word();
+    }
+    input.count = count;
+    for (int i = 0; i < PIXELS_PER_LINE; i++)
+    {
+        input.z[i] = random_depth(z_buffer[(left + i) % PIXELS_PER_LINE]);
+        input.mask[i] = (random_word() & 1) ? 0xFFFFFFFF : 0;
+        input.r[i] = random_word() & 0x3F;
+        input.g[i] = random_word() & 0x3F;
+        input.b[i] = random_word() & 0x3F;
+        input.texel[i] = random_word();
+        input.alpha[i] = random_word() & 0x1F;
+    }
+    int words = count * sizeof(uint32_t);
+
+    expected = input;
+    actual = input;
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::depth_test_span(expected, &z_buffer[left], test_equal);
+    GX_Math::force_kernels(level);
+    GX_Math::depth_test_span(actual, &z_buffer[left], test_equal);
+    check_bytes("depth_test_span", test_equal ? "mask (test_equal)" : "mask", level, index, expected.mask, actual.mask, words);
+
+    actual = expected;
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::shade_span(expected, vertex_alpha, alpha_ref);
+    GX_Math::force_kernels(level);
+    GX_Math::shade_span(actual, vertex_alpha, alpha_ref);
+    check_bytes("shade_span", "mask", level, index, expected.mask, actual.mask, words);
+    check_bytes("shade_span", "red", level, index, expected.r, actual.r, words);
+    check_bytes("shade_span", "green", level, index, expected.g, actual.g, words);
+    check_bytes("shade_span", "blue", level, index, expected.b, actual.b, words);
+    check_bytes("shade_span", "alpha", level, index, expected.alpha, actual.alpha, words);
+
+    //The whole line is compared, so writes past either end of the span are caught too
+    memcpy(expected_z, z_buffer, sizeof(z_buffer));
+    memcpy(expected_color, color_buffer, sizeof(color_buffer));
+    memcpy(expected_state, pixel_state, sizeof(pixel_state));
+    memcpy(expected_attr, pixel_attr, sizeof(pixel_attr));
+    memcpy(actual_z, z_buffer, sizeof(z_buffer));
+    memcpy(actual_color, color_buffer, sizeof(color_buffer));
+    memcpy(actual_state, pixel_state, sizeof(pixel_state));
+    memcpy(actual_attr, pixel_attr, sizeof(pixel_attr));
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::write_span(expected, &expected_z[left], &expected_color[left], &expected_state[left], state,
+                        &expected_attr[left], attr, write_z);
+    GX_Math::force_kernels(level);
+    GX_Math::write_span(expected, &actual_z[left], &actual_color[left], &actual_state[left], state,
+                        &actual_attr[left], attr, write_z);
+    check_bytes("write_span", write_z ? "depth (write_z)" : "depth", level, index, expected_z, actual_z, sizeof(actual_z));
+    check_bytes("write_span", "color", level, index, expected_color, actual_color, sizeof(actual_color));
+    check_bytes("write_span", "state", level, index, expected_state, actual_state, sizeof(actual_state));
+    check_bytes("write_span", "attributes", level, index, expected_attr, actual_attr, sizeof(actual_attr));
+}
+
+//Runs find_edges and fog_line over a whole line at the given level
+static void test_line_case(int level, int index)
+{
+    static uint32_t z_rows[3][PIXELS_PER_LINE + 2];
+    static uint8_t attr_rows[3][PIXELS_PER_LINE + 2];
+    static uint32_t expected[PIXELS_PER_LINE], actual[PIXELS_PER_LINE];
+    static uint32_t color_buffer[PIXELS_PER_LINE];
+    static uint8_t pixel_state[PIXELS_PER_LINE];
+    const uint8_t opaque_state = 1;
+
+    //Few distinct depths and polygon IDs, so neighbours often tie or match.
+    //The high attribute bits are random and must not affect the polygon ID comparison.
+    uint32_t depths[4];
+    for (int i = 0; i < 4; i++)
+        depths[i] = random_buffer_depth();
+    int ids = (index % 4) ? 3 : 64;
+    for (int row = 0; row < 3; row++)
+    {
+        //The padding at index -1 and PIXELS_PER_LINE gets random values as well, as the rear plane can be anything
+        for (int x = 0; x < PIXELS_PER_LINE + 2; x++)
+        {
+            z_rows[row][x] = depths[random_word() % 4];
+            attr_rows[row][x] = (random_word() & 0xC0) | (random_word() % ids);
+        }
+    }
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+        pixel_state[x] = (random_word() % 4) ? opaque_state : random_word() % 3;
+    //Keep the first and last columns opaque so the padding is always read
+    pixel_state[0] = opaque_state;
+    pixel_state[PIXELS_PER_LINE - 1] = opaque_state;
+
+    const uint32_t* z_row_ptrs[3];
+    const uint8_t* attr_row_ptrs[3];
+    for (int row = 0; row < 3; row++)
+    {
+        z_row_ptrs[row] = &z_rows[row][1];
+        attr_row_ptrs[row] = &attr_rows[row][1];
+    }
+    GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+    GX_Math::find_edges(expected, z_row_ptrs, attr_row_ptrs, pixel_state, opaque_state);
+    GX_Math::force_kernels(level);
+    GX_Math::find_edges(actual, z_row_ptrs, attr_row_ptrs, pixel_state, opaque_state);
+    check_bytes("find_edges", "edges", level, index, expected, actual, sizeof(actual));
+
+    //Every shift is run on the same line, with the depths spread above and below the fog offset
+    GX_Fog fog;
+    fog.offset = (random_word() % 0x8000) * 0x200;
+    for (int i = 0; i < 32; i++)
+        fog.density[i + 1] = random_word() & 0x7F;
+    fog.density[0] = fog.density[1];
+    fog.density[33] = fog.density[32];
+    fog.r = random_word() & 0xFF;
+    fog.g = random_word() & 0xFF;
+    fog.b = random_word() & 0xFF;
+    const uint32_t* z_buffer = &z_rows[1][1];
+    const uint8_t* pixel_attr = &attr_rows[1][1];
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+    {
+        uint32_t z;
+        switch (random_word() % 4)
+        {
+            case 0:
+                z = random_word() & 0xFFFFFF;
+                break;
+            case 1:
+                z = fog.offset - 1 - (random_word() & 0x3FF);
+                break;
+            default:
+                z = fog.offset + (random_word() & ((0x800 << (random_word() % 12)) - 1));
+                break;
+        }
+        z_rows[1][x + 1] = z & 0xFFFFFF;
+    }
+    for (int x = 0; x < PIXELS_PER_LINE; x++)
+        color_buffer[x] = random_word();
+
+    for (fog.shift = 0; fog.shift < 16; fog.shift++)
+    {
+        memcpy(expected, color_buffer, sizeof(color_buffer));
+        memcpy(actual, color_buffer, sizeof(color_buffer));
+        GX_Math::force_kernels(GX_Math::KERNEL_SCALAR);
+        GX_Math::fog_line(expected, z_buffer, pixel_attr, pixel_state, opaque_state, fog);
+        GX_Math::force_kernels(level);
+        GX_Math::fog_line(actual, z_buffer, pixel_attr, pixel_state, opaque_state, fog);
+        check("fog_line", level, index, fog.shift, (const int32_t*)expected, (const int32_t*)actual, PIXELS_PER_LINE);
+    }
+}
+
+int main()
+{
+    int tested = 0;
+    for (int level = GX_Math::KERNEL_SSE41; level <= GX_Math::KERNEL_AVX2; level++)
+    {
+        if (!GX_Math::force_kernels(level))
+        {
+            printf("%s: not supported on this host, skipped\n", level_names[level]);
+            continue;
+        }
+
+        seed = 0x12345678;
+        int level_failures = failures;
+        for (int i = 0; i < RANDOM_CASES; i++)
+            test_case(level, i, false);
+        for (int i = 0; i < EXTREME_CASES; i++)
+            test_case(level, RANDOM_CASES + i, true);
+        printf("%s geometry: %d cases, %d failed\n", level_names[level], RANDOM_CASES + EXTREME_CASES, failures - level_failures);
+
+        //A case checks several outputs, so count the cases rather than the failed checks
+        int failed_cases = 0;
+        for (int i = 0; i < SPAN_CASES; i++)
+        {
+            int case_failures = failures;
+            test_span_case(level, i);
+            if (failures != case_failures)
+                failed_cases++;
+        }
+        printf("%s spans: %d cases, %d failed\n", level_names[level], SPAN_CASES, failed_cases);
+
+        failed_cases = 0;
+        for (int i = 0; i < LINE_CASES; i++)
+        {
+            int case_failures = failures;
+            test_line_case(level, i);
+            if (failures != case_failures)
+                failed_cases++;
+        }
+        printf("%s lines: %d cases, %d failed\n", level_names[level], LINE_CASES, failed_cases);
+        tested++;
+    }
+
+    if (!tested)
+        printf("Only the scalar kernels are available, nothing to compare\n");
+    return failures ? 1 : 0;
+}
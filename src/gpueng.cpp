@@ -10,6 +10,7 @@
 #include "config.hpp"
 #include "gpu.hpp"
 #include "gpueng.hpp"
+#include "savestate.hpp"
 
 GPU_2D_Engine::GPU_2D_Engine(GPU* gpu, bool engine_A) : gpu(gpu), engine_A(engine_A) {}
 
@@ -29,6 +30,48 @@ void GPU_2D_Engine::VBLANK_start()
     DISPCAPCNT.enable_busy = false;
 }
 
+void GPU_2D_Engine::do_state(Save_State& state)
+{
+    state.begin_chunk(engine_A ? "2DA " : "2DB ", 1);
+    state.sync(framebuffer);
+    state.sync(front_framebuffer);
+    state.sync(final_bg_priority);
+    state.sync(sprite_scanline);
+    state.sync(window_mask);
+    state.sync(DISPCNT);
+    state.sync(DISPCAPCNT);
+    state.sync(captured_lines);
+    state.sync(BGCNT);
+    state.sync(BGHOFS);
+    state.sync(BGVOFS);
+    state.sync(BG2P);
+    state.sync(BG3P);
+    state.sync(BG2X);
+    state.sync(BG2Y);
+    state.sync(BG3X);
+    state.sync(BG3Y);
+    state.sync(BG2P_internal);
+    state.sync(BG3P_internal);
+    state.sync(BG2X_internal);
+    state.sync(BG2Y_internal);
+    state.sync(BG3X_internal);
+    state.sync(BG3Y_internal);
+    state.sync(WIN0H);
+    state.sync(WIN1H);
+    state.sync(WIN0V);
+    state.sync(WIN1V);
+    state.sync(MOSAIC);
+    state.sync(WININ);
+    state.sync(WINOUT);
+    state.sync(win0_active);
+    state.sync(win1_active);
+    state.sync(BLDCNT);
+    state.sync(BLDALPHA);
+    state.sync(BLDY);
+    state.sync(MASTER_BRIGHT);
+    state.end_chunk();
+}
+
 void GPU_2D_Engine::draw_backdrop()
 {
     uint16_t* palette = gpu->get_palette(engine_A);
@@ -1108,6 +1151,7 @@ void GPU_2D_Engine::draw_scanline()
                 color = rd | (gd << 5) | (bd << 10);
                 VRAM_dest[(write_offset + x) & 0xFFFF] = color | (1 << 15);
             }
+            gpu->VRAM_block_written(DISPCAPCNT.VRAM_write_block, (write_offset & 0xFFFF) * 2, x_size * 2);
         }
     }
 
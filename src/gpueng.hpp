@@ -81,6 +81,7 @@ struct BLDCNT_REG
 };
 
 class GPU;
+class Save_State;
 
 class GPU_2D_Engine
 {
@@ -140,6 +141,7 @@ class GPU_2D_Engine
         void set_framebuffer(uint32_t* buffer);
 
         void VBLANK_start();
+        void do_state(Save_State& state);
 
         uint32_t get_DISPCNT();
         uint16_t get_BGCNT(int index);
@@ -0,0 +1,133 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <cstring>
+#include "config.hpp"
+#include "guestmemory.hpp"
+#include "memconsts.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define GUEST_MMAP
+#include <sys/mman.h>
+#endif
+
+//Regions start on page boundaries, and the arena is a whole number of 2 MB huge pages
+#define REGION_ALIGN GUEST_PAGE_SIZE
+#define HUGE_PAGE_SIZE (1024 * 1024 * 2)
+
+static const uint32_t region_sizes[] =
+{
+    1024 * 1024 * 4, //Main RAM
+    1024 * 32, //Shared WRAM
+    1024 * 64, //ARM7 WRAM
+    1024 * 32, //ITCM
+    1024 * 16, //DTCM
+    VRAM_A_SIZE,
+    VRAM_B_SIZE,
+    VRAM_C_SIZE,
+    VRAM_D_SIZE,
+    VRAM_E_SIZE,
+    VRAM_F_SIZE,
+    VRAM_G_SIZE,
+    VRAM_H_SIZE,
+    VRAM_I_SIZE,
+    1024, //Palette A
+    1024, //Palette B
+    1024 * 2 //OAM
+};
+
+Guest_Memory::Guest_Memory() : arena(nullptr), mapped(false), huge_TLB(false), current_gen(1)
+{
+    uint64_t offset = 0;
+    for (int i = 0; i < (int)GUEST_REGION::COUNT; i++)
+    {
+        offsets[i] = offset;
+        offset += (region_sizes[i] + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+    }
+    arena_size = (offset + HUGE_PAGE_SIZE - 1) & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+    page_gens.assign(arena_size / GUEST_PAGE_SIZE, current_gen);
+
+#ifdef GUEST_MMAP
+    void* map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    //Explicit huge pages need pages reserved by the host, so they are opt-in
+    if (Config::huge_pages)
+    {
+        map = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge_TLB = map != MAP_FAILED;
+    }
+#endif
+    if (map == MAP_FAILED)
+        map = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED)
+    {
+        arena = (uint8_t*)map;
+        mapped = true;
+#ifdef MADV_HUGEPAGE
+        if (!huge_TLB)
+            madvise(arena, arena_size, MADV_HUGEPAGE);
+#endif
+        return;
+    }
+#endif
+
+    arena = new uint8_t[arena_size];
+    memset(arena, 0, arena_size);
+}
+
+Guest_Memory::~Guest_Memory()
+{
+#ifdef GUEST_MMAP
+    if (mapped)
+    {
+        munmap(arena, arena_size);
+        return;
+    }
+#endif
+    delete[] arena;
+}
+
+void Guest_Memory::reset()
+{
+    mark_all_dirty();
+#ifdef GUEST_MMAP
+    //Older kernels can't drop huge TLB pages, so those are cleared by hand
+    if (mapped && !huge_TLB && !madvise(arena, arena_size, MADV_DONTNEED))
+        return;
+#endif
+    memset(arena, 0, arena_size);
+}
+
+void Guest_Memory::mark_dirty(uint8_t* data, uint32_t size)
+{
+    if (!size)
+        return;
+    uint64_t first = (data - arena) / GUEST_PAGE_SIZE;
+    uint64_t last = (data + size - 1 - arena) / GUEST_PAGE_SIZE;
+    for (uint64_t page = first; page <= last; page++)
+        page_gens[page] = current_gen;
+}
+
+void Guest_Memory::mark_all_dirty()
+{
+    std::fill(page_gens.begin(), page_gens.end(), current_gen);
+}
+
+//Restamps every page written after the given generation, as though it were written now
+void Guest_Memory::mark_dirty_since(uint32_t gen)
+{
+    for (unsigned int i = 0; i < page_gens.size(); i++)
+    {
+        if (page_gens[i] > gen)
+            page_gens[i] = current_gen;
+    }
+}
+
+uint32_t Guest_Memory::get_region_size(GUEST_REGION region)
+{
+    return region_sizes[(int)region];
+}
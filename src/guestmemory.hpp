@@ -0,0 +1,102 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef guestmemory_hpp
+#define guestmemory_hpp
+#include <cstdint>
+#include <vector>
+
+//Granularity of dirty tracking. Regions start on page boundaries.
+#define GUEST_PAGE_SIZE (1024 * 4)
+
+enum class GUEST_REGION
+{
+    MAIN_RAM,
+    SHARED_WRAM,
+    ARM7_WRAM,
+    ITCM,
+    DTCM,
+    VRAM_A,
+    VRAM_B,
+    VRAM_C,
+    VRAM_D,
+    VRAM_E,
+    VRAM_F,
+    VRAM_G,
+    VRAM_H,
+    VRAM_I,
+    PALETTE_A,
+    PALETTE_B,
+    OAM,
+    COUNT
+};
+
+//All of the DS's RAM in one contiguous arena, mapped anonymously where the host allows it.
+//Resetting hands the pages back to the kernel, which zeroes them the next time they are touched.
+//Writes to main RAM and VRAM stamp their page with the current generation, so snapshots can tell
+//which pages changed since the generation they were taken at.
+class Guest_Memory
+{
+    private:
+        uint8_t* arena;
+        uint64_t arena_size;
+        bool mapped;
+        bool huge_TLB;
+        uint32_t offsets[(int)GUEST_REGION::COUNT];
+
+        std::vector<uint32_t> page_gens;
+        uint32_t current_gen;
+    public:
+        Guest_Memory();
+        ~Guest_Memory();
+
+        void reset();
+
+        uint8_t* get(GUEST_REGION region);
+        uint8_t* get_arena();
+        uint64_t get_size();
+        static uint32_t get_region_size(GUEST_REGION region);
+
+        void mark_dirty(uint8_t* data);
+        void mark_dirty(uint8_t* data, uint32_t size);
+        void mark_all_dirty();
+        void mark_dirty_since(uint32_t gen);
+        uint32_t next_generation();
+        const uint32_t* get_page_generations(GUEST_REGION region);
+};
+
+inline uint8_t* Guest_Memory::get(GUEST_REGION region)
+{
+    return arena + offsets[(int)region];
+}
+
+inline uint8_t* Guest_Memory::get_arena()
+{
+    return arena;
+}
+
+inline uint64_t Guest_Memory::get_size()
+{
+    return arena_size;
+}
+
+inline void Guest_Memory::mark_dirty(uint8_t* data)
+{
+    page_gens[(data - arena) / GUEST_PAGE_SIZE] = current_gen;
+}
+
+//Returns the generation ending now. Later writes are stamped with a newer one.
+inline uint32_t Guest_Memory::next_generation()
+{
+    return current_gen++;
+}
+
+inline const uint32_t* Guest_Memory::get_page_generations(GUEST_REGION region)
+{
+    return &page_gens[offsets[(int)region] / GUEST_PAGE_SIZE];
+}
+
+#endif /* guestmemory_hpp */
@@ -0,0 +1,265 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "config.hpp"
+#include "emulator.hpp"
+
+using namespace std;
+
+//Runs the emulator without a window or frame limiter, for measuring throughput and checking output
+
+struct Input_Event
+{
+    int frame;
+    string command;
+    string key;
+    int x, y;
+};
+
+static void print_usage()
+{
+    printf("Usage: corgids-headless [options] ROM\n");
+    printf("  -bios7 <file>      ARM7 BIOS\n");
+    printf("  -bios9 <file>      ARM9 BIOS\n");
+    printf("  -firmware <file>   Firmware\n");
+    printf("  -savelist <file>   Save database\n");
+    printf("  -frames <count>    Frames to run (default 600)\n");
+    printf("  -input <file>      Input script\n");
+    printf("  -directboot        Boot the game directly instead of through the firmware\n");
+    printf("  -bootcache         Use the boot snapshot cache\n");
+    printf("  -threaded3d        Render 3D on a separate thread\n");
+    printf("  -hash              Print a hash of the last frame\n");
+}
+
+//Each line of an input script is "<frame> <command> [args]", where the command is one of:
+//press <key>, release <key>, touch <x> <y>, untouch
+//Keys are A, B, X, Y, L, R, START, SELECT, UP, DOWN, LEFT and RIGHT. Lines starting with # are ignored.
+static int load_input_script(const string& file_name, vector<Input_Event>& events)
+{
+    ifstream file(file_name);
+    if (!file.is_open())
+    {
+        printf("Failed to open input script %s\n", file_name.c_str());
+        return 1;
+    }
+
+    string line;
+    int line_number = 0;
+    while (getline(file, line))
+    {
+        line_number++;
+        if (!line.length() || line[0] == '#')
+            continue;
+        istringstream stream(line);
+        Input_Event event;
+        event.x = 0;
+        event.y = 0;
+        if (!(stream >> event.frame >> event.command))
+            continue;
+        if (event.command == "press" || event.command == "release")
+            stream >> event.key;
+        else if (event.command == "touch")
+            stream >> event.x >> event.y;
+        else if (event.command != "untouch")
+        {
+            printf("Unrecognized command %s on line %d of %s\n", event.command.c_str(), line_number, file_name.c_str());
+            return 1;
+        }
+        if (stream.fail())
+        {
+            printf("Missing arguments on line %d of %s\n", line_number, file_name.c_str());
+            return 1;
+        }
+        events.push_back(event);
+    }
+    return 0;
+}
+
+static bool set_key(Emulator& e, const string& key, bool pressed)
+{
+    struct Key_Handlers
+    {
+        const char* name;
+        void (Emulator::*press)();
+        void (Emulator::*release)();
+    };
+    static const Key_Handlers keys[] =
+    {
+        {"A", &Emulator::button_a_pressed, &Emulator::button_a_released},
+        {"B", &Emulator::button_b_pressed, &Emulator::button_b_released},
+        {"X", &Emulator::button_x_pressed, &Emulator::button_x_released},
+        {"Y", &Emulator::button_y_pressed, &Emulator::button_y_released},
+        {"L", &Emulator::button_l_pressed, &Emulator::button_l_released},
+        {"R", &Emulator::button_r_pressed, &Emulator::button_r_released},
+        {"START", &Emulator::button_start_pressed, &Emulator::button_start_released},
+        {"SELECT", &Emulator::button_select_pressed, &Emulator::button_select_released},
+        {"UP", &Emulator::button_up_pressed, &Emulator::button_up_released},
+        {"DOWN", &Emulator::button_down_pressed, &Emulator::button_down_released},
+        {"LEFT", &Emulator::button_left_pressed, &Emulator::button_left_released},
+        {"RIGHT", &Emulator::button_right_pressed, &Emulator::button_right_released}
+    };
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        if (key == keys[i].name)
+        {
+            (e.*(pressed ? keys[i].press : keys[i].release))();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void apply_input(Emulator& e, const Input_Event& event)
+{
+    if (event.command == "press" || event.command == "release")
+    {
+        if (!set_key(e, event.key, event.command == "press"))
+            printf("Unknown key %s on frame %d\n", event.key.c_str(), event.frame);
+    }
+    else if (event.command == "touch")
+        e.touchscreen_press(event.x, event.y);
+    else
+        e.touchscreen_press(0, 0xFFF);
+}
+
+static uint64_t hash_frame(const uint32_t* upper, const uint32_t* lower)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const uint32_t* screens[] = {upper, lower};
+    for (int screen = 0; screen < 2; screen++)
+    {
+        for (int i = 0; i < PIXELS_PER_LINE * SCANLINES; i++)
+        {
+            hash ^= screens[screen][i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+int main(int argc, char* argv[])
+{
+    string ROM_name, input_name;
+    int frame_count = 600;
+    bool print_hash = false;
+
+    Config::direct_boot_enabled = false;
+    Config::boot_cache_enabled = false;
+    Config::threaded_3D = false;
+    Config::frameskip = 0;
+    Config::enable_framelimiter = false;
+    Config::rewind_enabled = false;
+    Config::run_ahead_frames = 0;
+    Config::hle_bios = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-bios7" && has_value)
+            Config::arm7_bios_path = argv[++i];
+        else if (arg == "-bios9" && has_value)
+            Config::arm9_bios_path = argv[++i];
+        else if (arg == "-firmware" && has_value)
+            Config::firmware_path = argv[++i];
+        else if (arg == "-savelist" && has_value)
+            Config::savelist_path = argv[++i];
+        else if (arg == "-frames" && has_value)
+            frame_count = atoi(argv[++i]);
+        else if (arg == "-input" && has_value)
+            input_name = argv[++i];
+        else if (arg == "-directboot")
+            Config::direct_boot_enabled = true;
+        else if (arg == "-bootcache")
+            Config::boot_cache_enabled = true;
+        else if (arg == "-threaded3d")
+            Config::threaded_3D = true;
+        else if (arg == "-hash")
+            print_hash = true;
+        else if (arg[0] != '-' && !ROM_name.length())
+            ROM_name = arg;
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!ROM_name.length() || frame_count <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    vector<Input_Event> events;
+    if (input_name.length() && load_input_script(input_name, events))
+        return 1;
+    stable_sort(events.begin(), events.end(),
+                [](const Input_Event& a, const Input_Event& b) { return a.frame < b.frame; });
+
+    //Emulator is too large for the stack
+    Emulator* e = new Emulator();
+    if (e->init() || e->load_firmware())
+        return 1;
+    if (Config::savelist_path.length())
+        e->load_save_database(Config::savelist_path);
+    if (e->load_ROM(ROM_name))
+    {
+        printf("Unable to load ROM %s\n", ROM_name.c_str());
+        return 1;
+    }
+
+    static uint32_t upper_buffer[PIXELS_PER_LINE * SCANLINES], lower_buffer[PIXELS_PER_LINE * SCANLINES];
+    unsigned int next_event = 0;
+    auto start = chrono::steady_clock::now();
+    for (int frame = 0; frame < frame_count; frame++)
+    {
+        while (next_event < events.size() && events[next_event].frame <= frame)
+        {
+            apply_input(*e, events[next_event]);
+            next_event++;
+        }
+        e->run();
+    }
+    auto end = chrono::steady_clock::now();
+
+    double seconds = chrono::duration<double>(end - start).count();
+    printf("Frames: %d\n", frame_count);
+    printf("Time: %.3f s\n", seconds);
+    printf("FPS: %.2f\n", frame_count / seconds);
+    printf("Frame time: %.3f ms\n", seconds * 1000.0 / frame_count);
+
+    //Overdraw: pixels covered by polygon spans, how many the coarse depth test threw out, and how many were written
+    GPU_3D* eng_3D = e->get_gpu()->get_3D_engine();
+    uint64_t span_pixels = eng_3D->get_span_pixels();
+    printf("3D pixels: %llu spanned, %llu culled, %llu drawn", (unsigned long long)span_pixels,
+           (unsigned long long)eng_3D->get_culled_pixels(), (unsigned long long)eng_3D->get_drawn_pixels());
+    if (span_pixels)
+        printf(" (%.2fx overdraw)", (double)span_pixels / (PIXELS_PER_LINE * SCANLINES * (double)frame_count));
+    printf("\n");
+    printf("Texture cache: %llu hits, %llu misses\n", (unsigned long long)eng_3D->get_texture_cache_hits(),
+           (unsigned long long)eng_3D->get_texture_cache_misses());
+    printf("Light memo: %llu hits, %llu misses\n", (unsigned long long)eng_3D->get_light_memo_hits(),
+           (unsigned long long)eng_3D->get_light_memo_misses());
+    if (print_hash)
+    {
+        e->get_upper_frame(upper_buffer);
+        e->get_lower_frame(lower_buffer);
+        printf("Frame hash: %016llx\n", (unsigned long long)hash_frame(upper_buffer, lower_buffer));
+    }
+    delete e;
+    return 0;
+}
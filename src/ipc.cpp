@@ -5,6 +5,7 @@
 */
 
 #include "ipc.hpp"
+#include "savestate.hpp"
 #include <cstdlib>
 
 using namespace std;
@@ -95,3 +96,15 @@ void IPCFIFO::write_queue(uint32_t word)
         receive_queue->push(word);
     }
 }
+
+//The queues belong to the emulator, which saves them itself
+void IPCFIFO::do_state(Save_State& state)
+{
+    state.sync(recent_word);
+    state.sync(send_empty_IRQ);
+    state.sync(request_empty_IRQ);
+    state.sync(receive_nempty_IRQ);
+    state.sync(request_nempty_IRQ);
+    state.sync(error);
+    state.sync(enabled);
+}
@@ -21,6 +21,8 @@ struct IPCSYNC
     void write(uint16_t halfword);
 };
 
+class Save_State;
+
 struct IPCFIFO
 {
     std::queue<uint32_t> *send_queue, *receive_queue;
@@ -38,6 +40,7 @@ struct IPCFIFO
 
     uint32_t read_queue();
     void write_queue(uint32_t word);
+    void do_state(Save_State& state);
 };
 
 #endif // IPC_H
@@ -0,0 +1,356 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <cstring>
+#include "rewind.hpp"
+
+using namespace std;
+
+#define LZ_HASH_BITS 16
+#define LZ_MIN_MATCH 4
+
+static void put_varint(vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+static uint64_t get_varint(const uint8_t*& data, const uint8_t* end)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (data < end)
+    {
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+        shift += 7;
+    }
+    return value;
+}
+
+//Bytes past the end of a state read as zero
+static uint64_t load_word(const uint8_t* data, uint64_t size, uint64_t offset)
+{
+    uint64_t word = 0;
+    if (offset + 8 <= size)
+        memcpy(&word, data + offset, 8);
+    else if (offset < size)
+        memcpy(&word, data + offset, size - offset);
+    return word;
+}
+
+static uint32_t load_u32(const uint8_t* data)
+{
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+//Greedy LZ77 over a byte stream: (varint literal count, literals, varint match length, varint match distance),
+//where a match length of 0 means no match follows. The table maps a hash of 4 bytes to the last position + 1 seen.
+static void compress_lz(const vector<uint8_t>& in, vector<uint8_t>& out, vector<uint32_t>& table)
+{
+    table.assign(1 << LZ_HASH_BITS, 0);
+    uint64_t size = in.size();
+    uint64_t anchor = 0, pos = 0;
+    while (pos + LZ_MIN_MATCH <= size)
+    {
+        uint32_t value = load_u32(&in[pos]);
+        uint32_t hash = (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+        uint64_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (!candidate || load_u32(&in[candidate - 1]) != value)
+        {
+            pos++;
+            continue;
+        }
+
+        candidate--;
+        uint64_t length = LZ_MIN_MATCH;
+        while (pos + length < size && in[candidate + length] == in[pos + length])
+            length++;
+        put_varint(out, pos - anchor);
+        out.insert(out.end(), in.begin() + anchor, in.begin() + pos);
+        put_varint(out, length);
+        put_varint(out, pos - candidate);
+        pos += length;
+        anchor = pos;
+    }
+    if (anchor < size)
+    {
+        put_varint(out, size - anchor);
+        out.insert(out.end(), in.begin() + anchor, in.end());
+        put_varint(out, 0);
+    }
+}
+
+//Stops at the first thing that doesn't make sense, leaving whatever was decoded so far
+static void decompress_lz(const uint8_t* in, const uint8_t* end, vector<uint8_t>& out)
+{
+    while (in < end)
+    {
+        uint64_t literals = min(get_varint(in, end), (uint64_t)(end - in));
+        out.insert(out.end(), in, in + literals);
+        in += literals;
+        uint64_t length = get_varint(in, end);
+        if (!length)
+            continue;
+        uint64_t distance = get_varint(in, end);
+        if (!distance || distance > out.size())
+            return;
+        //Matches may overlap what they produce, so they're copied a byte at a time
+        uint64_t start = out.size() - distance;
+        for (uint64_t i = 0; i < length; i++)
+            out.push_back(out[start + i]);
+    }
+}
+
+Rewind_Buffer::Rewind_Buffer() : worker_exit(false), capture_pending(false), has_latest(false),
+    delta_bytes(0), memory_limit(0)
+{
+
+}
+
+Rewind_Buffer::~Rewind_Buffer()
+{
+    if (worker_thread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(worker_mutex);
+            worker_exit = true;
+        }
+        worker_cond.notify_all();
+        worker_thread.join();
+    }
+}
+
+void Rewind_Buffer::wait_for_worker(unique_lock<mutex>& lock)
+{
+    worker_cond.wait(lock, [this] { return !capture_pending; });
+}
+
+void Rewind_Buffer::reset(uint64_t memory_limit)
+{
+    unique_lock<mutex> lock(worker_mutex);
+    wait_for_worker(lock);
+    deltas.clear();
+    delta_bytes = 0;
+    has_latest = false;
+    this->memory_limit = memory_limit;
+}
+
+//The state belongs to the caller until end_capture, and is saved over the previous capture
+Save_State* Rewind_Buffer::begin_capture()
+{
+    unique_lock<mutex> lock(worker_mutex);
+    wait_for_worker(lock);
+    if (!worker_thread.joinable())
+        worker_thread = thread(&Rewind_Buffer::worker_loop, this);
+    return &capture;
+}
+
+void Rewind_Buffer::end_capture()
+{
+    lock_guard<mutex> lock(worker_mutex);
+    capture_pending = true;
+    worker_cond.notify_all();
+}
+
+void Rewind_Buffer::worker_loop()
+{
+    unique_lock<mutex> lock(worker_mutex);
+    while (true)
+    {
+        worker_cond.wait(lock, [this] { return capture_pending || worker_exit; });
+        if (worker_exit)
+            return;
+
+        lock.unlock();
+        bool has_delta = store_capture();
+        lock.lock();
+
+        if (has_delta)
+        {
+            deltas.push_back(vector<uint8_t>(encode_buffer.begin(), encode_buffer.end()));
+            delta_bytes += encode_buffer.size();
+            while (delta_bytes > memory_limit && deltas.size())
+            {
+                delta_bytes -= deltas.front().size();
+                deltas.pop_front();
+            }
+        }
+        capture_pending = false;
+        worker_cond.notify_all();
+    }
+}
+
+//Makes the capture the latest snapshot, encoding the way back to the old one into encode_buffer
+bool Rewind_Buffer::store_capture()
+{
+    const uint8_t* source = capture.get_data();
+    uint64_t new_size = capture.get_size();
+    if (!has_latest)
+    {
+        latest.set_size(new_size);
+        memcpy(latest.get_writable(), source, new_size);
+        has_latest = true;
+        return false;
+    }
+
+    encode_delta();
+
+    //Pages the capture didn't write since the last one are already in place
+    uint64_t old_size = latest.get_size();
+    latest.set_size(new_size);
+    uint8_t* dest = latest.get_writable();
+    for (uint64_t offset = 0; offset < new_size; offset += SAVE_STATE_PAGE_SIZE)
+    {
+        uint64_t end = min(offset + SAVE_STATE_PAGE_SIZE, new_size);
+        if (end > old_size || capture.page_changed(offset / SAVE_STATE_PAGE_SIZE))
+            memcpy(dest + offset, source + offset, end - offset);
+    }
+    return true;
+}
+
+//The delta starts with the old state's size and the sizes of the token and literal streams.
+//Tokens of (words to skip, words to XOR) follow, then the LZ-packed XOR words they take in order.
+void Rewind_Buffer::encode_delta()
+{
+    const uint8_t* old_data = latest.get_data();
+    const uint8_t* new_data = capture.get_data();
+    uint64_t old_size = latest.get_size();
+    uint64_t new_size = capture.get_size();
+    uint64_t min_size = min(old_size, new_size);
+    uint64_t max_size = max(old_size, new_size);
+
+    token_buffer.clear();
+    literal_buffer.clear();
+    uint64_t skip = 0;
+    vector<uint64_t> run;
+    for (uint64_t offset = 0; offset < max_size; offset += SAVE_STATE_PAGE_SIZE)
+    {
+        uint64_t end = min(offset + SAVE_STATE_PAGE_SIZE, max_size);
+        if (end <= min_size && !capture.page_changed(offset / SAVE_STATE_PAGE_SIZE))
+        {
+            flush_run(skip, run);
+            skip += (end - offset + 7) / 8;
+            continue;
+        }
+        for (uint64_t word = offset; word < end; word += 8)
+        {
+            uint64_t value = load_word(old_data, old_size, word) ^ load_word(new_data, new_size, word);
+            if (value)
+                run.push_back(value);
+            else
+            {
+                flush_run(skip, run);
+                skip++;
+            }
+        }
+    }
+    flush_run(skip, run);
+
+    encode_buffer.resize(sizeof(old_size));
+    memcpy(encode_buffer.data(), &old_size, sizeof(old_size));
+    put_varint(encode_buffer, token_buffer.size());
+    put_varint(encode_buffer, literal_buffer.size());
+    encode_buffer.insert(encode_buffer.end(), token_buffer.begin(), token_buffer.end());
+    compress_lz(literal_buffer, encode_buffer, match_table);
+}
+
+void Rewind_Buffer::flush_run(uint64_t& skip, vector<uint64_t>& run)
+{
+    if (!run.size())
+        return;
+    put_varint(token_buffer, skip);
+    put_varint(token_buffer, run.size());
+    uint64_t pos = literal_buffer.size();
+    literal_buffer.resize(pos + run.size() * 8);
+    memcpy(&literal_buffer[pos], run.data(), run.size() * 8);
+    skip = 0;
+    run.clear();
+}
+
+void Rewind_Buffer::apply_delta(Save_State& state, const vector<uint8_t>& delta)
+{
+    uint64_t old_size;
+    memcpy(&old_size, delta.data(), sizeof(old_size));
+    uint64_t work_size = (max(old_size, state.get_size()) + 7) & ~7ULL;
+    state.set_size(work_size);
+    uint8_t* data = state.get_writable();
+
+    const uint8_t* in = delta.data() + sizeof(old_size);
+    const uint8_t* delta_end = delta.data() + delta.size();
+    uint64_t token_size = get_varint(in, delta_end);
+    uint64_t literal_size = get_varint(in, delta_end);
+    token_size = min(token_size, (uint64_t)(delta_end - in));
+    const uint8_t* end = in + token_size;
+
+    decode_buffer.clear();
+    decode_buffer.reserve(literal_size);
+    decompress_lz(end, delta_end, decode_buffer);
+    const uint8_t* literal = decode_buffer.data();
+    const uint8_t* literal_end = literal + decode_buffer.size();
+
+    uint64_t offset = 0;
+    while (in < end)
+    {
+        offset += get_varint(in, end) * 8;
+        uint64_t words = get_varint(in, end);
+        for (uint64_t i = 0; i < words && offset + 8 <= work_size && literal + 8 <= literal_end; i++)
+        {
+            uint64_t value, change;
+            memcpy(&value, data + offset, 8);
+            memcpy(&change, literal, 8);
+            value ^= change;
+            memcpy(data + offset, &value, 8);
+            offset += 8;
+            literal += 8;
+        }
+    }
+    state.set_size(old_size);
+}
+
+//Steps the latest snapshot back to the one before it
+bool Rewind_Buffer::pop()
+{
+    unique_lock<mutex> lock(worker_mutex);
+    wait_for_worker(lock);
+    if (!deltas.size())
+        return false;
+    apply_delta(latest, deltas.back());
+    delta_bytes -= deltas.back().size();
+    deltas.pop_back();
+    return true;
+}
+
+Save_State* Rewind_Buffer::get_latest()
+{
+    unique_lock<mutex> lock(worker_mutex);
+    wait_for_worker(lock);
+    if (!has_latest)
+        return nullptr;
+    return &latest;
+}
+
+uint64_t Rewind_Buffer::get_memory_usage()
+{
+    lock_guard<mutex> lock(worker_mutex);
+    return delta_bytes + (has_latest ? latest.get_size() : 0);
+}
+
+int Rewind_Buffer::get_snapshot_count()
+{
+    lock_guard<mutex> lock(worker_mutex);
+    return deltas.size() + has_latest;
+}
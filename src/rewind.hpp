@@ -0,0 +1,62 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef rewind_hpp
+#define rewind_hpp
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "savestate.hpp"
+
+//Keeps the most recent snapshot whole, and every older one as the delta back from the snapshot after it.
+//A delta is the XOR of the two states, stored as runs of zero words to skip and literal words to apply,
+//with the literal words packed by a small LZ pass since redrawn framebuffers repeat a lot.
+//The emulator saves into the capture state, which only copies dirty pages, and the worker thread encodes it.
+class Rewind_Buffer
+{
+    private:
+        std::thread worker_thread;
+        std::mutex worker_mutex;
+        std::condition_variable worker_cond;
+        bool worker_exit;
+        bool capture_pending;
+
+        Save_State capture;
+        Save_State latest;
+        bool has_latest;
+
+        std::deque<std::vector<uint8_t>> deltas;
+        std::vector<uint8_t> encode_buffer, token_buffer, literal_buffer, decode_buffer;
+        std::vector<uint32_t> match_table;
+        uint64_t delta_bytes;
+        uint64_t memory_limit;
+
+        void worker_loop();
+        void wait_for_worker(std::unique_lock<std::mutex>& lock);
+        bool store_capture();
+        void encode_delta();
+        void flush_run(uint64_t& skip, std::vector<uint64_t>& run);
+        void apply_delta(Save_State& state, const std::vector<uint8_t>& delta);
+    public:
+        Rewind_Buffer();
+        ~Rewind_Buffer();
+
+        void reset(uint64_t memory_limit);
+
+        Save_State* begin_capture();
+        void end_capture();
+
+        bool pop();
+        Save_State* get_latest();
+
+        uint64_t get_memory_usage();
+        int get_snapshot_count();
+};
+
+#endif /* rewind_hpp */
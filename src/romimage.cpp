@@ -0,0 +1,231 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "romimage.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+ROM_Image::ROM_Image() : mapping(nullptr), size(0), use_counter(0)
+{
+
+}
+
+ROM_Image::~ROM_Image()
+{
+    close();
+}
+
+bool ROM_Image::open(const string& file_name)
+{
+    close();
+    if (open_mapped(file_name))
+        return true;
+    return open_cached(file_name);
+}
+
+void ROM_Image::close()
+{
+#ifdef ROM_MMAP
+    if (mapping)
+        munmap(mapping, size);
+#endif
+    mapping = nullptr;
+    size = 0;
+
+    if (file.is_open())
+        file.close();
+    pages.clear();
+    page_table.clear();
+    use_counter = 0;
+}
+
+bool ROM_Image::open_mapped(const string& file_name)
+{
+#ifdef ROM_MMAP
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size <= 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    //A private mapping lets patches to the ROM (the secure area) become copy-on-write pages
+    void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    //Cart reads stream through the ROM in blocks, so let the kernel read ahead
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    mapping = (uint8_t*)map;
+    size = info.st_size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ROM_Image::open_cached(const string& file_name)
+{
+    file.open(file_name, ios::in | ios::binary);
+    if (!file.is_open())
+        return false;
+
+    file.seekg(0, ios::end);
+    size = file.tellg();
+    return true;
+}
+
+uint8_t* ROM_Image::get_page(uint64_t index)
+{
+    use_counter++;
+    auto entry = page_table.find(index);
+    if (entry != page_table.end())
+    {
+        pages[entry->second].last_used = use_counter;
+        return pages[entry->second].data.get();
+    }
+
+    //Take a new slot while the cache is filling, then evict the least recently used page
+    int slot = -1;
+    if (pages.size() < ROM_CACHE_PAGES)
+    {
+        pages.emplace_back();
+        slot = pages.size() - 1;
+        pages[slot].data = unique_ptr<uint8_t[]>(new uint8_t[ROM_PAGE_SIZE]);
+    }
+    else
+    {
+        for (unsigned int i = 0; i < pages.size(); i++)
+        {
+            if (pages[i].pinned)
+                continue;
+            if (slot == -1 || pages[i].last_used < pages[slot].last_used)
+                slot = i;
+        }
+        if (slot == -1)
+        {
+            printf("\nROM page cache is full of patched pages");
+            exit(1);
+        }
+        page_table.erase(pages[slot].index);
+    }
+
+    ROM_Page& page = pages[slot];
+    page.index = index;
+    page.last_used = use_counter;
+    page.pinned = false;
+
+    uint64_t start = index * ROM_PAGE_SIZE;
+    uint64_t amount = min((uint64_t)ROM_PAGE_SIZE, size - start);
+    file.clear();
+    file.seekg(start);
+    file.read((char*)page.data.get(), amount);
+    if (amount < ROM_PAGE_SIZE)
+        memset(page.data.get() + amount, 0xFF, ROM_PAGE_SIZE - amount);
+
+    page_table[index] = slot;
+    return page.data.get();
+}
+
+//Reads past the end of the ROM return 0xFF
+void ROM_Image::read(uint64_t address, uint8_t* dest, uint64_t amount)
+{
+    if (address >= size)
+    {
+        memset(dest, 0xFF, amount);
+        return;
+    }
+    if (address + amount > size)
+    {
+        memset(dest + (size - address), 0xFF, address + amount - size);
+        amount = size - address;
+    }
+
+    if (mapping)
+    {
+        memcpy(dest, mapping + address, amount);
+        return;
+    }
+
+    while (amount)
+    {
+        uint64_t offset = address % ROM_PAGE_SIZE;
+        uint64_t chunk = min(amount, ROM_PAGE_SIZE - offset);
+        memcpy(dest, get_page(address / ROM_PAGE_SIZE) + offset, chunk);
+        address += chunk;
+        dest += chunk;
+        amount -= chunk;
+    }
+}
+
+uint8_t ROM_Image::read_byte(uint64_t address)
+{
+    if (mapping && address < size)
+        return mapping[address];
+    uint8_t value;
+    read(address, &value, 1);
+    return value;
+}
+
+uint16_t ROM_Image::read_halfword(uint64_t address)
+{
+    if (mapping && address + 2 <= size)
+        return *(uint16_t*)&mapping[address];
+    uint16_t value;
+    read(address, (uint8_t*)&value, 2);
+    return value;
+}
+
+uint32_t ROM_Image::read_word(uint64_t address)
+{
+    if (mapping && address + 4 <= size)
+        return *(uint32_t*)&mapping[address];
+    uint32_t value;
+    read(address, (uint8_t*)&value, 4);
+    return value;
+}
+
+//Returns a pointer for patching part of the ROM in memory. The file itself is never modified.
+//In the page cache, the range must not cross a page boundary.
+uint8_t* ROM_Image::get_writable(uint64_t address, uint64_t amount)
+{
+    if (address + amount > size)
+        return nullptr;
+
+#ifdef ROM_MMAP
+    if (mapping)
+    {
+        uint64_t start = address & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+        if (mprotect(mapping + start, address + amount - start, PROT_READ | PROT_WRITE))
+            return nullptr;
+        return mapping + address;
+    }
+#endif
+
+    uint64_t index = address / ROM_PAGE_SIZE;
+    if ((address + amount - 1) / ROM_PAGE_SIZE != index)
+        return nullptr;
+    uint8_t* page = get_page(index);
+    pages[page_table[index]].pinned = true;
+    return page + (address % ROM_PAGE_SIZE);
+}
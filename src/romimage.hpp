@@ -0,0 +1,71 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef romimage_hpp
+#define romimage_hpp
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define ROM_PAGE_SIZE (1024 * 64)
+#define ROM_CACHE_PAGES 64
+
+struct ROM_Page
+{
+    uint64_t index;
+    uint64_t last_used;
+    bool pinned; //Patched pages are never evicted
+    std::unique_ptr<uint8_t[]> data;
+};
+
+//Read-only view of a ROM file. The file is mapped into memory when the host allows it,
+//otherwise it is read in pages on demand and kept in a small LRU cache.
+class ROM_Image
+{
+    private:
+        uint8_t* mapping;
+        uint64_t size;
+
+        std::ifstream file;
+        std::vector<ROM_Page> pages;
+        std::unordered_map<uint64_t, int> page_table;
+        uint64_t use_counter;
+
+        bool open_mapped(const std::string& file_name);
+        bool open_cached(const std::string& file_name);
+        uint8_t* get_page(uint64_t index);
+    public:
+        ROM_Image();
+        ~ROM_Image();
+
+        bool open(const std::string& file_name);
+        void close();
+
+        uint64_t get_size();
+        bool is_mapped();
+
+        void read(uint64_t address, uint8_t* dest, uint64_t amount);
+        uint8_t read_byte(uint64_t address);
+        uint16_t read_halfword(uint64_t address);
+        uint32_t read_word(uint64_t address);
+
+        uint8_t* get_writable(uint64_t address, uint64_t amount);
+};
+
+inline uint64_t ROM_Image::get_size()
+{
+    return size;
+}
+
+inline bool ROM_Image::is_mapped()
+{
+    return mapping;
+}
+
+#endif /* romimage_hpp */
@@ -5,6 +5,7 @@
 */
 
 #include "rtc.hpp"
+#include "savestate.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
@@ -34,6 +35,31 @@ void RealTimeClock::init()
     stat2_reg = 0;
 }
 
+void RealTimeClock::do_state(Save_State& state)
+{
+    state.begin_chunk("RTC ", 1);
+    state.sync(stat1_reg);
+    state.sync(stat2_reg);
+    state.sync(year);
+    state.sync(month);
+    state.sync(day);
+    state.sync(day_of_week);
+    state.sync(hour);
+    state.sync(minute);
+    state.sync(second);
+    state.sync(alarm1);
+    state.sync(alarm2);
+    state.sync(io_reg);
+    state.sync(internal_output);
+    state.sync(command);
+    state.sync(input);
+    state.sync(input_bit_num);
+    state.sync(input_index);
+    state.sync(output_bit_num);
+    state.sync(output_index);
+    state.end_chunk();
+}
+
 void RealTimeClock::interpret_input()
 {
     //printf("\nRTC input: $%02X", input);
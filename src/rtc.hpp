@@ -13,6 +13,8 @@ struct Alarm
     uint8_t day_of_week, hour, minute;
 };
 
+class Save_State;
+
 class RealTimeClock
 {
     private:
@@ -34,6 +36,7 @@ class RealTimeClock
         int output_index;
     public:
         void init();
+        void do_state(Save_State& state);
         void interpret_input();
         uint16_t read();
         void write(uint16_t value, bool is_byte);
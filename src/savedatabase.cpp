@@ -0,0 +1,171 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+#include "savedatabase.hpp"
+
+using namespace std;
+
+Save_Database::Save_Database() : slot_count(0)
+{
+
+}
+
+void Save_Database::clear()
+{
+    slots.clear();
+    index_file.close();
+    slot_count = 0;
+}
+
+uint64_t Save_Database::hash_key(const uint8_t* key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 16; i++)
+    {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void Save_Database::get_slot(uint32_t slot, Save_DB_Entry& entry)
+{
+    if (slots.size())
+        entry = slots[slot];
+    else
+        index_file.read(sizeof(Save_DB_Index_Header) + (uint64_t)slot * sizeof(Save_DB_Entry),
+                        (uint8_t*)&entry, sizeof(Save_DB_Entry));
+}
+
+int Save_Database::load(const string& file_name)
+{
+    clear();
+    struct stat info;
+    if (stat(file_name.c_str(), &info))
+    {
+        printf("Failed to load save database.\n");
+        return 1;
+    }
+
+    uint64_t source_size = info.st_size;
+    uint64_t source_time = info.st_mtime;
+    if (source_size % 19)
+    {
+        printf("Save database corrupted or in wrong format.\n");
+        return 1;
+    }
+
+    string index_name = file_name + ".idx";
+    if (load_index(index_name, source_size, source_time))
+    {
+        printf("Save database index successfully loaded.\n");
+        return 0;
+    }
+
+    ifstream file(file_name, ios::binary | ios::in);
+    if (!file.is_open())
+    {
+        printf("Failed to load save database.\n");
+        return 1;
+    }
+    vector<uint8_t> records(source_size);
+    file.read((char*)records.data(), source_size);
+    file.close();
+
+    //Keep the table at most half full so that probes stay short
+    uint32_t record_count = source_size / 19;
+    slot_count = 16;
+    while (slot_count < record_count * 2)
+        slot_count <<= 1;
+    slots.assign(slot_count, Save_DB_Entry());
+
+    uint32_t entry_count = 0;
+    for (uint32_t i = 0; i < record_count; i++)
+    {
+        const uint8_t* record = &records[i * 19];
+        uint32_t slot = hash_key(record) & (slot_count - 1);
+        while (slots[slot].used && memcmp(slots[slot].key, record, 16))
+            slot = (slot + 1) & (slot_count - 1);
+
+        //Later records for the same header win, as they did when the database was scanned
+        if (!slots[slot].used)
+            entry_count++;
+        memcpy(slots[slot].key, record, 16);
+        slots[slot].size_index = record[18];
+        slots[slot].used = 1;
+    }
+
+    printf("Save database successfully loaded.\n");
+    write_index(index_name, source_size, source_time, entry_count);
+    return 0;
+}
+
+//Maps an index written by an earlier run, as long as it was built from the same database
+bool Save_Database::load_index(const string& index_name, uint64_t source_size, uint64_t source_time)
+{
+    if (!index_file.open(index_name))
+        return false;
+
+    Save_DB_Index_Header header;
+    index_file.read(0, (uint8_t*)&header, sizeof(header));
+    bool valid = !memcmp(header.magic, "CDSI", 4) && header.version == SAVE_DB_INDEX_VERSION &&
+            header.source_size == source_size && header.source_time == source_time &&
+            header.slot_count && !(header.slot_count & (header.slot_count - 1)) &&
+            index_file.get_size() == sizeof(header) + (uint64_t)header.slot_count * sizeof(Save_DB_Entry);
+    if (!valid)
+    {
+        index_file.close();
+        return false;
+    }
+
+    slot_count = header.slot_count;
+    return true;
+}
+
+void Save_Database::write_index(const string& index_name, uint64_t source_size, uint64_t source_time, uint32_t entry_count)
+{
+    Save_DB_Index_Header header;
+    memcpy(header.magic, "CDSI", 4);
+    header.version = SAVE_DB_INDEX_VERSION;
+    header.source_size = source_size;
+    header.source_time = source_time;
+    header.slot_count = slot_count;
+    header.entry_count = entry_count;
+
+    ofstream file(index_name, ios::binary | ios::out | ios::trunc);
+    if (!file.is_open())
+    {
+        printf("Unable to write save database index %s\n", index_name.c_str());
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)slots.data(), slots.size() * sizeof(Save_DB_Entry));
+}
+
+bool Save_Database::find(const uint8_t* header, int& size_index)
+{
+    if (!slot_count)
+        return false;
+
+    uint64_t hash = hash_key(header);
+    for (uint32_t i = 0; i < slot_count; i++)
+    {
+        Save_DB_Entry entry;
+        get_slot((hash + i) & (slot_count - 1), entry);
+        if (!entry.used)
+            return false;
+        if (!memcmp(entry.key, header, 16))
+        {
+            size_index = entry.size_index;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,57 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef savedatabase_hpp
+#define savedatabase_hpp
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "romimage.hpp"
+
+#define SAVE_DB_INDEX_VERSION 1
+
+//One slot of the hash table, keyed by the first 16 bytes of the cartridge header
+struct Save_DB_Entry
+{
+    uint8_t key[16];
+    uint8_t size_index;
+    uint8_t used;
+    uint8_t padding[2];
+};
+
+//Start of a precompiled index file. The slots follow directly after it.
+struct Save_DB_Index_Header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    uint64_t source_time;
+    uint32_t slot_count;
+    uint32_t entry_count;
+};
+
+//Save type database, loaded as an open-addressed hash table.
+//The table is written next to the database as <database>.idx, and later runs map it instead of parsing the database.
+class Save_Database
+{
+    private:
+        std::vector<Save_DB_Entry> slots;
+        ROM_Image index_file;
+        uint32_t slot_count;
+
+        static uint64_t hash_key(const uint8_t* key);
+        void get_slot(uint32_t slot, Save_DB_Entry& entry);
+        bool load_index(const std::string& index_name, uint64_t source_size, uint64_t source_time);
+        void write_index(const std::string& index_name, uint64_t source_size, uint64_t source_time, uint32_t entry_count);
+    public:
+        Save_Database();
+
+        int load(const std::string& file_name);
+        void clear();
+        bool find(const uint8_t* header, int& size_index);
+};
+
+#endif /* savedatabase_hpp */
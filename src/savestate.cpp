@@ -0,0 +1,308 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "guestmemory.hpp"
+#include "savestate.hpp"
+
+using namespace std;
+
+Save_State::Save_State() : size(0), pos(0), chunk_start(0), loading(false), failed(false),
+    memory_owner(nullptr), memory_gen(0), page_block_index(0)
+{
+
+}
+
+void Save_State::reserve(uint64_t amount)
+{
+    if (pos + amount > buffer.size())
+    {
+        buffer.resize(max(pos + amount, (uint64_t)buffer.size() * 2));
+        changed_pages.resize((buffer.size() + SAVE_STATE_PAGE_SIZE - 1) / SAVE_STATE_PAGE_SIZE, 0);
+    }
+}
+
+void Save_State::mark_changed(uint64_t start, uint64_t amount)
+{
+    if (!amount)
+        return;
+    uint64_t first = start / SAVE_STATE_PAGE_SIZE;
+    uint64_t last = (start + amount - 1) / SAVE_STATE_PAGE_SIZE;
+    memset(&changed_pages[first], 1, last - first + 1);
+}
+
+//Called whenever the buffer is changed outside of a save, so the next save copies everything
+void Save_State::invalidate()
+{
+    memory_gen = 0;
+    page_blocks.clear();
+}
+
+void Save_State::begin_save()
+{
+    loading = false;
+    failed = false;
+    pos = 0;
+    size = 0;
+    page_block_index = 0;
+    memset(changed_pages.data(), 0, changed_pages.size());
+
+    Save_State_Header header;
+    memcpy(header.magic, "CDSS", 4);
+    header.version = SAVE_STATE_VERSION;
+    header.size = 0;
+    sync(header);
+}
+
+//Checks the header and that every chunk lies inside the state before anything is restored
+bool Save_State::begin_load()
+{
+    loading = true;
+    failed = false;
+    pos = 0;
+
+    Save_State_Header header;
+    if (size < sizeof(header))
+    {
+        failed = true;
+        return false;
+    }
+    sync(header);
+    if (memcmp(header.magic, "CDSS", 4) || header.version > SAVE_STATE_VERSION || header.size != size)
+    {
+        failed = true;
+        return false;
+    }
+
+    uint64_t chunk_pos = pos;
+    while (chunk_pos < size)
+    {
+        Save_State_Chunk chunk;
+        if (size - chunk_pos < sizeof(chunk))
+        {
+            failed = true;
+            return false;
+        }
+        memcpy(&chunk, &buffer[chunk_pos], sizeof(chunk));
+        chunk_pos += sizeof(chunk);
+        if (chunk.size > size - chunk_pos)
+        {
+            failed = true;
+            return false;
+        }
+        chunk_pos += chunk.size;
+    }
+    return true;
+}
+
+void Save_State::finish()
+{
+    if (loading)
+        return;
+    size = pos;
+    uint64_t header_size = size;
+    memcpy(&buffer[offsetof(Save_State_Header, size)], &header_size, sizeof(header_size));
+}
+
+bool Save_State::begin_chunk(const char* tag, uint32_t version)
+{
+    chunk_start = pos;
+    Save_State_Chunk chunk;
+    if (!loading)
+    {
+        memcpy(chunk.tag, tag, 4);
+        chunk.version = version;
+        chunk.size = 0;
+        sync(chunk);
+        return true;
+    }
+
+    sync(chunk);
+    if (failed || memcmp(chunk.tag, tag, 4) || chunk.version > version)
+    {
+        if (!failed)
+            printf("Save state chunk %.4s doesn't match\n", tag);
+        failed = true;
+    }
+    return !failed;
+}
+
+//Fills in the chunk's size when saving, and makes sure the whole chunk was read when loading
+void Save_State::end_chunk()
+{
+    uint64_t chunk_size = pos - chunk_start - sizeof(Save_State_Chunk);
+    if (!loading)
+    {
+        memcpy(&buffer[chunk_start + offsetof(Save_State_Chunk, size)], &chunk_size, sizeof(chunk_size));
+        return;
+    }
+
+    if (failed)
+        return;
+    Save_State_Chunk chunk;
+    memcpy(&chunk, &buffer[chunk_start], sizeof(chunk));
+    if (chunk.size != chunk_size)
+    {
+        printf("Save state chunk %.4s has the wrong size\n", chunk.tag);
+        failed = true;
+    }
+}
+
+//How many bytes of the current chunk are left to read, so that sizes taken from a state can be checked before use
+uint64_t Save_State::get_chunk_remaining()
+{
+    if (!loading || failed)
+        return 0;
+    Save_State_Chunk chunk;
+    memcpy(&chunk, &buffer[chunk_start], sizeof(chunk));
+    uint64_t chunk_end = chunk_start + sizeof(Save_State_Chunk) + chunk.size;
+    if (chunk.size > size || chunk_end > size || chunk_end < pos)
+        return 0;
+    return chunk_end - pos;
+}
+
+void Save_State::sync_block(void* data, uint64_t amount)
+{
+    if (!loading)
+    {
+        reserve(amount);
+        memcpy(&buffer[pos], data, amount);
+        mark_changed(pos, amount);
+        pos += amount;
+        return;
+    }
+
+    if (failed || amount > size - pos)
+    {
+        failed = true;
+        return;
+    }
+    memcpy(data, &buffer[pos], amount);
+    pos += amount;
+}
+
+//Same as sync_block, but reports whether loading changed the data
+bool Save_State::sync_block_changed(void* data, uint64_t amount)
+{
+    if (!loading || failed || amount > size - pos)
+    {
+        sync_block(data, amount);
+        return false;
+    }
+    bool changed = memcmp(data, &buffer[pos], amount) != 0;
+    sync_block(data, amount);
+    return changed;
+}
+
+//Syncs a block of guest memory, copying only the pages stamped with a generation newer than since.
+//When saving, the other pages are still in the buffer from the last save, as long as the block is at the same place.
+//When loading, they haven't been written since this state was last saved or loaded, so they already match it.
+void Save_State::sync_pages(void* data, uint64_t amount, const uint32_t* page_gens, uint32_t since)
+{
+    uint8_t* source = (uint8_t*)data;
+    if (loading)
+    {
+        if (!since || failed || amount > size - pos)
+        {
+            sync_block(data, amount);
+            return;
+        }
+        for (uint64_t offset = 0; offset < amount; offset += GUEST_PAGE_SIZE)
+        {
+            if (page_gens[offset / GUEST_PAGE_SIZE] > since)
+                memcpy(source + offset, &buffer[pos + offset], min((uint64_t)GUEST_PAGE_SIZE, amount - offset));
+        }
+        pos += amount;
+        return;
+    }
+
+    bool same_place = since && page_block_index < page_blocks.size() && page_blocks[page_block_index] == pos;
+    if (page_block_index < page_blocks.size())
+        page_blocks[page_block_index] = pos;
+    else
+        page_blocks.push_back(pos);
+    page_block_index++;
+    if (!same_place)
+    {
+        sync_block(data, amount);
+        return;
+    }
+
+    for (uint64_t offset = 0; offset < amount; offset += GUEST_PAGE_SIZE)
+    {
+        if (page_gens[offset / GUEST_PAGE_SIZE] <= since)
+            continue;
+        uint64_t length = min((uint64_t)GUEST_PAGE_SIZE, amount - offset);
+        memcpy(&buffer[pos + offset], source + offset, length);
+        mark_changed(pos + offset, length);
+    }
+    pos += amount;
+}
+
+uint8_t* Save_State::get_writable()
+{
+    invalidate();
+    return buffer.data();
+}
+
+//Grows or shrinks the state. Bytes past the old size read as zero.
+void Save_State::set_size(uint64_t new_size)
+{
+    invalidate();
+    if (new_size > buffer.size())
+    {
+        buffer.resize(new_size);
+        changed_pages.resize((buffer.size() + SAVE_STATE_PAGE_SIZE - 1) / SAVE_STATE_PAGE_SIZE, 0);
+    }
+    if (new_size > size)
+        memset(&buffer[size], 0, new_size - size);
+    size = new_size;
+}
+
+int Save_State::read_file(const string& file_name)
+{
+    ifstream file(file_name, ios::binary | ios::in | ios::ate);
+    if (!file.is_open())
+    {
+        printf("Failed to open save state %s\n", file_name.c_str());
+        return 1;
+    }
+    invalidate();
+    size = file.tellg();
+    file.seekg(0, ios::beg);
+    if (buffer.size() < size)
+        buffer.resize(size);
+    file.read((char*)buffer.data(), size);
+    if (!file)
+    {
+        printf("Failed to read save state %s\n", file_name.c_str());
+        size = 0;
+        return 1;
+    }
+    return 0;
+}
+
+int Save_State::write_file(const string& file_name)
+{
+    ofstream file(file_name, ios::binary | ios::out | ios::trunc);
+    if (!file.is_open())
+    {
+        printf("Failed to write save state %s\n", file_name.c_str());
+        return 1;
+    }
+    file.write((const char*)buffer.data(), size);
+    file.close();
+    if (file.fail())
+    {
+        printf("Failed to write save state %s\n", file_name.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef savestate_hpp
+#define savestate_hpp
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <vector>
+
+#define SAVE_STATE_VERSION 1
+
+//Granularity at which a state records which parts of its buffer the last save wrote
+#define SAVE_STATE_PAGE_SIZE (1024 * 4)
+
+class Guest_Memory;
+
+struct Save_State_Header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+};
+
+//Every component's state is stored in its own chunk, so a mismatch is caught where it happens
+struct Save_State_Chunk
+{
+    char tag[4];
+    uint32_t version;
+    uint64_t size;
+};
+
+//Binary snapshot of the emulator. Components read and write their state through the same do_state function,
+//copying registers and memory as raw blocks. The buffer is kept between saves so that repeated states don't allocate,
+//and guest memory pages that weren't written since the last save into the same state are left in place.
+class Save_State
+{
+    private:
+        std::vector<uint8_t> buffer;
+        uint64_t size;
+        uint64_t pos;
+        uint64_t chunk_start;
+        bool loading;
+        bool failed;
+
+        //Dirty tracking: the guest memory and generation the buffer last matched, where each tracked block went,
+        //and which buffer pages the last save wrote
+        const Guest_Memory* memory_owner;
+        uint32_t memory_gen;
+        std::vector<uint64_t> page_blocks;
+        unsigned int page_block_index;
+        std::vector<uint8_t> changed_pages;
+
+        void reserve(uint64_t amount);
+        void mark_changed(uint64_t start, uint64_t amount);
+        void invalidate();
+    public:
+        Save_State();
+
+        void begin_save();
+        bool begin_load();
+        void finish();
+
+        bool is_loading();
+        bool has_failed();
+        void fail();
+        uint64_t get_size();
+
+        bool begin_chunk(const char* tag, uint32_t version);
+        void end_chunk();
+        uint64_t get_chunk_remaining();
+
+        void sync_block(void* data, uint64_t amount);
+        bool sync_block_changed(void* data, uint64_t amount);
+        void sync_pages(void* data, uint64_t amount, const uint32_t* page_gens, uint32_t since);
+        template <typename T> void sync(T& value);
+        template <typename T> void sync_vector(std::vector<T>& values);
+        template <typename T> void sync_queue(std::queue<T>& values);
+
+        uint32_t get_memory_gen(const Guest_Memory* memory);
+        void set_memory_gen(const Guest_Memory* memory, uint32_t gen);
+        bool page_changed(uint64_t page);
+
+        const uint8_t* get_data();
+        uint8_t* get_writable();
+        void set_size(uint64_t new_size);
+
+        int read_file(const std::string& file_name);
+        int write_file(const std::string& file_name);
+};
+
+inline bool Save_State::is_loading()
+{
+    return loading;
+}
+
+inline bool Save_State::has_failed()
+{
+    return failed;
+}
+
+inline void Save_State::fail()
+{
+    failed = true;
+}
+
+inline uint64_t Save_State::get_size()
+{
+    return size;
+}
+
+//Generations only mean something to the memory that handed them out
+inline uint32_t Save_State::get_memory_gen(const Guest_Memory* memory)
+{
+    if (memory != memory_owner)
+        return 0;
+    return memory_gen;
+}
+
+inline void Save_State::set_memory_gen(const Guest_Memory* memory, uint32_t gen)
+{
+    memory_owner = memory;
+    memory_gen = gen;
+}
+
+inline bool Save_State::page_changed(uint64_t page)
+{
+    return page < changed_pages.size() && changed_pages[page];
+}
+
+inline const uint8_t* Save_State::get_data()
+{
+    return buffer.data();
+}
+
+template <typename T>
+inline void Save_State::sync(T& value)
+{
+    sync_block(&value, sizeof(T));
+}
+
+template <typename T>
+void Save_State::sync_vector(std::vector<T>& values)
+{
+    uint64_t count = values.size();
+    sync(count);
+    if (loading)
+    {
+        if (failed || count * sizeof(T) > size - pos)
+        {
+            failed = true;
+            return;
+        }
+        values.resize(count);
+    }
+    if (count)
+        sync_block(values.data(), count * sizeof(T));
+}
+
+template <typename T>
+void Save_State::sync_queue(std::queue<T>& values)
+{
+    std::vector<T> items;
+    if (!loading)
+    {
+        std::queue<T> copy = values;
+        while (copy.size())
+        {
+            items.push_back(copy.front());
+            copy.pop();
+        }
+    }
+    sync_vector(items);
+    if (loading && !failed)
+    {
+        values = std::queue<T>();
+        for (unsigned int i = 0; i < items.size(); i++)
+            values.push(items[i]);
+    }
+}
+
+#endif /* savestate_hpp */
@@ -0,0 +1,121 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "savewriter.hpp"
+
+using namespace std;
+
+Save_Writer::Save_Writer() : writer_exit(false), pending(false), writing(false), flush_requested(false)
+{
+
+}
+
+Save_Writer::~Save_Writer()
+{
+    if (writer_thread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(writer_mutex);
+            writer_exit = true;
+        }
+        writer_cond.notify_all();
+        writer_thread.join();
+    }
+}
+
+//Copies the range [start, end) of the save into the writer's image.
+//The whole save is copied when the file or the save size changes.
+void Save_Writer::update(const string& name, const uint8_t* save, uint32_t size, uint32_t start, uint32_t end)
+{
+    lock_guard<mutex> lock(writer_mutex);
+    if (!writer_thread.joinable())
+        writer_thread = thread(&Save_Writer::writer_loop, this);
+
+    if (name != file_name || size != image.size())
+    {
+        file_name = name;
+        image.assign(save, save + size);
+    }
+    else if (start < end)
+        memcpy(&image[start], save + start, end - start);
+
+    pending = true;
+    last_update = chrono::steady_clock::now();
+    writer_cond.notify_all();
+}
+
+//Blocks until every update has been written
+void Save_Writer::flush()
+{
+    unique_lock<mutex> lock(writer_mutex);
+    if (!pending && !writing)
+        return;
+    flush_requested = true;
+    writer_cond.notify_all();
+    writer_cond.wait(lock, [this] { return !pending && !writing; });
+    flush_requested = false;
+}
+
+void Save_Writer::writer_loop()
+{
+    unique_lock<mutex> lock(writer_mutex);
+    while (true)
+    {
+        chrono::steady_clock::time_point deadline = last_update + chrono::milliseconds(SAVE_WRITE_DELAY_MS);
+        if (pending && (writer_exit || flush_requested || chrono::steady_clock::now() >= deadline))
+        {
+            //The image keeps taking updates while the copy is on disk
+            vector<uint8_t> data = image;
+            string name = file_name;
+            pending = false;
+            writing = true;
+            lock.unlock();
+            write_file(name, data);
+            lock.lock();
+            writing = false;
+            writer_cond.notify_all();
+            continue;
+        }
+        if (writer_exit)
+            return;
+
+        if (pending)
+            writer_cond.wait_until(lock, deadline);
+        else
+            writer_cond.wait(lock);
+    }
+}
+
+//Writes to a temporary file first, so a crash mid-write never leaves a truncated save
+void Save_Writer::write_file(const string& name, const vector<uint8_t>& data)
+{
+    string temp_name = name + ".tmp";
+    ofstream save_file(temp_name, ios::binary | ios::out | ios::trunc);
+    if (!save_file.is_open())
+    {
+        printf("\nFailed to write %s", temp_name.c_str());
+        return;
+    }
+    save_file.write((const char*)data.data(), data.size());
+    save_file.close();
+    if (save_file.fail())
+    {
+        printf("\nFailed to write %s", temp_name.c_str());
+        remove(temp_name.c_str());
+        return;
+    }
+
+    //rename won't replace an existing file on every host
+    if (rename(temp_name.c_str(), name.c_str()))
+    {
+        remove(name.c_str());
+        if (rename(temp_name.c_str(), name.c_str()))
+            printf("\nFailed to replace %s", name.c_str());
+    }
+}
@@ -0,0 +1,48 @@
+/*
+    CorgiDS Copyright PSISP 2017
+    Licensed under the GPLv3
+    See LICENSE.txt for details
+*/
+
+#ifndef savewriter_hpp
+#define savewriter_hpp
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//How long a save must go without changes before it is written out
+#define SAVE_WRITE_DELAY_MS 500
+
+//Writes save files from a background thread.
+//The emulator hands over only the bytes that changed, and the file is written once the game stops saving,
+//to a temporary file that then replaces the old one.
+class Save_Writer
+{
+    private:
+        std::thread writer_thread;
+        std::mutex writer_mutex;
+        std::condition_variable writer_cond;
+        bool writer_exit;
+
+        std::string file_name;
+        std::vector<uint8_t> image;
+        bool pending;
+        bool writing;
+        bool flush_requested;
+        std::chrono::steady_clock::time_point last_update;
+
+        void writer_loop();
+        static void write_file(const std::string& name, const std::vector<uint8_t>& data);
+    public:
+        Save_Writer();
+        ~Save_Writer();
+
+        void update(const std::string& name, const uint8_t* save, uint32_t size, uint32_t start, uint32_t end);
+        void flush();
+};
+
+#endif /* savewriter_hpp */
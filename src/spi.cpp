@@ -7,6 +7,7 @@
 #include <cstdlib>
 #include "emulator.hpp"
 #include "spi.hpp"
+#include "savestate.hpp"
 
 SPI_Bus::SPI_Bus(Emulator* e) : e(e), firmware(e) {}
 
@@ -36,6 +37,17 @@ void SPI_Bus::direct_boot()
     firmware.direct_boot();
 }
 
+void SPI_Bus::do_state(Save_State& state)
+{
+    state.begin_chunk("SPI ", 1);
+    state.sync(SPICNT);
+    state.sync(output);
+    state.end_chunk();
+
+    firmware.do_state(state);
+    touchscreen.do_state(state);
+}
+
 void SPI_Bus::touchscreen_press(int x, int y)
 {
     touchscreen.press_event(x, y);
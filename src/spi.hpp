@@ -21,6 +21,7 @@ struct REG_SPICNT
 };
 
 class Emulator;
+class Save_State;
 
 class SPI_Bus
 {
@@ -36,6 +37,8 @@ class SPI_Bus
         int init(std::string firmware_path);
         void init(uint8_t* firmware);
         void direct_boot();
+        void do_state(Save_State& state);
+        const uint8_t* get_firmware();
 
         void touchscreen_press(int x, int y);
     
@@ -46,4 +49,9 @@ class SPI_Bus
         void set_SPICNT(uint16_t value);
 };
 
+inline const uint8_t* SPI_Bus::get_firmware()
+{
+    return firmware.get_image();
+}
+
 #endif /* spi_hpp */
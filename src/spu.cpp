@@ -6,6 +6,7 @@
 
 #include <cstdlib>
 #include "spu.hpp"
+#include "savestate.hpp"
 
 void SPU::power_on()
 {
@@ -18,6 +19,17 @@ void SPU::power_on()
     SOUNDBIAS = 0x200;
 }
 
+void SPU::do_state(Save_State& state)
+{
+    state.begin_chunk("SPU ", 1);
+    state.sync(channels);
+    state.sync(SOUNDCNT);
+    state.sync(SNDCAP0);
+    state.sync(SNDCAP1);
+    state.sync(SOUNDBIAS);
+    state.end_chunk();
+}
+
 uint8_t SPU::read_channel_byte(uint32_t address)
 {
     address -= 0x04000400;
@@ -51,6 +51,8 @@ struct SNDCAPTURE
     uint16_t len;
 };
 
+class Save_State;
+
 class SPU
 {
     private:
@@ -60,6 +62,7 @@ class SPU
         uint16_t SOUNDBIAS;
     public:
         void power_on();
+        void do_state(Save_State& state);
 
         uint8_t read_channel_byte(uint32_t address);
         uint16_t get_SOUNDCNT();
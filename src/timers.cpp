@@ -8,6 +8,7 @@
 #include <cstdio>
 #include <cmath>
 #include "emulator.hpp"
+#include "savestate.hpp"
 #include "timers.hpp"
 
 NDS_Timing::NDS_Timing(Emulator* e) : e(e)
@@ -58,6 +59,14 @@ void NDS_Timing::power_on()
     }
 }
 
+void NDS_Timing::do_state(Save_State& state)
+{
+    state.begin_chunk("TIMR", 1);
+    state.sync(timer_clock_divs);
+    state.sync(timers);
+    state.end_chunk();
+}
+
 void NDS_Timing::run_timers7(int cycles)
 {
     if (timers[0].enabled)
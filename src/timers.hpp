@@ -31,6 +31,7 @@ struct TimerReg
 };
 
 class Emulator;
+class Save_State;
 
 class NDS_Timing
 {
@@ -43,6 +44,7 @@ class NDS_Timing
     public:
         NDS_Timing(Emulator* e);
         void power_on();
+        void do_state(Save_State& state);
         void run_timers9(int cycles);
         void run_timers7(int cycles);
         void run_timer(int cycles, int index);
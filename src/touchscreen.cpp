@@ -6,6 +6,7 @@
 
 #include <cstdio>
 #include "touchscreen.hpp"
+#include "savestate.hpp"
 
 TouchScreen::TouchScreen()
 {
@@ -27,6 +28,17 @@ void TouchScreen::power_on()
     press_y = 0xFFF;
 }
 
+void TouchScreen::do_state(Save_State& state)
+{
+    state.begin_chunk("TSC ", 1);
+    state.sync(control_byte);
+    state.sync(output_coords);
+    state.sync(data_pos);
+    state.sync(press_x);
+    state.sync(press_y);
+    state.end_chunk();
+}
+
 void TouchScreen::press_event(int x, int y)
 {
     press_x = x;
@@ -8,6 +8,8 @@
 #define TOUCHSCREEN_HPP
 #include <cstdint>
 
+class Save_State;
+
 class TouchScreen
 {
     private:
@@ -19,6 +21,7 @@ class TouchScreen
     public:
         TouchScreen();
         void power_on();
+        void do_state(Save_State& state);
 
         void press_event(int x, int y);
 
@@ -5,6 +5,7 @@
 */
 
 #include "wifi.hpp"
+#include "savestate.hpp"
 
 //All of this is very much TODO
 void WiFi::set_W_POWER_US(uint16_t value)
@@ -12,6 +13,18 @@ void WiFi::set_W_POWER_US(uint16_t value)
     W_POWER_US = value;
 }
 
+void WiFi::do_state(Save_State& state)
+{
+    state.begin_chunk("WIFI", 1);
+    state.sync(W_POWER_US);
+    state.sync(W_BB_WRITE);
+    state.sync(W_BB_READ);
+    state.sync(W_BB_MODE);
+    state.sync(W_BB_POWER);
+    state.sync(W_RF_CNT);
+    state.end_chunk();
+}
+
 void WiFi::BB_READ(int index)
 {
     switch (index)
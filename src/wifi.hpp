@@ -8,6 +8,8 @@
 #define WIFI_HPP
 #include <cstdint>
 
+class Save_State;
+
 //This will just be a stub for now
 //Maybe wifi emulation in the future? who knows
 class WiFi
@@ -23,6 +25,8 @@ class WiFi
         void BB_READ(int index);
         void BB_WRITE(int index);
     public:
+        void do_state(Save_State& state);
+
         void set_W_POWER_US(uint16_t value);
         void set_W_BB_CNT(uint16_t value);
         void set_W_BB_WRITE(uint16_t value);